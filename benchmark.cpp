@@ -0,0 +1,672 @@
+// Microbenchmark suite for the simulation core. Every case is timed with a
+// small self-calibrating harness (no external benchmark library needed) and
+// the results can be written as JSON in the layout Google Benchmark uses, so
+// its compare tooling works on two runs from different releases.
+#define SDL_MAIN_HANDLED
+#include "physics_sim.h"
+
+#include <ctime>
+#include <iomanip>
+#include <new>
+
+// Heap allocation counter. Every operator new of the process comes through
+// here (the array and nothrow forms default to these), so a case can report
+// how often one iteration allocates. The sized deletes are defined as well,
+// since the compiler calls them directly once the plain ones are replaced.
+// None of them may be inlined: GCC would then see new-expressions paired with
+// free() and warn about mismatched allocation functions.
+#if defined(__GNUC__) || defined(__clang__)
+#define BENCH_NOINLINE __attribute__((noinline))
+#elif defined(_MSC_VER)
+#define BENCH_NOINLINE __declspec(noinline)
+#else
+#define BENCH_NOINLINE
+#endif
+
+static std::atomic<long long> allocationCount(0);
+
+BENCH_NOINLINE void* operator new(std::size_t size) {
+    allocationCount.fetch_add(1, std::memory_order_relaxed);
+    if (void* block = std::malloc(size ? size : 1)) return block;
+    throw std::bad_alloc();
+}
+
+BENCH_NOINLINE void operator delete(void* block) noexcept {
+    std::free(block);
+}
+
+BENCH_NOINLINE void operator delete(void* block, std::size_t) noexcept {
+    std::free(block);
+}
+
+BENCH_NOINLINE void* operator new(std::size_t size, std::align_val_t alignment) {
+    allocationCount.fetch_add(1, std::memory_order_relaxed);
+    size_t align = (size_t)alignment;
+#ifdef _WIN32
+    void* block = _aligned_malloc(size ? size : 1, align);
+#else
+    void* block = std::aligned_alloc(align, (std::max<size_t>(size, 1) + align - 1) / align * align);
+#endif
+    if (block) return block;
+    throw std::bad_alloc();
+}
+
+BENCH_NOINLINE void operator delete(void* block, std::align_val_t) noexcept {
+#ifdef _WIN32
+    _aligned_free(block);
+#else
+    std::free(block);
+#endif
+}
+
+BENCH_NOINLINE void operator delete(void* block, std::size_t, std::align_val_t alignment) noexcept {
+    operator delete(block, alignment);
+}
+
+// Keeps the compiler from discarding a result that is never used otherwise
+template <typename Value>
+inline void keep(const Value& value) {
+#if defined(__GNUC__) || defined(__clang__)
+    asm volatile("" : : "g"(&value) : "memory");
+#else
+    static volatile const void* sink;
+    sink = &value;
+#endif
+}
+
+// Swallows the simulation's console output while a case is being set up
+class NullBuffer : public std::streambuf {
+protected:
+    int overflow(int c) override {
+        return c;
+    }
+};
+
+class SilentConsole {
+private:
+    NullBuffer buffer;
+    std::streambuf* saved;
+    
+public:
+    SilentConsole() : saved(std::cout.rdbuf(&buffer)) {}
+    ~SilentConsole() { std::cout.rdbuf(saved); }
+};
+
+struct BenchmarkResult {
+    std::string name;
+    long long balls;
+    long long iterations;
+    double realNanoseconds;     // Per iteration
+    double cpuNanoseconds;      // Per iteration, all threads of the process
+    double itemsPerSecond;
+    double allocations;         // Heap allocations per iteration
+    bool steadyState;           // A simulation step, expected not to allocate
+};
+
+struct BenchmarkOptions {
+    std::vector<int> sizes;
+    std::string filter;
+    std::string jsonPath;
+    double minTime;
+    int threads;
+    unsigned int seed;
+    std::string precision;      // double, float or both
+    
+    BenchmarkOptions()
+        : sizes({1000, 10000, 100000, 1000000}), minTime(0.5),
+          threads(std::max(1u, std::thread::hardware_concurrency())), seed(1), precision("double") {}
+};
+
+// Runs a case until it has taken at least minTime, then reports the last run.
+// One iteration processes `items` items (balls, pairs, vectors ...).
+class BenchmarkRunner {
+private:
+    const BenchmarkOptions& options;
+    std::vector<BenchmarkResult> results;
+    
+public:
+    explicit BenchmarkRunner(const BenchmarkOptions& benchmarkOptions) : options(benchmarkOptions) {}
+    
+    bool selected(const std::string& name) const {
+        return options.filter.empty() || name.find(options.filter) != std::string::npos;
+    }
+    
+    // steadyState marks a simulation step: it is warmed up for minTime first,
+    // so every pool has grown to its working size, and must not allocate after
+    void run(const std::string& name, long long balls, long long items, const std::function<void()>& iteration,
+             bool steadyState = false) {
+        if (!selected(name)) return;
+        
+        // One untimed call to warm caches and let lazy state (schedules, sort orders) settle
+        iteration();
+        if (steadyState) {
+            auto warmStart = std::chrono::steady_clock::now();
+            while (std::chrono::duration<double>(std::chrono::steady_clock::now() - warmStart).count() < options.minTime) {
+                iteration();
+            }
+        }
+        
+        long long iterations = 1;
+        long long allocations = 0;
+        double seconds = 0, cpuSeconds = 0;
+        while (true) {
+            long long allocationsBefore = allocationCount.load();
+            std::clock_t cpuStart = std::clock();
+            auto start = std::chrono::steady_clock::now();
+            for (long long k = 0; k < iterations; k++) iteration();
+            seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            cpuSeconds = (double)(std::clock() - cpuStart) / CLOCKS_PER_SEC;
+            allocations = allocationCount.load() - allocationsBefore;
+            if (seconds >= options.minTime || iterations >= (1LL << 40)) break;
+            
+            // Aim a little past the target instead of doubling blindly
+            double scale = seconds > 0 ? options.minTime * 1.2 / seconds : 10;
+            iterations = std::max(iterations + 1, (long long)(iterations * std::min(scale, 10.0)));
+        }
+        
+        BenchmarkResult result;
+        result.name = name;
+        result.balls = balls;
+        result.iterations = iterations;
+        result.realNanoseconds = seconds * 1e9 / iterations;
+        result.cpuNanoseconds = cpuSeconds * 1e9 / iterations;
+        result.itemsPerSecond = seconds > 0 ? (double)items * iterations / seconds : 0;
+        result.allocations = (double)allocations / iterations;
+        result.steadyState = steadyState;
+        results.push_back(result);
+        
+        std::cout << std::left << std::setw(44) << name << std::right
+                  << std::setw(14) << std::fixed << std::setprecision(1) << result.realNanoseconds << " ns"
+                  << std::setw(14) << std::setprecision(2) << result.realNanoseconds / std::max(1LL, items) << " ns/item"
+                  << std::setw(12) << iterations << " iterations"
+                  << std::setw(10) << result.allocations << " allocs" << std::endl;
+        std::cout.unsetf(std::ios::floatfield);
+    }
+    
+    // Reports the steps that still allocated once warm. Every step allocating
+    // is a failure; a few allocations over the whole run are a pool reaching
+    // a new high-water mark and only warned about.
+    bool checkAllocations() const {
+        bool checked = false, allocated = false, clean = true;
+        for (const BenchmarkResult& result : results) {
+            if (!result.steadyState) continue;
+            checked = true;
+            if (result.allocations == 0) continue;
+            bool failed = result.allocations >= 1;
+            allocated = true;
+            clean = clean && !failed;
+            std::cout << (failed ? "❌ " : "⚠️  ") << result.name << " allocates "
+                      << result.allocations << " times per step" << std::endl;
+        }
+        if (checked && !allocated) std::cout << "✅ Steady-state steps do not allocate" << std::endl;
+        else if (checked && clean) std::cout << "   (occasional only: pools reaching a new high-water mark)" << std::endl;
+        return clean;
+    }
+    
+    static std::string escape(const std::string& text) {
+        std::string out;
+        for (char c : text) {
+            if (c == '"' || c == '\\') out += '\\';
+            out += c;
+        }
+        return out;
+    }
+    
+    bool writeJson(const std::string& path, const std::string& kernels) const {
+        std::ofstream out(path);
+        if (!out) return false;
+        
+        std::time_t now = std::time(nullptr);
+        char date[32];
+        std::strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", std::localtime(&now));
+        
+        out << "{\n  \"context\": {\n"
+            << "    \"date\": \"" << date << "\",\n"
+            << "    \"num_cpus\": " << std::thread::hardware_concurrency() << ",\n"
+            << "    \"threads\": " << options.threads << ",\n"
+            << "    \"step_kernels\": \"" << escape(kernels) << "\",\n"
+            << "    \"min_time\": " << options.minTime << ",\n"
+            << "    \"seed\": " << options.seed << "\n"
+            << "  },\n  \"benchmarks\": [";
+        out << std::setprecision(10);
+        for (size_t k = 0; k < results.size(); k++) {
+            const BenchmarkResult& result = results[k];
+            out << (k ? ",\n" : "\n")
+                << "    {\"name\": \"" << escape(result.name) << "\", \"run_name\": \"" << escape(result.name)
+                << "\", \"run_type\": \"iteration\", \"balls\": " << result.balls
+                << ", \"iterations\": " << result.iterations
+                << ", \"real_time\": " << result.realNanoseconds
+                << ", \"cpu_time\": " << result.cpuNanoseconds
+                << ", \"time_unit\": \"ns\", \"items_per_second\": " << result.itemsPerSecond
+                << ", \"allocations_per_iteration\": " << result.allocations << "}";
+        }
+        out << "\n  ]\n}\n";
+        return (bool)out;
+    }
+};
+
+// World that keeps the same ball density for every N (about 200 px^2 per ball
+// at a 16:9 aspect), so costs scale with N rather than with crowding
+void benchmarkWorld(int balls, int& width, int& height) {
+    const double AREA_PER_BALL = 200.0;
+    width = std::max(200, (int)std::sqrt(balls * AREA_PER_BALL * 16 / 9));
+    height = std::max(200, width * 9 / 16);
+}
+
+const double BENCH_MIN_RADIUS = 1;
+const double BENCH_MAX_RADIUS = 3;
+const double BENCH_DT = 1.0 / 60.0;
+
+template <typename T>
+BallStore<T> benchmarkScene(const BenchmarkOptions& options, int balls, int width, int height) {
+    BallStore<T> store;
+    store.resize(balls);
+    SceneGenerator(options.seed, 0, balls, BENCH_MIN_RADIUS, BENCH_MAX_RADIUS, width, height).fill(store, 0, balls);
+    return store;
+}
+
+// Neighbouring pairs of a scene, the candidates a real narrow phase sees
+template <typename T>
+void candidatePairs(const BallStore<T>& balls, int width, int height,
+                    std::vector<std::pair<int, int>>& pairs) {
+    UniformGrid grid;
+    grid.build(balls, 2 * BENCH_MAX_RADIUS, width, height);
+    std::vector<int> neighbours;
+    for (size_t i = 0; i < balls.size(); i++) {
+        grid.gatherNeighbours((int)i, neighbours);
+        for (int j : neighbours) pairs.push_back({(int)i, j});
+    }
+}
+
+template <typename T>
+void benchmarkVectors(BenchmarkRunner& runner, const std::string& prefix) {
+    const int COUNT = 4096;
+    std::vector<Vector2D<T>> a(COUNT), b(COUNT), out(COUNT);
+    CounterRng rng(7, 0);
+    for (int i = 0; i < COUNT; i++) {
+        a[i] = Vector2D<T>(T(rng.uniform(-100.0, 100.0)), T(rng.uniform(-100.0, 100.0)));
+        b[i] = Vector2D<T>(T(rng.uniform(-100.0, 100.0)), T(rng.uniform(-100.0, 100.0)));
+    }
+    
+    runner.run(prefix + "Vector2D/add", 0, COUNT, [&] {
+        for (int i = 0; i < COUNT; i++) out[i] = a[i] + b[i];
+        keep(out);
+    });
+    runner.run(prefix + "Vector2D/scale", 0, COUNT, [&] {
+        for (int i = 0; i < COUNT; i++) out[i] = a[i] * T(0.5);
+        keep(out);
+    });
+    runner.run(prefix + "Vector2D/dot", 0, COUNT, [&] {
+        T sum = 0;
+        for (int i = 0; i < COUNT; i++) sum += a[i].dot(b[i]);
+        keep(sum);
+    });
+    runner.run(prefix + "Vector2D/length", 0, COUNT, [&] {
+        T sum = 0;
+        for (int i = 0; i < COUNT; i++) sum += a[i].length();
+        keep(sum);
+    });
+    runner.run(prefix + "Vector2D/normalize", 0, COUNT, [&] {
+        for (int i = 0; i < COUNT; i++) out[i] = a[i].normalize();
+        keep(out);
+    });
+}
+
+// Pair tests and responses of the Ball view and of BallStore, on the candidate
+// pairs of a 10k scene. The responses restore both balls before every pair so
+// each call does the full push-out and impulse, and that restore is included.
+template <typename T>
+void benchmarkNarrowPhase(BenchmarkRunner& runner, const BenchmarkOptions& options, const std::string& prefix) {
+    const int BALLS = 10000;
+    int width, height;
+    benchmarkWorld(BALLS, width, height);
+    BallStore<T> store = benchmarkScene<T>(options, BALLS, width, height);
+    std::vector<std::pair<int, int>> pairs;
+    candidatePairs(store, width, height, pairs);
+    
+    // Colliding pairs, moved into contact and set approaching
+    std::vector<std::pair<int, int>> contacts;
+    BallStore<T> touching = store;
+    for (size_t k = 0; k < pairs.size() && contacts.size() < 4096; k++) {
+        int i = pairs[k].first, j = pairs[k].second;
+        if (std::find_if(contacts.begin(), contacts.end(), [&](const std::pair<int, int>& c) {
+                return c.first == i || c.second == i || c.first == j || c.second == j; }) != contacts.end()) continue;
+        touching.x[j] = touching.x[i] + (touching.r[i] + touching.r[j]) * T(0.9);
+        touching.y[j] = touching.y[i];
+        touching.vx[i] = std::abs(touching.vx[i]);
+        touching.vx[j] = -std::abs(touching.vx[j]);
+        contacts.push_back({i, j});
+    }
+    
+    std::vector<Ball<T>> ballView;
+    for (size_t i = 0; i < store.size(); i++) ballView.push_back(store.get(i));
+    std::vector<Ball<T>> touchingView;
+    for (size_t i = 0; i < touching.size(); i++) touchingView.push_back(touching.get(i));
+    
+    const long long pairCount = (long long)pairs.size();
+    runner.run(prefix + "Ball/isCollidingWith", 0, pairCount, [&] {
+        long long hits = 0;
+        for (const std::pair<int, int>& pair : pairs) {
+            hits += ballView[pair.first].isCollidingWith(ballView[pair.second]);
+        }
+        keep(hits);
+    });
+    runner.run(prefix + "BallStore/isColliding", 0, pairCount, [&] {
+        long long hits = 0;
+        for (const std::pair<int, int>& pair : pairs) hits += store.isColliding(pair.first, pair.second);
+        keep(hits);
+    });
+    
+    const long long contactCount = (long long)contacts.size();
+    std::vector<Ball<T>> scratch = touchingView;
+    runner.run(prefix + "Ball/resolveCollision", 0, contactCount, [&] {
+        for (const std::pair<int, int>& contact : contacts) {
+            Ball<T>& a = scratch[contact.first];
+            Ball<T>& b = scratch[contact.second];
+            a = touchingView[contact.first];
+            b = touchingView[contact.second];
+            a.resolveCollision(b);
+        }
+        keep(scratch);
+    });
+    
+    BallStore<T> working = touching;
+    runner.run(prefix + "BallStore/resolveCollision", 0, contactCount, [&] {
+        for (const std::pair<int, int>& contact : contacts) {
+            for (int i : {contact.first, contact.second}) {
+                working.x[i] = touching.x[i];
+                working.y[i] = touching.y[i];
+                working.vx[i] = touching.vx[i];
+                working.vy[i] = touching.vy[i];
+            }
+            working.resolveCollision(contact.first, contact.second);
+        }
+        keep(working.vx);
+    });
+}
+
+// Per-N cases: the integrate/bounce pass, each broad phase on its own, and a
+// full update() in every mode
+template <typename T>
+void benchmarkScale(BenchmarkRunner& runner, const BenchmarkOptions& options, const std::string& prefix, int balls) {
+    int width, height;
+    benchmarkWorld(balls, width, height);
+    const std::string suffix = "/" + std::to_string(balls);
+    BallStore<T> store = benchmarkScene<T>(options, balls, width, height);
+    
+    for (bool simd : {false, true}) {
+        StepKernels<T> kernels = StepKernels<T>::detect(simd);
+        if (simd && std::string(kernels.name) == "scalar") continue;
+        BallStore<T> moving = store;
+        MotionStats motion;
+        runner.run(prefix + "integrate_bounce/" + kernels.name + suffix, balls, balls, [&] {
+            moving.integrate(kernels, T(BENCH_DT), 0, moving.size());
+            moving.bounceOffWalls(kernels, width, height, 0, moving.size(), motion);
+        });
+    }
+    
+    UniformGrid grid;
+    std::vector<int> neighbours;
+    runner.run(prefix + "broadphase/grid" + suffix, balls, balls, [&] {
+        grid.build(store, 2 * BENCH_MAX_RADIUS, width, height);
+        long long candidates = 0;
+        for (size_t i = 0; i < store.size(); i++) {
+            grid.gatherNeighbours((int)i, neighbours);
+            candidates += neighbours.size();
+        }
+        keep(candidates);
+    });
+    
+    // Alternate between two consecutive steps so the incremental sort has real,
+    // small motion to follow
+    BallStore<T> swept = store;
+    BallStore<T> next = store;
+    StepKernels<T> kernels = StepKernels<T>::detect();
+    MotionStats motion;
+    next.integrate(kernels, T(BENCH_DT), 0, next.size());
+    next.bounceOffWalls(kernels, width, height, 0, next.size(), motion);
+    SweepAndPrune sweep;
+    runner.run(prefix + "broadphase/sap" + suffix, balls, balls, [&] {
+        std::swap(swept.x, next.x);
+        std::swap(swept.y, next.y);
+        sweep.update(swept);
+        keep(sweep.candidateCount());
+    });
+    
+    HierarchicalGrid levels;
+    runner.run(prefix + "broadphase/hgrid" + suffix, balls, balls, [&] {
+        levels.update(store, width, height);
+        keep(levels.candidateCount());
+    });
+    
+    // Storage order: the grid broad phase and pair tests over the scene with
+    // its balls shuffled through the arrays, as long runs leave them, then over
+    // the same scene re-sorted in Morton order; and the re-sort itself
+    std::vector<int> shuffle(balls);
+    for (int i = 0; i < balls; i++) shuffle[i] = i;
+    CounterRng rng(options.seed, 1ull << 41);
+    for (int i = balls - 1; i > 0; i--) std::swap(shuffle[i], shuffle[rng.below(i + 1)]);
+    BallStore<T> shuffled;
+    shuffled.resize(balls);
+    shuffled.gather(store, shuffle, 0, balls);
+    
+    MortonOrder morton;
+    std::unique_ptr<ThreadPool> pool(options.threads > 1 ? new ThreadPool(options.threads) : nullptr);
+    BallStore<T> sorted;
+    sorted.resize(balls);
+    sorted.gather(shuffled, morton.sort(shuffled, 2 * BENCH_MAX_RADIUS, width, height), 0, balls);
+    
+    for (const BallStore<T>* scene : {&shuffled, &sorted}) {
+        runner.run(prefix + (scene == &shuffled ? "locality/shuffled" : "locality/morton") + suffix, balls, balls, [&] {
+            grid.build(*scene, 2 * BENCH_MAX_RADIUS, width, height);
+            long long hits = 0;
+            for (size_t i = 0; i < scene->size(); i++) {
+                grid.gatherNeighbours((int)i, neighbours);
+                for (int j : neighbours) hits += scene->isColliding(i, j);
+            }
+            keep(hits);
+        });
+    }
+    
+    runner.run(prefix + "reorder/morton" + suffix, balls, balls, [&] {
+        const std::vector<int>& newOrder = morton.sort(shuffled, 2 * BENCH_MAX_RADIUS, width, height, pool.get());
+        sorted.gather(shuffled, newOrder, 0, shuffled.size());
+        keep(sorted.x);
+    });
+    
+    struct Mode {
+        const char* name;
+        BroadPhase broadPhase;
+        bool continuous;
+        int maxBalls;
+        double mass;    // Uniform mass, 0 = drawn per ball
+    };
+    const Mode modes[] = {
+        {"brute", BroadPhase::BruteForce, false, 10000, 0},
+        {"grid", BroadPhase::UniformGrid, false, 0, 0},
+        {"grid-uniform-mass", BroadPhase::UniformGrid, false, 0, 1},
+        {"sap", BroadPhase::SweepAndPrune, false, 0, 0},
+        {"hgrid", BroadPhase::HierarchicalGrid, false, 0, 0},
+        {"parallel", BroadPhase::ParallelGrid, false, 0, 0},
+        {"ccd", BroadPhase::UniformGrid, true, 0, 0},
+    };
+    for (const Mode& mode : modes) {
+        std::string name = prefix + "update/" + mode.name + suffix;
+        if (!runner.selected(name) || (mode.maxBalls > 0 && balls > mode.maxBalls)) continue;
+        
+        std::unique_ptr<PhysicsSimulation<T>> simulation;
+        {
+            SilentConsole quiet;
+            simulation.reset(new PhysicsSimulation<T>(width, height, balls, BENCH_MIN_RADIUS, BENCH_MAX_RADIUS,
+                                                      mode.broadPhase, options.seed));
+            simulation->setThreadCount(mode.broadPhase == BroadPhase::ParallelGrid ? options.threads : 1);
+            simulation->setContinuousCollisions(mode.continuous);
+            simulation->setUniformMass(mode.mass);
+        }
+        runner.run(name, balls, balls, [&] { simulation->update(BENCH_DT); }, true);
+    }
+    
+    // The parallel grid step split into domain slabs, at least two, one per thread
+    const std::string domainName = prefix + "update/domain" + suffix;
+    if (runner.selected(domainName)) {
+        std::unique_ptr<DomainDecomposition<T>> domain;
+        {
+            SilentConsole quiet;
+            domain.reset(new DomainDecomposition<T>(width, height, balls, BENCH_MIN_RADIUS, BENCH_MAX_RADIUS,
+                                                    std::max(2, options.threads), options.seed, options.threads));
+        }
+        runner.run(domainName, balls, balls, [&] { domain->update(BENCH_DT); }, true);
+    }
+    
+#ifdef PHYSICS_SIM_OPENCL
+    // The parallel grid step on the OpenCL device, skipped when there is none
+    const std::string gpuName = prefix + "update/gpu" + suffix;
+    if (runner.selected(gpuName)) {
+        std::unique_ptr<PhysicsSimulation<T>> simulation;
+        bool available;
+        {
+            SilentConsole quiet;
+            simulation.reset(new PhysicsSimulation<T>(width, height, balls, BENCH_MIN_RADIUS, BENCH_MAX_RADIUS,
+                                                      BroadPhase::ParallelGrid, options.seed));
+            available = simulation->setGpuEnabled(true);
+        }
+        if (available) runner.run(gpuName, balls, balls, [&] { simulation->update(BENCH_DT); }, true);
+    }
+#endif
+}
+
+// Widely mixed radii, the case the hierarchical grid is for: radius 5 - 10
+// with one ball in ten at 50 - 100. Besides the time, the candidate pairs per
+// ball each broad phase hands to the narrow phase are printed.
+template <typename T>
+void benchmarkMixedRadii(BenchmarkRunner& runner, const BenchmarkOptions& options, const std::string& prefix, int balls) {
+    const double AREA_PER_BALL = 3000.0;
+    int width = std::max(400, (int)std::sqrt(balls * AREA_PER_BALL * 16 / 9));
+    int height = width * 9 / 16;
+    const std::string suffix = "/mixed/" + std::to_string(balls);
+    
+    BallStore<T> store = benchmarkScene<T>(options, balls, width, height);
+    double largest = 0;
+    for (int i = 0; i < balls; i++) {
+        CounterRng rng(options.seed, (uint64_t)i + (1ull << 40));
+        store.r[i] = T(rng.below(10) == 0 ? rng.uniform(50.0, 100.0) : rng.uniform(5.0, 10.0));
+        largest = std::max(largest, (double)store.r[i]);
+    }
+    
+    UniformGrid grid;
+    std::vector<int> neighbours;
+    long long gridCandidates = 0;
+    runner.run(prefix + "broadphase/grid" + suffix, balls, balls, [&] {
+        grid.build(store, 2 * largest, width, height);
+        gridCandidates = 0;
+        for (size_t i = 0; i < store.size(); i++) {
+            grid.gatherNeighbours((int)i, neighbours);
+            gridCandidates += neighbours.size();
+        }
+    });
+    
+    HierarchicalGrid levels;
+    runner.run(prefix + "broadphase/hgrid" + suffix, balls, balls, [&] {
+        levels.update(store, width, height);
+    });
+    
+    SweepAndPrune sweep;
+    runner.run(prefix + "broadphase/sap" + suffix, balls, balls, [&] {
+        sweep.update(store);
+    });
+    
+    if (runner.selected(prefix + "broadphase/") && gridCandidates > 0) {
+        std::cout << "   candidates per ball: grid " << (double)gridCandidates / balls
+                  << ", hgrid " << (double)levels.candidateCount() / balls
+                  << " (" << levels.getLevelCount() << " levels), sap "
+                  << (double)sweep.candidateCount() / balls << std::endl;
+    }
+}
+
+template <typename T>
+void runBenchmarks(BenchmarkRunner& runner, const BenchmarkOptions& options, bool tagPrecision) {
+    const std::string prefix = tagPrecision ? std::string(precisionName<T>()) + "/" : std::string();
+    benchmarkVectors<T>(runner, prefix);
+    benchmarkNarrowPhase<T>(runner, options, prefix);
+    for (int balls : options.sizes) benchmarkScale<T>(runner, options, prefix, balls);
+    for (int balls : options.sizes) {
+        if (balls <= 100000) benchmarkMixedRadii<T>(runner, options, prefix, balls);
+    }
+}
+
+void printBenchmarkUsage(const char* program) {
+    std::cout << "Usage: " << program << " [options]" << std::endl;
+    std::cout << "  --sizes N,N,...      Ball counts for the per-N cases (default 1000,10000,100000,1000000)" << std::endl;
+    std::cout << "  --filter TEXT        Only run cases whose name contains TEXT" << std::endl;
+    std::cout << "  --min-time SECONDS   Least time spent timing each case (default 0.5)" << std::endl;
+    std::cout << "  --threads N          Worker threads for the parallel broad phase and domain slabs (default: all)" << std::endl;
+    std::cout << "  --precision NAME     double, float or both (default double)" << std::endl;
+    std::cout << "  --seed N             Seed of the benchmark scenes (default 1)" << std::endl;
+    std::cout << "  --json FILE          Also write the results to FILE as JSON" << std::endl;
+}
+
+bool parseSizes(const std::string& text, std::vector<int>& sizes) {
+    sizes.clear();
+    std::stringstream stream(text);
+    std::string item;
+    while (std::getline(stream, item, ',')) {
+        int balls = std::atoi(item.c_str());
+        if (balls <= 0 || balls > MAX_BALLS) return false;
+        sizes.push_back(balls);
+    }
+    return !sizes.empty();
+}
+
+int main(int argc, char* argv[]) {
+    BenchmarkOptions options;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--help") {
+            printBenchmarkUsage(argv[0]);
+            return 0;
+        }
+        if (i + 1 >= argc) {
+            printBenchmarkUsage(argv[0]);
+            return 1;
+        }
+        
+        std::string value = argv[++i];
+        bool valid = true;
+        if (arg == "--sizes") valid = parseSizes(value, options.sizes);
+        else if (arg == "--filter") options.filter = value;
+        else if (arg == "--min-time") valid = (options.minTime = std::atof(value.c_str())) > 0;
+        else if (arg == "--threads") valid = (options.threads = std::atoi(value.c_str())) > 0;
+        else if (arg == "--precision") valid = (options.precision = value) == "double" || value == "float" || value == "both";
+        else if (arg == "--seed") options.seed = (unsigned int)std::strtoul(value.c_str(), nullptr, 10);
+        else if (arg == "--json") options.jsonPath = value;
+        else valid = false;
+        
+        if (!valid) {
+            std::cout << "❌ Invalid value for " << arg << ": " << value << std::endl;
+            printBenchmarkUsage(argv[0]);
+            return 1;
+        }
+    }
+    
+    std::cout << "⏱️  NEON BALL PHYSICS BENCHMARKS" << std::endl;
+    std::cout << "   Step kernels: " << StepKernels<double>::detect().name << std::endl;
+    std::cout << "   Threads (parallel grid): " << options.threads << std::endl;
+    std::cout << "   Minimum time per case: " << options.minTime << " s\n" << std::endl;
+    
+    BenchmarkRunner runner(options);
+    bool both = options.precision == "both";
+    if (options.precision != "float") runBenchmarks<double>(runner, options, both);
+    if (options.precision != "double") runBenchmarks<float>(runner, options, both);
+    
+    std::cout << std::endl;
+    bool clean = runner.checkAllocations();
+    
+    if (!options.jsonPath.empty()) {
+        if (!runner.writeJson(options.jsonPath, StepKernels<double>::detect().name)) {
+            std::cout << "❌ Could not write " << options.jsonPath << std::endl;
+            return 1;
+        }
+        std::cout << "\n💾 Results written to " << options.jsonPath << std::endl;
+    }
+    return clean ? 0 : 1;
+}
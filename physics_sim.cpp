@@ -1,366 +1,783 @@
-#include <SDL2/SDL.h>
-#include <cmath>
-#include <iostream>
-#include <vector>
-#include <random>
+#include "physics_sim.h"
 
-struct Vector2D {
-    double x, y;
-    
-    Vector2D(double x = 0, double y = 0) : x(x), y(y) {}
+// Both precisions are always built, so neither can silently stop compiling
+template class PhysicsSimulation<double>;
+template class PhysicsSimulation<float>;
+
+// Headless benchmark: step the simulation with a fixed dt, without SDL video,
+// a window or VSYNC, and report raw throughput
+struct HeadlessResult {
+    double seconds;
+    double stepsPerSecond;
+    double nsPerBallStep;
+    long long collisions;
+    double energyDrift;     // Percent of the initial energy
+};
+
+template <typename T>
+HeadlessResult runHeadless(PhysicsSimulation<T>& simulation, int steps, double dt, double reportInterval) {
+    TelemetryReporter<PhysicsSimulation<T>> reporter(simulation, reportInterval);
     
-    Vector2D operator+(const Vector2D& other) const {
-        return Vector2D(x + other.x, y + other.y);
+    std::cout << "\n⏱️  HEADLESS BENCHMARK" << std::endl;
+    std::cout << "   Balls: " << simulation.getBallCount() << std::endl;
+    std::cout << "   Precision: " << precisionName<T>() << std::endl;
+    std::cout << "   Broad phase: " << (simulation.getContinuousCollisions()
+        ? "event-driven CCD" : broadPhaseName(simulation.getBroadPhase())) << std::endl;
+    std::cout << "   Threads: " << simulation.getThreadCount() << std::endl;
+    std::cout << "   Step kernels: " << simulation.getKernelName() << std::endl;
+    if (simulation.getGpuEnabled()) std::cout << "   OpenCL device: " << simulation.getGpuDevice() << std::endl;
+    if (simulation.getReorderInterval() > 0) {
+        std::cout << "   Morton reorder: every " << simulation.getReorderInterval() << " steps" << std::endl;
     }
+    if (simulation.getUniformMass()) std::cout << "   Masses: uniform" << std::endl;
+    std::cout << "   Steps: " << steps << " (dt = " << dt << " s)" << std::endl;
     
-    Vector2D operator-(const Vector2D& other) const {
-        return Vector2D(x - other.x, y - other.y);
+    double initialEnergy = simulation.getTotalEnergy();
+    long long initialCollisions = simulation.getCollisionCount();
+    Profiler::global().clear();
+    
+    auto start = std::chrono::steady_clock::now();
+    for (int step = 0; step < steps; step++) {
+        simulation.update(dt);
     }
+    auto end = std::chrono::steady_clock::now();
+    TelemetrySample last = simulation.getTelemetry();
+    
+    double seconds = std::chrono::duration<double>(end - start).count();
+    long long collisions = simulation.getCollisionCount() - initialCollisions;
+    double ballSteps = (double)steps * simulation.getBallCount();
+    
+    // Measure the end state exactly, so the drift below is the simulation's alone
+    simulation.reconcileStats();
+    double finalEnergy = simulation.getTotalEnergy();
+    
+    std::cout << "\n📈 RESULTS:" << std::endl;
+    std::cout << "   Wall time: " << seconds << " s" << std::endl;
+    std::cout << "   Steps/sec: " << (seconds > 0 ? steps / seconds : 0) << std::endl;
+    std::cout << "   Collisions: " << collisions << " ("
+              << (seconds > 0 ? collisions / seconds : 0) << " /sec)" << std::endl;
+    std::cout << "   ns per ball-step: " << (ballSteps > 0 ? seconds * 1e9 / ballSteps : 0) << std::endl;
+    std::cout << "   Last step: " << last.broadPhaseCandidates << " candidates, "
+              << last.narrowPhaseHits << " narrow-phase hits" << std::endl;
+    std::cout << "   Energy drift: " << (initialEnergy != 0 ? (finalEnergy - initialEnergy) / initialEnergy * 100 : 0)
+              << " %" << std::endl;
     
-    Vector2D operator*(double scalar) const {
-        return Vector2D(x * scalar, y * scalar);
+    simulation.printStats();
+    
+    HeadlessResult result;
+    result.seconds = seconds;
+    result.stepsPerSecond = seconds > 0 ? steps / seconds : 0;
+    result.nsPerBallStep = ballSteps > 0 ? seconds * 1e9 / ballSteps : 0;
+    result.collisions = collisions;
+    result.energyDrift = initialEnergy != 0 ? (finalEnergy - initialEnergy) / initialEnergy * 100 : 0;
+    return result;
+}
+
+// End a --trace or T capture and write it out
+void finishTrace(const std::string& path) {
+    Profiler::global().stopTrace();
+    if (!Profiler::global().writeTrace(path)) std::cout << "❌ Cannot write trace file: " << path << std::endl;
+}
+
+// Scalar type the simulation runs in; Both runs a headless benchmark in each
+// precision with the same scene and compares them
+enum class Precision {
+    Double,
+    Float,
+    Both
+};
+
+// Run parameters, filled in from defaults, then an optional config file, then
+// command line flags
+struct SimulationConfig {
+    int numberOfBalls = 200;
+    double minRadius = 5;
+    double maxRadius = 20;
+    int width = 0;                  // 0 = size the world from the ball count
+    int height = 0;
+    double dt = 1.0 / 60.0;         // Fixed physics timestep
+    int maxSubsteps = 8;            // Most physics steps per rendered frame
+    unsigned int seed = 0;          // 0 = random seed
+    int threads = 0;                // 0 = all hardware threads
+    int ranks = 1;                  // Headless: subdomains the world is split into
+    int steps = 1000;               // Headless step count
+    double reportInterval = 1.0;    // Seconds between telemetry lines, 0 = off
+    bool headless = false;
+    bool continuous = false;        // Event-driven CCD instead of fixed-step overlap tests
+    bool gpu = false;               // Step on an OpenCL device (needs a PHYSICS_SIM_OPENCL build)
+    double sleepSpeed = 0;          // Balls slower than this (px/s) for sleepTime fall asleep, 0 = off
+    double sleepTime = 0.5;
+    int reorderInterval = 0;        // Steps between Morton re-sorts of the ball storage, 0 = off
+    double mass = 0;                // Mass of every ball, 0 = drawn per ball from [0.5, 1.5)
+    bool narrowPhaseBenchmark = false;  // Headless: time the narrow phase test instead of stepping
+    bool profile = false;           // Phase timings: report after a headless run, HUD in the window
+    BroadPhase broadPhase = BroadPhase::ParallelGrid;
+    Precision precision = Precision::Double;
+    std::string loadPath;           // Snapshot to resume from
+    std::string savePath;           // Snapshot written after a headless run / on W
+    std::string recordPath;         // Trajectory file recording every step
+    std::string inspectPath;        // Trajectory file to summarize instead of simulating
+    std::string tracePath;          // Chrome trace of the profiler scopes
+    std::string ensemblePath;       // Runs of a batch ensemble, one per line
+    int replicas = 1;               // Ensemble: seeds run for every line
+    std::string resultsPath;        // Ensemble results, CSV or (*.json) JSON
+    int streamPort = 0;             // Serve the state to remote viewers on this TCP port, 0 = off
+    double streamRate = 30;         // Most frames per second sent to one viewer
+    std::string connectAddress;     // HOST:PORT of a stream to watch instead of simulating
+    long long inspectFrame = -1;    // Frame to decode with --inspect, -1 = last
+};
+
+bool parseBroadPhase(const std::string& name, BroadPhase& mode) {
+    if (name == "brute") mode = BroadPhase::BruteForce;
+    else if (name == "grid") mode = BroadPhase::UniformGrid;
+    else if (name == "parallel") mode = BroadPhase::ParallelGrid;
+    else if (name == "sap") mode = BroadPhase::SweepAndPrune;
+    else if (name == "hgrid") mode = BroadPhase::HierarchicalGrid;
+    else return false;
+    return true;
+}
+
+bool parsePrecision(const std::string& name, Precision& precision) {
+    if (name == "double") precision = Precision::Double;
+    else if (name == "float") precision = Precision::Float;
+    else if (name == "both") precision = Precision::Both;
+    else return false;
+    return true;
+}
+
+// Apply one "key = value" setting. Config files and flags share these keys,
+// so "--balls 5000" on the command line is "balls = 5000" in a file.
+bool applyConfigOption(SimulationConfig& config, const std::string& key, const std::string& value) {
+    std::istringstream in(value);
+    bool ok;
+    if (key == "balls") ok = (bool)(in >> config.numberOfBalls);
+    else if (key == "min-radius") ok = (bool)(in >> config.minRadius);
+    else if (key == "max-radius") ok = (bool)(in >> config.maxRadius);
+    else if (key == "width") ok = (bool)(in >> config.width);
+    else if (key == "height") ok = (bool)(in >> config.height);
+    else if (key == "dt") ok = (bool)(in >> config.dt) && config.dt > 0;
+    else if (key == "max-substeps") ok = (bool)(in >> config.maxSubsteps) && config.maxSubsteps >= 1;
+    else if (key == "seed") ok = (bool)(in >> config.seed);
+    else if (key == "threads") ok = (bool)(in >> config.threads) && config.threads >= 0;
+    else if (key == "ranks") ok = (bool)(in >> config.ranks) && config.ranks >= 1;
+    else if (key == "steps") ok = (bool)(in >> config.steps) && config.steps >= 0;
+    else if (key == "report-interval") ok = (bool)(in >> config.reportInterval) && config.reportInterval >= 0;
+    else if (key == "headless") { config.headless = (value == "true" || value == "1"); ok = true; }
+    else if (key == "ccd") { config.continuous = (value == "true" || value == "1"); ok = true; }
+    else if (key == "gpu") { config.gpu = (value == "true" || value == "1"); ok = true; }
+    else if (key == "sleep-speed") ok = (bool)(in >> config.sleepSpeed) && config.sleepSpeed >= 0;
+    else if (key == "sleep-time") ok = (bool)(in >> config.sleepTime) && config.sleepTime >= 0;
+    else if (key == "reorder") ok = (bool)(in >> config.reorderInterval) && config.reorderInterval >= 0;
+    else if (key == "mass") ok = (bool)(in >> config.mass) && config.mass >= 0;
+    else if (key == "bench-narrowphase") { config.narrowPhaseBenchmark = (value == "true" || value == "1"); ok = true; }
+    else if (key == "profile") { config.profile = (value == "true" || value == "1"); ok = true; }
+    else if (key == "trace") { config.tracePath = value; ok = !value.empty(); }
+    else if (key == "broadphase") ok = parseBroadPhase(value, config.broadPhase);
+    else if (key == "precision") ok = parsePrecision(value, config.precision);
+    else if (key == "load") { config.loadPath = value; ok = !value.empty(); }
+    else if (key == "save") { config.savePath = value; ok = !value.empty(); }
+    else if (key == "record") { config.recordPath = value; ok = !value.empty(); }
+    else if (key == "inspect") { config.inspectPath = value; ok = !value.empty(); }
+    else if (key == "frame") ok = (bool)(in >> config.inspectFrame) && config.inspectFrame >= 0;
+    else if (key == "ensemble") { config.ensemblePath = value; ok = !value.empty(); }
+    else if (key == "replicas") ok = (bool)(in >> config.replicas) && config.replicas >= 1;
+    else if (key == "results") { config.resultsPath = value; ok = !value.empty(); }
+    else if (key == "stream") ok = (bool)(in >> config.streamPort) && config.streamPort >= 0 && config.streamPort < 65536;
+    else if (key == "stream-fps") ok = (bool)(in >> config.streamRate) && config.streamRate > 0;
+    else if (key == "connect") { config.connectAddress = value; ok = !value.empty(); }
+    else {
+        std::cout << "❌ Unknown option: " << key << std::endl;
+        return false;
     }
     
-    double dot(const Vector2D& other) const {
-        return x * other.x + y * other.y;
+    if (!ok) std::cout << "❌ Invalid value for " << key << ": " << value << std::endl;
+    return ok;
+}
+
+// Config file: one "key = value" per line, '#' starts a comment
+bool loadConfigFile(const std::string& path, SimulationConfig& config) {
+    std::ifstream file(path);
+    if (!file) {
+        std::cout << "❌ Cannot open config file: " << path << std::endl;
+        return false;
     }
     
-    double length() const {
-        return sqrt(x * x + y * y);
+    std::string line;
+    int lineNumber = 0;
+    while (std::getline(file, line)) {
+        lineNumber++;
+        line = line.substr(0, line.find('#'));
+        size_t equals = line.find('=');
+        
+        auto trim = [](const std::string& text) {
+            size_t first = text.find_first_not_of(" \t\r");
+            size_t last = text.find_last_not_of(" \t\r");
+            return first == std::string::npos ? std::string() : text.substr(first, last - first + 1);
+        };
+        
+        if (trim(line).empty()) continue;
+        if (equals == std::string::npos) {
+            std::cout << "❌ " << path << ":" << lineNumber << ": expected key = value" << std::endl;
+            return false;
+        }
+        if (!applyConfigOption(config, trim(line.substr(0, equals)), trim(line.substr(equals + 1)))) {
+            std::cout << "   (" << path << ":" << lineNumber << ")" << std::endl;
+            return false;
+        }
     }
+    return true;
+}
+
+void printUsage(const char* program) {
+    std::cout << "Usage: " << program << " [options]" << std::endl;
+    std::cout << "Without options the simulator asks for the ball count and radius range." << std::endl;
+    std::cout << "  --config FILE        Read \"key = value\" options from FILE (flags override it)" << std::endl;
+    std::cout << "  --balls N            Number of balls (capped at 1000 with --broadphase brute)" << std::endl;
+    std::cout << "  --min-radius R       Minimum ball radius" << std::endl;
+    std::cout << "  --max-radius R       Maximum ball radius" << std::endl;
+    std::cout << "  --width W            World/window width (default: sized from the ball count)" << std::endl;
+    std::cout << "  --height H           World/window height" << std::endl;
+    std::cout << "  --dt SECONDS         Fixed physics timestep (default 1/60)" << std::endl;
+    std::cout << "  --max-substeps N     Most physics steps per rendered frame (default 8)" << std::endl;
+    std::cout << "  --seed N             Random seed for the initial scene (default: random)" << std::endl;
+    std::cout << "  --threads N          Worker threads (default: all hardware threads)" << std::endl;
+    std::cout << "  --ranks N            With --headless: split the world into N domain slabs (default 1)" << std::endl;
+    std::cout << "  --steps N            Number of fixed steps in headless mode (default 1000)" << std::endl;
+    std::cout << "  --report-interval S  Seconds between telemetry lines, 0 = off (default 1)" << std::endl;
+    std::cout << "  --broadphase NAME    brute, grid, hgrid, parallel or sap (default parallel)" << std::endl;
+    std::cout << "  --precision NAME     double, float, or both to compare them headless (default double)" << std::endl;
+    std::cout << "  --ccd                Event-driven continuous collision detection" << std::endl;
+    std::cout << "  --gpu                Run the step on an OpenCL device (builds with PHYSICS_SIM_OPENCL)" << std::endl;
+    std::cout << "  --sleep-speed V      Put balls slower than V px/s to sleep, 0 = off (default 0)" << std::endl;
+    std::cout << "  --sleep-time S       Seconds a ball must stay that slow first (default 0.5)" << std::endl;
+    std::cout << "  --reorder N          Re-sort the ball storage in Morton order every N steps, 0 = off (default 0)" << std::endl;
+    std::cout << "  --mass M             Give every ball mass M, 0 = random 0.5 - 1.5 per ball (default 0)" << std::endl;
+    std::cout << "  --load FILE          Resume from a snapshot (ball count, world and seed come from it)" << std::endl;
+    std::cout << "  --save FILE          Write a snapshot after the headless run, or when W is pressed" << std::endl;
+    std::cout << "  --record FILE        Record every step's positions and velocities to FILE (a window drops steps the disk is behind on)" << std::endl;
+    std::cout << "  --stream PORT        Serve the state to remote viewers over WebSocket on TCP PORT, 0 = off (default 0)" << std::endl;
+    std::cout << "  --stream-fps N       Most frames per second sent to one viewer (default 30)" << std::endl;
+    std::cout << "  --connect HOST:PORT  Watch a --stream server in a window instead of simulating" << std::endl;
+    std::cout << "  --profile            Time the step phases: report after a headless run, HUD in the window" << std::endl;
+    std::cout << "  --trace FILE         Write a Chrome trace of the headless run, or in the window until T" << std::endl;
+    std::cout << "  --inspect FILE       Summarize a recorded trajectory and decode one frame" << std::endl;
+    std::cout << "  --frame N            Frame decoded by --inspect (default: the last)" << std::endl;
+    std::cout << "  --ensemble FILE      Run every line of FILE (\"key=value ...\" overrides) as one simulation of a batch" << std::endl;
+    std::cout << "  --replicas N         Ensemble: run each line with N consecutive seeds (default 1)" << std::endl;
+    std::cout << "  --results FILE       Ensemble: write one row per run to FILE, CSV or JSON (*.json)" << std::endl;
+    std::cout << "  --headless           Run without a window and report throughput" << std::endl;
+    std::cout << "  --bench-narrowphase  With --headless: time the pair test for --steps rounds" << std::endl;
+}
+
+// Same prompts as always, used when the program is started without options
+void promptForConfig(SimulationConfig& config) {
+    std::cout << "🌈 WELCOME TO THE NEON BALL PHYSICS SIMULATOR! 🌈" << std::endl;
+    std::cout << "=================================================" << std::endl;
     
-    Vector2D normalize() const {
-        double len = length();
-        if (len == 0) return Vector2D(0, 0);
-        return Vector2D(x / len, y / len);
+    // Get number of balls
+    std::cout << "\n🎱 Enter the number of balls (1-1000): ";
+    std::cin >> config.numberOfBalls;
+    
+    // Validate number of balls
+    if (config.numberOfBalls < 1) {
+        config.numberOfBalls = 1;
+        std::cout << "⚠️  Minimum 1 ball set!" << std::endl;
+    } else if (config.numberOfBalls > 1000) {
+        config.numberOfBalls = 1000;
+        std::cout << "⚠️  Maximum 1000 balls set (for performance)!" << std::endl;
     }
-};
+    
+    // Get radius range
+    std::cout << "\n🔵 Enter minimum ball radius (5-50): ";
+    std::cin >> config.minRadius;
+    std::cout << "🔴 Enter maximum ball radius (" << config.minRadius << "-100): ";
+    std::cin >> config.maxRadius;
+    
+    // Validate radius range
+    if (config.minRadius < 5) config.minRadius = 5;
+    if (config.minRadius > 50) config.minRadius = 50;
+    if (config.maxRadius < config.minRadius) config.maxRadius = config.minRadius + 5;
+    if (config.maxRadius > 100) config.maxRadius = 100;
+}
 
-class Ball {
-public:
-    Vector2D position;
-    Vector2D velocity;
-    double radius;
-    double mass;
-    SDL_Color color;
-    int id;
-    
-    Ball(int ballId, double x, double y, double vx, double vy, double r, double m, SDL_Color c)
-        : id(ballId), position(x, y), velocity(vx, vy), radius(r), mass(m), color(c) {}
-    
-    void update(double dt) {
-        // Pure constant velocity motion - no forces applied
-        position = position + velocity * dt;
-    }
-    
-    void bounceOffWalls(int windowWidth, int windowHeight) {
-        // Perfect elastic collision with walls
-        if (position.x - radius <= 0) {
-            position.x = radius;
-            velocity.x = -velocity.x;  // Perfect reflection
-        } else if (position.x + radius >= windowWidth) {
-            position.x = windowWidth - radius;
-            velocity.x = -velocity.x;  // Perfect reflection
-        }
-        
-        if (position.y - radius <= 0) {
-            position.y = radius;
-            velocity.y = -velocity.y;  // Perfect reflection
-        } else if (position.y + radius >= windowHeight) {
-            position.y = windowHeight - radius;
-            velocity.y = -velocity.y;  // Perfect reflection
-        }
+// Sanity limits for scripted runs. The 1000-ball cap only exists because
+// the brute-force loop is quadratic, so the grid broad phases skip it.
+void validateConfig(SimulationConfig& config) {
+    if (config.numberOfBalls < 1) {
+        config.numberOfBalls = 1;
+        std::cout << "⚠️  Minimum 1 ball set!" << std::endl;
+    } else if (config.numberOfBalls > 1000 && config.broadPhase == BroadPhase::BruteForce) {
+        config.numberOfBalls = 1000;
+        std::cout << "⚠️  Maximum 1000 balls set for the brute-force broad phase!" << std::endl;
+    } else if (config.numberOfBalls > MAX_BALLS) {
+        config.numberOfBalls = MAX_BALLS;
+        std::cout << "⚠️  Maximum " << MAX_BALLS << " balls set!" << std::endl;
     }
     
-    bool isCollidingWith(const Ball& other) const {
-        Vector2D distance = position - other.position;
-        return distance.length() <= (radius + other.radius);
+    if (config.minRadius <= 0) {
+        config.minRadius = 5;
+        std::cout << "⚠️  Minimum radius must be positive, using 5!" << std::endl;
     }
+    if (config.maxRadius < config.minRadius) config.maxRadius = config.minRadius + 5;
     
-    void resolveCollision(Ball& other) {
-        Vector2D distance = position - other.position;
-        double d = distance.length();
-        
-        // Avoid division by zero
-        if (d == 0) {
-            distance = Vector2D(1, 0);
-            d = 1;
-        }
-        
-        // Normalize collision vector
-        Vector2D normal = distance * (1.0 / d);
-        
-        // Separate overlapping balls
-        double overlap = (radius + other.radius) - d;
-        double totalMass = mass + other.mass;
-        
-        position = position + normal * (overlap * other.mass / totalMass);
-        other.position = other.position - normal * (overlap * mass / totalMass);
-        
-        // Calculate relative velocity
-        Vector2D relativeVelocity = velocity - other.velocity;
-        
-        // Calculate collision impulse using conservation of momentum
-        double velocityAlongNormal = relativeVelocity.dot(normal);
-        
-        // Do not resolve if velocities are separating
-        if (velocityAlongNormal > 0) return;
-        
-        // Perfect elastic collision - no energy loss
-        double impulse = 2 * velocityAlongNormal / totalMass;
-        
-        // Apply impulse to conserve momentum perfectly
-        velocity = velocity - normal * (impulse * other.mass);
-        other.velocity = other.velocity + normal * (impulse * mass);
+    int defaultWidth, defaultHeight;
+    worldSizeForBalls(config.numberOfBalls, defaultWidth, defaultHeight);
+    if (config.width <= 0) config.width = defaultWidth;
+    if (config.height <= 0) config.height = defaultHeight;
+    
+    double smallestSide = std::min(config.width, config.height);
+    if (2 * config.maxRadius >= smallestSide) {
+        config.maxRadius = smallestSide / 4;
+        config.minRadius = std::min(config.minRadius, config.maxRadius);
+        std::cout << "⚠️  Radius range reduced to fit the world!" << std::endl;
     }
     
-    void render(SDL_Renderer* renderer) {
-        SDL_SetRenderDrawColor(renderer, color.r, color.g, color.b, color.a);
-        
-        // Optimized circle drawing
-        int r = (int)radius;
-        int x = (int)position.x;
-        int y = (int)position.y;
-        
-        // Use a more efficient circle drawing algorithm
-        for (int dy = -r; dy <= r; dy++) {
-            int width = (int)sqrt(r*r - dy*dy);
-            SDL_RenderDrawLine(renderer, x - width, y + dy, x + width, y + dy);
-        }
+    if (config.threads <= 0) config.threads = std::max(1u, std::thread::hardware_concurrency());
+    
+    if (!PROFILER_AVAILABLE && (config.profile || !config.tracePath.empty())) {
+        config.profile = false;
+        config.tracePath.clear();
+        std::cout << "⚠️  Built without the profiler (PHYSICS_SIM_PROFILE), ignoring --profile and --trace!" << std::endl;
     }
-};
+    
+    // A decomposed run is the plain parallel grid step and nothing else
+    if (config.ranks > 1 && (config.continuous || config.gpu || config.sleepSpeed > 0 || !config.loadPath.empty() ||
+                             !config.savePath.empty() || !config.recordPath.empty() || config.streamPort > 0 ||
+                             config.narrowPhaseBenchmark)) {
+        config.ranks = 1;
+        std::cout << "⚠️  --ranks does not combine with CCD, the GPU, sleeping, snapshots, recording or streaming, using 1 rank!" << std::endl;
+    }
+    if (config.ranks > 1 && config.reorderInterval > 0) {
+        config.reorderInterval = 0;
+        std::cout << "⚠️  Domain slabs keep their balls in id order, ignoring --reorder!" << std::endl;
+    }
+}
 
-class PhysicsSimulation {
-private:
-    std::vector<Ball> balls;
-    int windowWidth;
-    int windowHeight;
-    int collisionCount;
-    int numBalls;
-    double minRadius;
-    double maxRadius;
-    
-    SDL_Color generateRandomColor(std::mt19937& rng) {
-        // Neon color palette - bright, vibrant, refreshing colors
-        std::vector<SDL_Color> neonColors = {
-            {0, 255, 255, 255},     // Electric Cyan
-            {255, 0, 255, 255},     // Electric Magenta
-            {255, 255, 0, 255},     // Electric Yellow
-            {0, 255, 0, 255},       // Electric Green
-            {255, 64, 255, 255},    // Hot Pink
-            {64, 255, 64, 255},     // Lime Green
-            {255, 128, 0, 255},     // Electric Orange
-            {128, 255, 255, 255},   // Light Cyan
-            {255, 128, 255, 255},   // Light Magenta
-            {255, 255, 128, 255},   // Light Yellow
-            {128, 255, 128, 255},   // Light Green
-            {255, 64, 128, 255},    // Pink Neon
-            {64, 255, 255, 255},    // Aqua Neon
-            {255, 255, 64, 255},    // Bright Yellow
-            {128, 128, 255, 255},   // Electric Blue
-            {255, 128, 128, 255},   // Light Red
-            {192, 255, 64, 255},    // Electric Lime
-            {255, 64, 192, 255},    // Hot Pink 2
-            {64, 192, 255, 255},    // Sky Blue Neon
-            {255, 192, 64, 255}     // Golden Neon
-        };
-        
-        std::uniform_int_distribution<int> colorIndex(0, neonColors.size() - 1);
-        return neonColors[colorIndex(rng)];
+// Take ball count, radii, world size and seed from the snapshot to be loaded,
+// so validation, the banner and the window all match it
+bool applySnapshotConfig(SimulationConfig& config) {
+    MappedFile file;
+    const char* problem = "cannot be read";
+    const SnapshotHeader* header = file.open(config.loadPath) ? checkSnapshot(file.data(), file.size(), &problem) : nullptr;
+    if (!header) {
+        std::cout << "❌ Not a valid snapshot: " << config.loadPath << " (" << problem << ")" << std::endl;
+        return false;
+    }
+    config.numberOfBalls = (int)header->ballCount;
+    config.minRadius = header->minRadius;
+    config.maxRadius = header->maxRadius;
+    config.width = header->width;
+    config.height = header->height;
+    config.seed = header->seed;
+    return true;
+}
+
+template <typename T>
+bool loadSnapshotFile(PhysicsSimulation<T>& simulation, const std::string& path) {
+    auto start = std::chrono::steady_clock::now();
+    MappedFile file;
+    if (!file.open(path) || !simulation.readSnapshot(file.data(), file.size())) {
+        std::cout << "❌ Cannot load snapshot: " << path << std::endl;
+        return false;
+    }
+    double milliseconds = std::chrono::duration<double, std::milli>(
+        std::chrono::steady_clock::now() - start).count();
+    std::cout << "📂 Loaded snapshot " << path << ": " << simulation.getBallCount() << " balls at step "
+              << simulation.getStepCount() << " (" << milliseconds << " ms)" << std::endl;
+    return true;
+}
+
+// --inspect: summary of a trajectory file plus one randomly accessed frame
+int inspectTrajectory(const SimulationConfig& config) {
+    TrajectoryReader reader;
+    if (!reader.open(config.inspectPath)) {
+        std::cout << "❌ Not a complete, valid trajectory file: " << config.inspectPath << std::endl;
+        return 1;
     }
     
-    void initializeBalls() {
-        balls.clear();
-        collisionCount = 0;
-        
-        // Create random number generator
-        std::random_device rd;
-        std::mt19937 rng(rd());
-        
-        // Distributions for ball properties
-        std::uniform_real_distribution<double> radiusDist(minRadius, maxRadius);
-        std::uniform_real_distribution<double> massDist(0.5, 1.5);
-        std::uniform_real_distribution<double> velocityDist(80.0, 200.0);
-        std::uniform_int_distribution<int> signDist(0, 1);
-        
-        // Calculate grid size based on number of balls
-        int gridSize = (int)ceil(sqrt(numBalls));
-        if (gridSize * gridSize < numBalls) gridSize++;
-        
-        const double SPACING_X = (windowWidth - 100) / (gridSize - 1);
-        const double SPACING_Y = (windowHeight - 100) / (gridSize - 1);
-        
-        int ballCount = 0;
-        
-        // Create balls in a grid pattern with random properties
-        for (int row = 0; row < gridSize && ballCount < numBalls; row++) {
-            for (int col = 0; col < gridSize && ballCount < numBalls; col++) {
-                if (ballCount >= numBalls) break;
-                
-                double x = 50 + col * SPACING_X;
-                double y = 50 + row * SPACING_Y;
-                
-                // Add small random offset to avoid perfect grid
-                std::uniform_real_distribution<double> offsetDist(-15.0, 15.0);
-                x += offsetDist(rng);
-                y += offsetDist(rng);
-                
-                // Ensure ball stays within bounds
-                double radius = radiusDist(rng);
-                x = std::max(radius + 5, std::min(x, windowWidth - radius - 5));
-                y = std::max(radius + 5, std::min(y, windowHeight - radius - 5));
-                
-                // Random velocity
-                double vx = velocityDist(rng) * (signDist(rng) ? 1 : -1);
-                double vy = velocityDist(rng) * (signDist(rng) ? 1 : -1);
-                
-                double mass = massDist(rng);
-                SDL_Color color = generateRandomColor(rng);
-                
-                balls.push_back(Ball(ballCount + 1, x, y, vx, vy, radius, mass, color));
-                ballCount++;
-            }
-        }
-        
-        std::cout << "Created " << balls.size() << " balls!" << std::endl;
+    std::cout << "\n🎞️  TRAJECTORY " << config.inspectPath << std::endl;
+    std::cout << "   Balls: " << reader.ballCount() << std::endl;
+    std::cout << "   Frames: " << reader.frameCount() << " in " << reader.chunkCount() << " chunks" << std::endl;
+    std::cout << "   Size: " << reader.fileSize() / 1e6 << " MB ("
+              << (reader.frameCount() > 0 ? (double)reader.fileSize() / reader.frameCount() / reader.ballCount() : 0)
+              << " bytes per ball-frame)" << std::endl;
+    if (reader.frameCount() == 0) return 0;
+    
+    uint64_t frame = config.inspectFrame >= 0 ? (uint64_t)config.inspectFrame : reader.frameCount() - 1;
+    long long step;
+    std::vector<double> x, y, vx, vy;
+    auto start = std::chrono::steady_clock::now();
+    if (frame >= reader.frameCount()) {
+        std::cout << "❌ No frame " << frame << " (the file has " << reader.frameCount() << ")" << std::endl;
+        return 1;
+    }
+    if (!reader.readFrame(frame, step, x, y, vx, vy)) {
+        std::cout << "❌ Frame " << frame << " is corrupt: its chunk ends before it does" << std::endl;
+        return 1;
     }
+    double milliseconds = std::chrono::duration<double, std::milli>(
+        std::chrono::steady_clock::now() - start).count();
     
-public:
-    PhysicsSimulation(int width, int height, int numberOfBalls, double minR, double maxR) 
-        : windowWidth(width), windowHeight(height), collisionCount(0), 
-          numBalls(numberOfBalls), minRadius(minR), maxRadius(maxR) {
-        initializeBalls();
-        
-        std::cout << "🔥 CUSTOMIZABLE NEON BALL PHYSICS SIMULATION INITIALIZED! 🔥" << std::endl;
-        std::cout << "Total balls: " << balls.size() << std::endl;
-        std::cout << "Ball radius range: " << minRadius << " - " << maxRadius << std::endl;
-        std::cout << "Possible collision pairs: " << (balls.size() * (balls.size() - 1)) / 2 << std::endl;
-        std::cout << "LET THE NEON CHAOS BEGIN! 🌈💥" << std::endl;
-    }
-    
-    void update(double deltaTime) {
-        // Update all ball positions with constant velocity
-        for (Ball& ball : balls) {
-            ball.update(deltaTime);
-            ball.bounceOffWalls(windowWidth, windowHeight);
-        }
-        
-        // Handle ball-to-ball collisions (check every pair)
-        int frameCollisions = 0;
-        for (size_t i = 0; i < balls.size(); i++) {
-            for (size_t j = i + 1; j < balls.size(); j++) {
-                if (balls[i].isCollidingWith(balls[j])) {
-                    balls[i].resolveCollision(balls[j]);
-                    frameCollisions++;
-                    collisionCount++;
-                }
-            }
-        }
-        
-        // Only print if there are collisions to avoid spam
-        if (frameCollisions > 0) {
-            std::cout << "💥 " << frameCollisions << " collisions this frame! Total: " 
-                      << collisionCount << std::endl;
-        }
+    std::cout << "   Frame " << frame << " = step " << step << " (decoded in " << milliseconds << " ms)" << std::endl;
+    for (size_t i = 0; i < std::min<size_t>(3, x.size()); i++) {
+        std::cout << "   ball " << i + 1 << ": position (" << x[i] << ", " << y[i]
+                  << "), velocity (" << vx[i] << ", " << vy[i] << "), radius " << reader.radii()[i] << std::endl;
     }
+    return 0;
+}
+
+// Headless run split into config.ranks domain slabs. Collisions and the
+// final energy match a single-process run with --broadphase parallel.
+template <typename T>
+HeadlessResult runDecomposed(const SimulationConfig& config) {
+    DomainDecomposition<T> domain(config.width, config.height, config.numberOfBalls, config.minRadius,
+                                  config.maxRadius, config.ranks, config.seed, config.threads, config.mass);
     
-    void render(SDL_Renderer* renderer) {
-        // Clear screen with black background
-        SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
-        SDL_RenderClear(renderer);
-        
-        // Draw blue box outline (closed container)
-        SDL_SetRenderDrawColor(renderer, 0, 100, 255, 255);
-        for (int i = 0; i < 4; i++) {
-            SDL_Rect border = {i, i, windowWidth - 2*i, windowHeight - 2*i};
-            SDL_RenderDrawRect(renderer, &border);
+    std::cout << "\n⏱️  HEADLESS BENCHMARK (DOMAIN DECOMPOSITION)" << std::endl;
+    std::cout << "   Balls: " << domain.getBallCount() << std::endl;
+    std::cout << "   Precision: " << precisionName<T>() << std::endl;
+    std::cout << "   Ranks: " << domain.getRankCount() << std::endl;
+    std::cout << "   Threads: " << domain.getThreadCount() << std::endl;
+    std::cout << "   Step kernels: " << domain.getKernelName() << std::endl;
+    std::cout << "   Steps: " << config.steps << " (dt = " << config.dt << " s)" << std::endl;
+    
+    double initialEnergy = domain.measureMotion().energy;
+    Profiler::global().clear();
+    
+    auto start = std::chrono::steady_clock::now();
+    for (int step = 0; step < config.steps; step++) {
+        domain.update(config.dt);
+    }
+    auto end = std::chrono::steady_clock::now();
+    
+    double seconds = std::chrono::duration<double>(end - start).count();
+    double ballSteps = (double)config.steps * domain.getBallCount();
+    MotionStats final = domain.measureMotion();
+    double drift = initialEnergy != 0 ? (final.energy - initialEnergy) / initialEnergy * 100 : 0;
+    
+    std::cout << "\n📈 RESULTS:" << std::endl;
+    std::cout << "   Wall time: " << seconds << " s" << std::endl;
+    std::cout << "   Steps/sec: " << (seconds > 0 ? config.steps / seconds : 0) << std::endl;
+    std::cout << "   Collisions: " << domain.getCollisionCount() << " ("
+              << (seconds > 0 ? domain.getCollisionCount() / seconds : 0) << " /sec)" << std::endl;
+    std::cout << "   ns per ball-step: " << (ballSteps > 0 ? seconds * 1e9 / ballSteps : 0) << std::endl;
+    std::cout << "   Last step: " << domain.getCandidates() << " candidates" << std::endl;
+    std::cout << "   Energy drift: " << drift << " %" << std::endl;
+    std::cout << "   Total energy: " << final.energy << std::endl;
+    std::cout << "   Total momentum: (" << final.momentumX << ", " << final.momentumY << ")" << std::endl;
+    std::cout << "   Balls per slab:";
+    for (size_t population : domain.getPopulations()) std::cout << " " << population;
+    std::cout << std::endl;
+    if (config.profile) Profiler::global().printReport();
+    
+    HeadlessResult result;
+    result.seconds = seconds;
+    result.stepsPerSecond = seconds > 0 ? config.steps / seconds : 0;
+    result.nsPerBallStep = ballSteps > 0 ? seconds * 1e9 / ballSteps : 0;
+    result.collisions = domain.getCollisionCount();
+    result.energyDrift = drift;
+    return result;
+}
+
+// Headless run of the configured scene in precision T
+template <typename T>
+HeadlessResult runHeadless(const SimulationConfig& config) {
+    if (config.ranks > 1) return runDecomposed<T>(config);
+    
+    PhysicsSimulation<T> simulation(config.width, config.height, config.numberOfBalls,
+                                    config.minRadius, config.maxRadius, config.broadPhase, config.seed);
+    simulation.setThreadCount(config.threads);
+    simulation.setContinuousCollisions(config.continuous);
+    simulation.setSleeping(config.sleepSpeed, config.sleepTime);
+    simulation.setReorderInterval(config.reorderInterval);
+    simulation.setUniformMass(config.mass);
+    if (config.gpu && !simulation.setGpuEnabled(true)) std::cout << "⚠️  Stepping on the CPU instead" << std::endl;
+    if (!config.loadPath.empty() && !loadSnapshotFile(simulation, config.loadPath)) return HeadlessResult();
+    if (config.narrowPhaseBenchmark) {
+        simulation.benchmarkNarrowPhase(config.steps);
+        return HeadlessResult();
+    }
+    
+    TrajectoryRecorder<T> recorder;
+    if (!config.recordPath.empty()) {
+        if (!recorder.open(config.recordPath, simulation.getBalls(), simulation.getWorldWidth(),
+                           simulation.getWorldHeight())) {
+            std::cout << "❌ Cannot open trajectory file: " << config.recordPath << std::endl;
+            return HeadlessResult();
         }
-        
-        // Render all balls
-        for (Ball& ball : balls) {
-            ball.render(renderer);
+        // Offline analysis wants every step; the run waits for the disk instead
+        recorder.setLossless(true);
+        simulation.setRecorder(&recorder);
+    }
+    StateStreamer<T> streamer;
+    if (config.streamPort > 0) {
+        if (!streamer.open(config.streamPort, config.streamRate)) {
+            std::cout << "❌ Cannot listen on port " << config.streamPort << std::endl;
+            return HeadlessResult();
         }
-        
-        SDL_RenderPresent(renderer);
+        simulation.setStreamer(&streamer);
     }
     
-    void reset() {
-        std::cout << "🔄 RESETTING NEON BALL CHAOS!" << std::endl;
-        initializeBalls();
-        std::cout << "Fresh neon chaos initiated! 🎯✨" << std::endl;
+    HeadlessResult result = runHeadless(simulation, config.steps, config.dt, config.reportInterval);
+    if (config.profile) Profiler::global().printReport();
+    simulation.setRecorder(nullptr);
+    recorder.close();
+    simulation.setStreamer(nullptr);
+    streamer.close();
+    if (!config.savePath.empty()) {
+        SnapshotWriter writer;
+        writer.write(simulation.writeSnapshot(), config.savePath);
+        writer.wait();
     }
+    return result;
+}
+
+// The same seeded scene in double and then float, side by side
+void comparePrecisions(SimulationConfig config) {
+    if (config.seed == 0) config.seed = std::random_device()();
+    HeadlessResult reference = runHeadless<double>(config);
+    HeadlessResult single = runHeadless<float>(config);
     
-    double getTotalEnergy() const {
-        double totalEnergy = 0;
-        for (const Ball& ball : balls) {
-            double ke = 0.5 * ball.mass * (ball.velocity.x * ball.velocity.x + ball.velocity.y * ball.velocity.y);
-            totalEnergy += ke;
-        }
-        return totalEnergy;
+    std::cout << "\n⚖️  PRECISION COMPARISON (seed " << config.seed << "):" << std::endl;
+    std::cout << "   double: " << reference.stepsPerSecond << " steps/s, "
+              << reference.nsPerBallStep << " ns per ball-step, energy drift "
+              << reference.energyDrift << " %, " << reference.collisions << " collisions" << std::endl;
+    std::cout << "   float:  " << single.stepsPerSecond << " steps/s, "
+              << single.nsPerBallStep << " ns per ball-step, energy drift "
+              << single.energyDrift << " %, " << single.collisions << " collisions" << std::endl;
+    if (single.seconds > 0) {
+        std::cout << "   float speedup: " << reference.seconds / single.seconds << "x" << std::endl;
+    }
+}
+
+// Batch ensemble: many small independent simulations in one process, for
+// parameter sweeps. Each run is single-threaded; the runs are spread over a
+// WorkStealingPool, longest first. A run's simulation is built by the worker
+// that steps it and dropped when it finishes, so only one per worker is
+// alive at a time and its arrays stay in that core's cache.
+struct EnsembleRun {
+    SimulationConfig config;    // Validated, with this replica's seed
+    int line;                   // Line of the ensemble file
+    
+    // Filled in by the run
+    long long collisions = 0;
+    double initialEnergy = 0;
+    double finalEnergy = 0;
+    double energyDrift = 0;     // Percent of the initial energy
+    MotionStats motion;         // End state, re-measured
+    int sleeping = 0;
+    double seconds = 0;
+    int worker = 0;
+};
+
+// Ensemble file: one run per line as "key=value" pairs separated by spaces,
+// with the keys of the config file, applied over the command-line options;
+// '#' starts a comment. Every line is run with replicas consecutive seeds.
+bool loadEnsembleFile(const SimulationConfig& base, std::vector<EnsembleRun>& runs) {
+    std::ifstream file(base.ensemblePath);
+    if (!file) {
+        std::cout << "❌ Cannot open ensemble file: " << base.ensemblePath << std::endl;
+        return false;
     }
     
-    void printStats() const {
-        std::cout << "\n📊 NEON BALL SIMULATION STATS:" << std::endl;
-        std::cout << "Number of balls: " << balls.size() << std::endl;
-        std::cout << "Ball size range: " << minRadius << " - " << maxRadius << std::endl;
-        std::cout << "Total collisions: " << collisionCount << std::endl;
-        std::cout << "Total energy: " << getTotalEnergy() << std::endl;
+    std::string line;
+    int lineNumber = 0;
+    while (std::getline(file, line)) {
+        lineNumber++;
+        std::istringstream tokens(line.substr(0, line.find('#')));
+        SimulationConfig config = base;
+        std::string token;
+        bool any = false;
+        while (tokens >> token) {
+            size_t equals = token.find('=');
+            if (equals == std::string::npos || !applyConfigOption(config, token.substr(0, equals), token.substr(equals + 1))) {
+                if (equals == std::string::npos) std::cout << "❌ Expected key=value: " << token << std::endl;
+                std::cout << "   (" << base.ensemblePath << ":" << lineNumber << ")" << std::endl;
+                return false;
+            }
+            any = true;
+        }
+        if (!any) continue;
         
-        // Count balls in different speed ranges
-        int slow = 0, medium = 0, fast = 0;
-        for (const Ball& ball : balls) {
-            double speed = ball.velocity.length();
-            if (speed < 100) slow++;
-            else if (speed < 150) medium++;
-            else fast++;
+        if (config.ranks > 1 || config.gpu || config.precision == Precision::Both || config.narrowPhaseBenchmark ||
+            !config.loadPath.empty() || !config.savePath.empty() || !config.recordPath.empty() || config.streamPort > 0) {
+            std::cout << "❌ Ensemble runs are plain headless runs: no ranks, GPU, precision both, snapshots,"
+                      << " recording, streaming or narrow phase benchmark (" << base.ensemblePath << ":" << lineNumber << ")" << std::endl;
+            return false;
+        }
+        validateConfig(config);
+        for (int replica = 0; replica < base.replicas; replica++) {
+            EnsembleRun run;
+            run.config = config;
+            run.config.seed = config.seed + replica;
+            run.line = lineNumber;
+            runs.push_back(run);
         }
-        std::cout << "Speed distribution - Slow(<100): " << slow 
-                  << ", Medium(100-150): " << medium 
-                  << ", Fast(>150): " << fast << std::endl;
     }
-    
-    int getCollisionCount() const {
-        return collisionCount;
+    if (runs.empty()) {
+        std::cout << "❌ No runs in ensemble file: " << base.ensemblePath << std::endl;
+        return false;
     }
-};
+    return true;
+}
 
-int main(int argc, char* argv[]) {
-    // Get user input for simulation parameters
-    int numberOfBalls;
-    double minRadius, maxRadius;
+template <typename T>
+void runEnsembleMember(EnsembleRun& run) {
+    const SimulationConfig& config = run.config;
+    auto start = std::chrono::steady_clock::now();
+    PhysicsSimulation<T> simulation(config.width, config.height, config.numberOfBalls, config.minRadius,
+                                    config.maxRadius, config.broadPhase, config.seed, false);
+    simulation.setContinuousCollisions(config.continuous);
+    simulation.setSleeping(config.sleepSpeed, config.sleepTime);
+    simulation.setReorderInterval(config.reorderInterval);
+    simulation.setUniformMass(config.mass);
     
-    std::cout << "🌈 WELCOME TO THE NEON BALL PHYSICS SIMULATOR! 🌈" << std::endl;
-    std::cout << "=================================================" << std::endl;
+    run.initialEnergy = simulation.getTotalEnergy();
+    for (int step = 0; step < config.steps; step++) simulation.update(config.dt);
+    simulation.reconcileStats();
     
-    // Get number of balls
-    std::cout << "\n🎱 Enter the number of balls (1-1000): ";
-    std::cin >> numberOfBalls;
+    run.collisions = simulation.getCollisionCount();
+    run.finalEnergy = simulation.getTotalEnergy();
+    run.energyDrift = run.initialEnergy != 0 ? (run.finalEnergy - run.initialEnergy) / run.initialEnergy * 100 : 0;
+    run.motion = simulation.getMotion();
+    run.sleeping = simulation.getSleepingCount();
+    run.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+std::string ensembleBroadPhase(const SimulationConfig& config) {
+    return config.continuous ? "event-driven CCD" : broadPhaseName(config.broadPhase);
+}
+
+bool writeEnsembleCsv(const std::string& path, const std::vector<EnsembleRun>& runs) {
+    std::ofstream out(path);
+    if (!out) return false;
+    out << "run,line,seed,balls,min_radius,max_radius,mass,width,height,broad_phase,precision,steps,dt,"
+        << "collisions,initial_energy,final_energy,energy_drift_percent,momentum_x,momentum_y,"
+        << "slow,medium,fast,sleeping,seconds\n";
+    out.precision(10);
+    for (size_t k = 0; k < runs.size(); k++) {
+        const EnsembleRun& run = runs[k];
+        const SimulationConfig& config = run.config;
+        out << k << "," << run.line << "," << config.seed << "," << config.numberOfBalls << ","
+            << config.minRadius << "," << config.maxRadius << "," << config.mass << "," << config.width << "," << config.height << ","
+            << ensembleBroadPhase(config) << "," << (config.precision == Precision::Float ? "float" : "double") << ","
+            << config.steps << "," << config.dt << "," << run.collisions << "," << run.initialEnergy << ","
+            << run.finalEnergy << "," << run.energyDrift << "," << run.motion.momentumX << "," << run.motion.momentumY << ","
+            << run.motion.slow << "," << run.motion.medium << "," << run.motion.fast << "," << run.sleeping << ","
+            << run.seconds << "\n";
+    }
+    return (bool)out;
+}
+
+bool writeEnsembleJson(const std::string& path, const std::vector<EnsembleRun>& runs, int threads, double seconds) {
+    std::ofstream out(path);
+    if (!out) return false;
+    out.precision(10);
+    out << "{\n  \"context\": {\"runs\": " << runs.size() << ", \"threads\": " << threads
+        << ", \"wall_seconds\": " << seconds << "},\n  \"runs\": [";
+    for (size_t k = 0; k < runs.size(); k++) {
+        const EnsembleRun& run = runs[k];
+        const SimulationConfig& config = run.config;
+        out << (k ? ",\n" : "\n")
+            << "    {\"run\": " << k << ", \"line\": " << run.line << ", \"seed\": " << config.seed
+            << ", \"balls\": " << config.numberOfBalls << ", \"min_radius\": " << config.minRadius
+            << ", \"max_radius\": " << config.maxRadius << ", \"mass\": " << config.mass << ", \"width\": " << config.width
+            << ", \"height\": " << config.height << ", \"broad_phase\": \"" << ensembleBroadPhase(config)
+            << "\", \"precision\": \"" << (config.precision == Precision::Float ? "float" : "double")
+            << "\", \"steps\": " << config.steps << ", \"dt\": " << config.dt
+            << ", \"collisions\": " << run.collisions << ", \"initial_energy\": " << run.initialEnergy
+            << ", \"final_energy\": " << run.finalEnergy << ", \"energy_drift_percent\": " << run.energyDrift
+            << ", \"momentum_x\": " << run.motion.momentumX << ", \"momentum_y\": " << run.motion.momentumY
+            << ", \"slow\": " << run.motion.slow << ", \"medium\": " << run.motion.medium
+            << ", \"fast\": " << run.motion.fast << ", \"sleeping\": " << run.sleeping
+            << ", \"seconds\": " << run.seconds << "}";
+    }
+    out << "\n  ]\n}\n";
+    return (bool)out;
+}
+
+int runEnsemble(SimulationConfig config) {
+    if (config.seed == 0) config.seed = std::random_device()();
+    std::vector<EnsembleRun> runs;
+    if (!loadEnsembleFile(config, runs)) return 1;
+    const int threads = config.threads > 0 ? config.threads : (int)std::max(1u, std::thread::hardware_concurrency());
     
-    // Validate number of balls
-    if (numberOfBalls < 1) {
-        numberOfBalls = 1;
-        std::cout << "⚠️  Minimum 1 ball set!" << std::endl;
-    } else if (numberOfBalls > 1000) {
-        numberOfBalls = 1000;
-        std::cout << "⚠️  Maximum 1000 balls set (for performance)!" << std::endl;
+    // Rough cost of every run, only used to start the long ones first
+    std::vector<double> cost(runs.size());
+    for (size_t k = 0; k < runs.size(); k++) {
+        const SimulationConfig& run = runs[k].config;
+        double perStep = run.broadPhase == BroadPhase::BruteForce && !run.continuous
+            ? (double)run.numberOfBalls * run.numberOfBalls / 64 : run.numberOfBalls;
+        cost[k] = perStep * run.steps;
     }
+    std::vector<int> jobs(runs.size());
+    for (size_t k = 0; k < jobs.size(); k++) jobs[k] = (int)k;
+    std::stable_sort(jobs.begin(), jobs.end(), [&](int a, int b) { return cost[a] > cost[b]; });
     
-    // Get radius range
-    std::cout << "\n🔵 Enter minimum ball radius (5-50): ";
-    std::cin >> minRadius;
-    std::cout << "🔴 Enter maximum ball radius (" << minRadius << "-100): ";
-    std::cin >> maxRadius;
+    std::cout << "\n📦 ENSEMBLE: " << runs.size() << " runs from " << config.ensemblePath << " ("
+              << config.replicas << " seeds per line from " << config.seed << ") on " << threads << " threads" << std::endl;
     
-    // Validate radius range
-    if (minRadius < 5) minRadius = 5;
-    if (minRadius > 50) minRadius = 50;
-    if (maxRadius < minRadius) maxRadius = minRadius + 5;
-    if (maxRadius > 100) maxRadius = 100;
+    WorkStealingPool pool(threads);
+    std::mutex progress;
+    size_t finished = 0;
+    auto start = std::chrono::steady_clock::now();
+    pool.run(jobs, [&](int job, int worker) {
+        EnsembleRun& run = runs[job];
+        run.worker = worker;
+        if (run.config.precision == Precision::Float) runEnsembleMember<float>(run);
+        else runEnsembleMember<double>(run);
+        
+        std::lock_guard<std::mutex> lock(progress);
+        finished++;
+        if (finished * 10 / runs.size() != (finished - 1) * 10 / runs.size()) {
+            double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            std::cout << "   " << finished << " / " << runs.size() << " runs done (" << elapsed << " s)" << std::endl;
+        }
+    });
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
     
-    std::cout << "\n✅ SIMULATION CONFIGURED:" << std::endl;
-    std::cout << "   Balls: " << numberOfBalls << std::endl;
-    std::cout << "   Radius Range: " << minRadius << " - " << maxRadius << std::endl;
-    std::cout << "   Possible Collisions: " << (numberOfBalls * (numberOfBalls - 1)) / 2 << std::endl;
+    double runSeconds = 0, driftSum = 0;
+    long long collisions = 0;
+    size_t worst = 0;
+    MotionStats speeds;
+    for (size_t k = 0; k < runs.size(); k++) {
+        runSeconds += runs[k].seconds;
+        collisions += runs[k].collisions;
+        driftSum += std::abs(runs[k].energyDrift);
+        speeds.add(runs[k].motion);
+        if (std::abs(runs[k].energyDrift) > std::abs(runs[worst].energyDrift)) worst = k;
+    }
+    
+    std::cout << "\n📈 ENSEMBLE RESULTS:" << std::endl;
+    std::cout << "   Wall time: " << seconds << " s (" << (seconds > 0 ? runs.size() / seconds : 0) << " runs/s; "
+              << runSeconds << " s summed over the runs, " << pool.getSteals() << " steals)" << std::endl;
+    std::cout << "   Collisions: " << collisions << " (" << collisions / (double)runs.size() << " per run)" << std::endl;
+    std::cout << "   Energy drift: " << driftSum / runs.size() << " % mean |drift|, worst " << runs[worst].energyDrift
+              << " % (run " << worst << ", line " << runs[worst].line << ", seed " << runs[worst].config.seed << ")" << std::endl;
+    std::cout << "   Speed distribution - Slow(<100): " << speeds.slow << ", Medium(100-150): " << speeds.medium
+              << ", Fast(>150): " << speeds.fast << std::endl;
+    
+    if (!config.resultsPath.empty()) {
+        const std::string& path = config.resultsPath;
+        bool json = path.size() >= 5 && path.compare(path.size() - 5, 5, ".json") == 0;
+        if (!(json ? writeEnsembleJson(path, runs, threads, seconds) : writeEnsembleCsv(path, runs))) {
+            std::cout << "❌ Could not write " << path << std::endl;
+            return 1;
+        }
+        std::cout << "\n💾 Results written to " << path << std::endl;
+    }
+    return 0;
+}
+
+#ifndef PHYSICS_SIM_NO_SDL
+// Interactive SDL run in precision T
+template <typename T>
+int runWindowed(const SimulationConfig& config) {
+    int numberOfBalls = config.numberOfBalls;
+    double minRadius = config.minRadius;
+    double maxRadius = config.maxRadius;
+    const int WINDOW_WIDTH = config.width;
+    const int WINDOW_HEIGHT = config.height;
     
     // Initialize SDL
     if (SDL_Init(SDL_INIT_VIDEO) < 0) {
@@ -368,14 +785,6 @@ int main(int argc, char* argv[]) {
         return -1;
     }
     
-    // Calculate window size based on number of balls
-    int WINDOW_WIDTH = std::max(800, (int)(400 + sqrt(numberOfBalls) * 60));
-    int WINDOW_HEIGHT = std::max(600, (int)(300 + sqrt(numberOfBalls) * 45));
-    
-    // Cap window size for very large numbers
-    WINDOW_WIDTH = std::min(WINDOW_WIDTH, 1920);
-    WINDOW_HEIGHT = std::min(WINDOW_HEIGHT, 1080);
-    
     std::string windowTitle = "🔥 NEON PHYSICS: " + std::to_string(numberOfBalls) + 
                              " BALLS (Size: " + std::to_string((int)minRadius) + 
                              "-" + std::to_string((int)maxRadius) + ") 🔥";
@@ -407,40 +816,131 @@ int main(int argc, char* argv[]) {
     }
     
     // Create physics simulation
-    PhysicsSimulation simulation(WINDOW_WIDTH, WINDOW_HEIGHT, numberOfBalls, minRadius, maxRadius);
+    PhysicsSimulation<T> simulation(WINDOW_WIDTH, WINDOW_HEIGHT, numberOfBalls, minRadius, maxRadius,
+                                 config.broadPhase, config.seed);
+    simulation.setThreadCount(config.threads);
+    simulation.setContinuousCollisions(config.continuous);
+    simulation.setSleeping(config.sleepSpeed, config.sleepTime);
+    simulation.setReorderInterval(config.reorderInterval);
+    simulation.setUniformMass(config.mass);
+    if (config.gpu && !simulation.setGpuEnabled(true)) std::cout << "⚠️  Stepping on the CPU instead" << std::endl;
+    if (!config.loadPath.empty()) loadSnapshotFile(simulation, config.loadPath);
     
-    // Game loop variables
-    bool running = true;
-    SDL_Event event;
+    TrajectoryRecorder<T> recorder;
+    if (!config.recordPath.empty()) {
+        if (recorder.open(config.recordPath, simulation.getBalls(), WINDOW_WIDTH, WINDOW_HEIGHT)) {
+            simulation.setRecorder(&recorder);
+        } else {
+            std::cout << "❌ Cannot open trajectory file: " << config.recordPath << std::endl;
+        }
+    }
+    StateStreamer<T> streamer;
+    if (config.streamPort > 0) {
+        if (streamer.open(config.streamPort, config.streamRate)) {
+            simulation.setStreamer(&streamer);
+        } else {
+            std::cout << "❌ Cannot listen on port " << config.streamPort << std::endl;
+        }
+    }
     
-    // High precision timing
-    Uint64 currentTime = SDL_GetPerformanceCounter();
-    Uint64 lastTime = 0;
-    double deltaTime;
+    // Snapshots are written in the background so a frame never waits on disk
+    SnapshotWriter snapshots;
+    const std::string SNAPSHOT_PATH = config.savePath.empty() ? "snapshot.bin" : config.savePath;
+    const std::string TRACE_PATH = config.tracePath.empty() ? "trace.json" : config.tracePath;
+    if (!config.tracePath.empty()) Profiler::global().startTrace();
     
-    // FPS tracking
-    const double TARGET_FPS = 60.0;
-    const double FRAME_TIME = 1.0 / TARGET_FPS;
+    // Fixed-step physics: wall-clock time is accumulated and consumed in steps of
+    // exactly config.dt, independent of how fast frames are rendered
+    const double PHYSICS_DT = config.dt;
+    const int MAX_SUBSTEPS = config.maxSubsteps;
+    simulation.setInterpolation(true);
     
     std::cout << "\n🎮 CONTROLS:" << std::endl;
     std::cout << "SPACE - Reset simulation (new random chaos!)" << std::endl;
     std::cout << "S     - Show detailed statistics" << std::endl;
+    std::cout << "B     - Cycle broad phase (parallel grid / uniform grid / hierarchical grid / sweep and prune / brute force)" << std::endl;
+    std::cout << "C     - Toggle event-driven continuous collision detection" << std::endl;
+    std::cout << "W     - Write a snapshot to " << SNAPSHOT_PATH << std::endl;
+    std::cout << "P     - Toggle the profiler HUD" << std::endl;
+    std::cout << "T     - Start / stop a trace capture to " << TRACE_PATH << std::endl;
     std::cout << "ESC   - Exit simulation" << std::endl;
     std::cout << "\n🚀 NEON CHAOS ACTIVATED!" << std::endl;
     std::cout << "Initial total energy: " << simulation.getTotalEnergy() << std::endl;
     
-    // Main game loop
-    while (running) {
-        // Calculate high-precision delta time
-        lastTime = currentTime;
-        currentTime = SDL_GetPerformanceCounter();
-        deltaTime = (double)(currentTime - lastTime) / SDL_GetPerformanceFrequency();
+    TelemetryReporter<PhysicsSimulation<T>> reporter(simulation, config.reportInterval);
+    
+    // Physics runs on its own thread and hands finished states to this one
+    // through a triple buffer, so a step never waits for VSYNC and a frame
+    // never waits for a step. SDL stays on the main thread (window events and
+    // the renderer belong there); key presses become commands that the
+    // physics thread runs between steps.
+    TripleBuffer<RenderState<T>> states;
+    std::mutex commandMutex;
+    std::vector<std::function<void()>> commands;
+    std::atomic<bool> running(true);
+    
+    auto sendCommand = [&](std::function<void()> command) {
+        std::lock_guard<std::mutex> lock(commandMutex);
+        commands.push_back(std::move(command));
+    };
+    
+    std::thread physics([&] {
+        std::vector<std::function<void()>> pending;
+        double accumulator = 0;
+        long long nextEnergyCheck = (long long)(10 / PHYSICS_DT);
+        auto lastTime = std::chrono::steady_clock::now();
         
-        // Cap delta time to prevent large jumps
-        if (deltaTime > FRAME_TIME * 2) {
-            deltaTime = FRAME_TIME;
-        }
+        simulation.captureRenderState(states.writeSlot());
+        states.publish();
         
+        while (running) {
+            {
+                std::lock_guard<std::mutex> lock(commandMutex);
+                pending.swap(commands);
+            }
+            for (std::function<void()>& command : pending) command();
+            pending.clear();
+            
+            auto now = std::chrono::steady_clock::now();
+            accumulator += std::chrono::duration<double>(now - lastTime).count();
+            lastTime = now;
+            
+            // Run as many fixed steps as the elapsed time allows
+            int substeps = 0;
+            while (accumulator >= PHYSICS_DT && substeps < MAX_SUBSTEPS) {
+                simulation.update(PHYSICS_DT);
+                accumulator -= PHYSICS_DT;
+                substeps++;
+            }
+            
+            // Physics can't keep up: drop the backlog instead of spiralling
+            if (accumulator >= PHYSICS_DT) {
+                accumulator = fmod(accumulator, PHYSICS_DT);
+            }
+            
+            if (substeps > 0) {
+                simulation.captureRenderState(states.writeSlot());
+                states.publish();
+            } else {
+                // Ahead of the clock: sleep until the next step is due
+                std::this_thread::sleep_for(std::chrono::duration<double>(PHYSICS_DT - accumulator));
+            }
+            
+            // Print energy conservation check every 10 simulated seconds
+            if (simulation.getStepCount() >= nextEnergyCheck) {
+                nextEnergyCheck = simulation.getStepCount() + (long long)(10 / PHYSICS_DT);
+                std::cout << "🔋 Energy conservation check: " << simulation.getTotalEnergy() 
+                          << " | Total collisions: " << simulation.getCollisionCount() << std::endl;
+            }
+        }
+    });
+    
+    FrameRenderer<T> frames;
+    frames.setProfileHud(config.profile);
+    SDL_Event event;
+    
+    // Main game loop: events and rendering at the display rate
+    while (running) {
         // Handle events
         while (SDL_PollEvent(&event)) {
             if (event.type == SDL_QUIT) {
@@ -451,31 +951,70 @@ int main(int argc, char* argv[]) {
                     std::cout << "Thanks for the neon chaos experience! 🌈✨" << std::endl;
                     running = false;
                 } else if (event.key.keysym.sym == SDLK_SPACE) {
-                    simulation.reset();
+                    sendCommand([&] { simulation.reset(); });
                 } else if (event.key.keysym.sym == SDLK_s) {
-                    simulation.printStats();
+                    sendCommand([&] {
+                        simulation.syncFromDevice();
+                        simulation.printStats();
+                    });
+                } else if (event.key.keysym.sym == SDLK_b) {
+                    sendCommand([&] {
+                        BroadPhase next;
+                        switch (simulation.getBroadPhase()) {
+                            case BroadPhase::ParallelGrid: next = BroadPhase::UniformGrid; break;
+                            case BroadPhase::UniformGrid:  next = BroadPhase::HierarchicalGrid; break;
+                            case BroadPhase::HierarchicalGrid: next = BroadPhase::SweepAndPrune; break;
+                            case BroadPhase::SweepAndPrune: next = BroadPhase::BruteForce; break;
+                            default:                       next = BroadPhase::ParallelGrid; break;
+                        }
+                        simulation.setBroadPhase(next);
+                        std::cout << "🧮 Broad phase: " << broadPhaseName(next) << std::endl;
+                    });
+                } else if (event.key.keysym.sym == SDLK_c) {
+                    sendCommand([&] {
+                        simulation.setContinuousCollisions(!simulation.getContinuousCollisions());
+                        std::cout << "⏳ Continuous collisions: "
+                                  << (simulation.getContinuousCollisions() ? "on" : "off") << std::endl;
+                    });
+                } else if (event.key.keysym.sym == SDLK_w) {
+                    sendCommand([&] {
+                        simulation.syncFromDevice();
+                        snapshots.write(simulation.writeSnapshot(), SNAPSHOT_PATH);
+                    });
+                } else if (event.key.keysym.sym == SDLK_p || event.key.keysym.sym == SDLK_t) {
+                    if (!PROFILER_AVAILABLE) {
+                        std::cout << "❌ Built without the profiler (PHYSICS_SIM_PROFILE)" << std::endl;
+                    } else if (event.key.keysym.sym == SDLK_p) {
+                        frames.setProfileHud(!frames.getProfileHud());
+                    } else if (Profiler::global().isTracing()) {
+                        finishTrace(TRACE_PATH);
+                    } else {
+                        Profiler::global().startTrace();
+                        std::cout << "🧵 Tracing..." << std::endl;
+                    }
                 }
             }
         }
         
-        // Update physics with precise timing
-        simulation.update(deltaTime);
-        
-        // Render
-        simulation.render(renderer);
-        
-        // Print energy conservation check every 10 seconds
-        static int frameCount = 0;
-        if (++frameCount % (int)(TARGET_FPS * 10) == 0) {
-            std::cout << "🔋 Energy conservation check: " << simulation.getTotalEnergy() 
-                      << " | Total collisions: " << simulation.getCollisionCount() << std::endl;
-        }
+        // Latest complete state, interpolated by the time since its step finished
+        states.acquire();
+        const RenderState<T>& state = states.readSlot();
+        double sinceStep = std::chrono::duration<double>(std::chrono::steady_clock::now() - state.time).count();
+        frames.draw(renderer, state, std::min(1.0, sinceStep / PHYSICS_DT), WINDOW_WIDTH, WINDOW_HEIGHT);
     }
+    physics.join();
+    if (Profiler::global().isTracing()) finishTrace(TRACE_PATH);
     
     // Final stats
+    simulation.syncFromDevice();
     simulation.printStats();
+    simulation.setRecorder(nullptr);
+    recorder.close();
+    simulation.setStreamer(nullptr);
+    streamer.close();
     
     // Cleanup
+    frames.release();
     SDL_DestroyRenderer(renderer);
     SDL_DestroyWindow(window);
     SDL_Quit();
@@ -483,4 +1022,159 @@ int main(int argc, char* argv[]) {
     std::cout << "\n🎯 NEON BALL SIMULATION ENDED!" << std::endl;
     std::cout << "Thanks for experiencing the chaos! ✨💫🔥" << std::endl;
     return 0;
-}
\ No newline at end of file
+}
+
+// Window onto a --stream server: draws the frames it receives, interpolated
+// over the interval they arrive at, and simulates nothing itself
+int runViewer(const SimulationConfig& config) {
+    StreamViewer viewer;
+    if (!viewer.connect(config.connectAddress)) return 1;
+    
+    if (SDL_Init(SDL_INIT_VIDEO) < 0) {
+        std::cout << "SDL initialization failed: " << SDL_GetError() << std::endl;
+        viewer.close();
+        return -1;
+    }
+    
+    std::string windowTitle = "📺 NEON PHYSICS VIEWER: " + config.connectAddress;
+    SDL_Window* window = SDL_CreateWindow(
+        windowTitle.c_str(),
+        SDL_WINDOWPOS_CENTERED,
+        SDL_WINDOWPOS_CENTERED,
+        viewer.getWidth(),
+        viewer.getHeight(),
+        SDL_WINDOW_SHOWN
+    );
+    if (!window) {
+        std::cout << "Window creation failed: " << SDL_GetError() << std::endl;
+        SDL_Quit();
+        viewer.close();
+        return -1;
+    }
+    
+    SDL_Renderer* renderer = SDL_CreateRenderer(window, -1, 
+        SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC);
+    if (!renderer) {
+        std::cout << "Renderer creation failed: " << SDL_GetError() << std::endl;
+        SDL_DestroyWindow(window);
+        SDL_Quit();
+        viewer.close();
+        return -1;
+    }
+    
+    FrameRenderer<float> frames;
+    SDL_Event event;
+    bool running = true;
+    while (running) {
+        while (SDL_PollEvent(&event)) {
+            if (event.type == SDL_QUIT ||
+                (event.type == SDL_KEYDOWN && event.key.keysym.sym == SDLK_ESCAPE)) {
+                running = false;
+            }
+        }
+        if (!viewer.isConnected()) {
+            std::cout << "📺 The stream ended" << std::endl;
+            break;
+        }
+        
+        // Blend towards the newest frame over the time the next one should take
+        viewer.acquire();
+        const RenderState<float>& state = viewer.current();
+        double sinceFrame = std::chrono::duration<double>(std::chrono::steady_clock::now() - state.time).count();
+        double interval = viewer.frameInterval();
+        double alpha = interval > 0 ? std::min(1.0, sinceFrame / interval) : 1.0;
+        frames.draw(renderer, state, alpha, viewer.getWidth(), viewer.getHeight());
+    }
+    
+    frames.release();
+    SDL_DestroyRenderer(renderer);
+    SDL_DestroyWindow(window);
+    SDL_Quit();
+    viewer.close();
+    return 0;
+}
+#endif
+
+int main(int argc, char* argv[]) {
+    SimulationConfig config;
+    
+    if (argc == 1) {
+        promptForConfig(config);
+    } else {
+        // A config file is applied first so flags always override it
+        for (int i = 1; i + 1 < argc; i++) {
+            if (std::string(argv[i]) == "--config" && !loadConfigFile(argv[i + 1], config)) return 1;
+        }
+        
+        for (int i = 1; i < argc; i++) {
+            std::string arg = argv[i];
+            if (arg == "--help") {
+                printUsage(argv[0]);
+                return 0;
+            } else if (arg == "--headless") {
+                config.headless = true;
+            } else if (arg == "--ccd") {
+                config.continuous = true;
+            } else if (arg == "--gpu") {
+                config.gpu = true;
+            } else if (arg == "--bench-narrowphase") {
+                config.narrowPhaseBenchmark = true;
+            } else if (arg == "--profile") {
+                config.profile = true;
+            } else if (arg.compare(0, 2, "--") == 0 && i + 1 < argc) {
+                std::string value = argv[++i];
+                if (arg != "--config" && !applyConfigOption(config, arg.substr(2), value)) return 1;
+            } else {
+                printUsage(argv[0]);
+                return 1;
+            }
+        }
+    }
+    if (!config.inspectPath.empty()) return inspectTrajectory(config);
+    if (!config.ensemblePath.empty()) return runEnsemble(config);
+    if (!config.connectAddress.empty()) {
+#ifndef PHYSICS_SIM_NO_SDL
+        return runViewer(config);
+#else
+        std::cout << "❌ Built without SDL: --connect needs the windowed build" << std::endl;
+        return 1;
+#endif
+    }
+    if (!config.loadPath.empty() && !applySnapshotConfig(config)) return 1;
+#ifdef PHYSICS_SIM_NO_SDL
+    // Built without SDL: there is no window, so every run is headless
+    config.headless = true;
+#endif
+    validateConfig(config);
+    
+    int numberOfBalls = config.numberOfBalls;
+    double minRadius = config.minRadius;
+    double maxRadius = config.maxRadius;
+    const int WINDOW_WIDTH = config.width;
+    const int WINDOW_HEIGHT = config.height;
+    
+    std::cout << "\n✅ SIMULATION CONFIGURED:" << std::endl;
+    std::cout << "   Balls: " << numberOfBalls << std::endl;
+    std::cout << "   Radius Range: " << minRadius << " - " << maxRadius << std::endl;
+    std::cout << "   World: " << WINDOW_WIDTH << " x " << WINDOW_HEIGHT << std::endl;
+    std::cout << "   Possible Collisions: " << ((long long)numberOfBalls * (numberOfBalls - 1)) / 2 << std::endl;
+    
+    if (config.headless) {
+        if (!config.tracePath.empty()) Profiler::global().startTrace();
+        switch (config.precision) {
+            case Precision::Both:  comparePrecisions(config); break;
+            case Precision::Float: runHeadless<float>(config); break;
+            default:               runHeadless<double>(config); break;
+        }
+        if (!config.tracePath.empty()) finishTrace(config.tracePath);
+        return 0;
+    }
+    
+#ifndef PHYSICS_SIM_NO_SDL
+    // Comparing only makes sense headless; a window runs the reference precision
+    if (config.precision == Precision::Float) return runWindowed<float>(config);
+    return runWindowed<double>(config);
+#else
+    return 0;
+#endif
+}
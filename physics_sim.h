@@ -0,0 +1,6765 @@
+// Simulation core: vectors and balls, the step kernels, ball storage, scene
+// generation, broad phases, CCD, rendering, snapshots and trajectories, and
+// PhysicsSimulation itself, and its domain-decomposed counterpart. Shared by
+// the simulator and the benchmark suite.
+#ifndef PHYSICS_SIM_H
+#define PHYSICS_SIM_H
+
+#include <cmath>
+#include <iostream>
+#include <vector>
+#include <random>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+
+// Headless builds (PHYSICS_SIM_NO_SDL) do not need SDL at all: outside the
+// renderer only the colour type is used, declared here with SDL's layout
+#ifdef PHYSICS_SIM_NO_SDL
+struct SDL_Color {
+    uint8_t r, g, b, a;
+};
+#else
+#include <SDL2/SDL.h>
+#endif
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <windows.h>
+#else
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/mman.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Optional OpenCL compute backend (CMake option PHYSICS_SIM_OPENCL)
+#ifdef PHYSICS_SIM_OPENCL
+#define CL_TARGET_OPENCL_VERSION 120
+#ifdef __APPLE__
+#include <OpenCL/opencl.h>
+#else
+#include <CL/cl.h>
+#endif
+#endif
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define PHYSICS_SIM_X86 1
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#elif defined(__aarch64__) || defined(_M_ARM64)
+#define PHYSICS_SIM_NEON 1
+#include <arm_neon.h>
+#endif
+
+// Lets the AVX2 kernels be compiled without building the whole program for AVX2
+#if defined(PHYSICS_SIM_X86) && (defined(__GNUC__) || defined(__clang__))
+#define PHYSICS_SIM_TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define PHYSICS_SIM_TARGET_AVX2
+#endif
+
+// The simulation core is templated on its scalar type. double is the reference;
+// float halves the memory traffic and doubles the SIMD lane count.
+template <typename T>
+struct Vector2D {
+    T x, y;
+    
+    Vector2D(T x = 0, T y = 0) : x(x), y(y) {}
+    
+    Vector2D operator+(const Vector2D& other) const {
+        return Vector2D(x + other.x, y + other.y);
+    }
+    
+    Vector2D operator-(const Vector2D& other) const {
+        return Vector2D(x - other.x, y - other.y);
+    }
+    
+    Vector2D operator*(T scalar) const {
+        return Vector2D(x * scalar, y * scalar);
+    }
+    
+    T dot(const Vector2D& other) const {
+        return x * other.x + y * other.y;
+    }
+    
+    T length() const {
+        return std::sqrt(x * x + y * y);
+    }
+    
+    Vector2D normalize() const {
+        T len = length();
+        if (len == 0) return Vector2D(0, 0);
+        return Vector2D(x / len, y / len);
+    }
+};
+
+template <typename T>
+class Ball {
+public:
+    Vector2D<T> position;
+    Vector2D<T> velocity;
+    T radius;
+    T mass;
+    T inverseMass;      // Cached 1 / mass, so collisions multiply instead of divide
+    SDL_Color color;
+    int id;
+    
+    Ball(int ballId, T x, T y, T vx, T vy, T r, T m, SDL_Color c)
+        : position(x, y), velocity(vx, vy), radius(r), mass(m), inverseMass(T(1) / m), color(c), id(ballId) {}
+    
+    void update(T dt) {
+        // Pure constant velocity motion - no forces applied
+        position = position + velocity * dt;
+    }
+    
+    void bounceOffWalls(int windowWidth, int windowHeight) {
+        // Perfect elastic collision with walls
+        if (position.x - radius <= 0) {
+            position.x = radius;
+            velocity.x = -velocity.x;  // Perfect reflection
+        } else if (position.x + radius >= windowWidth) {
+            position.x = windowWidth - radius;
+            velocity.x = -velocity.x;  // Perfect reflection
+        }
+        
+        if (position.y - radius <= 0) {
+            position.y = radius;
+            velocity.y = -velocity.y;  // Perfect reflection
+        } else if (position.y + radius >= windowHeight) {
+            position.y = windowHeight - radius;
+            velocity.y = -velocity.y;  // Perfect reflection
+        }
+    }
+    
+    // Squared distance against squared reach: no sqrt for the (many) misses
+    bool isCollidingWith(const Ball& other) const {
+        Vector2D<T> distance = position - other.position;
+        T reach = radius + other.radius;
+        return distance.dot(distance) <= reach * reach;
+    }
+    
+    void resolveCollision(Ball& other) {
+        Vector2D<T> distance = position - other.position;
+        T d = distance.length();
+        
+        // Avoid division by zero
+        if (d == 0) {
+            distance = Vector2D<T>(1, 0);
+            d = 1;
+        }
+        
+        // Normalize collision vector
+        Vector2D<T> normal = distance * (T(1) / d);
+        
+        // Separate overlapping balls, each moving in proportion to its inverse mass
+        T overlap = (radius + other.radius) - d;
+        T reducedMass = T(1) / (inverseMass + other.inverseMass);
+        T push = overlap * reducedMass;
+        
+        position = position + normal * (push * inverseMass);
+        other.position = other.position - normal * (push * other.inverseMass);
+        
+        // Calculate relative velocity
+        Vector2D<T> relativeVelocity = velocity - other.velocity;
+        
+        // Calculate collision impulse using conservation of momentum
+        T velocityAlongNormal = relativeVelocity.dot(normal);
+        
+        // Do not resolve if velocities are separating
+        if (velocityAlongNormal > 0) return;
+        
+        // Perfect elastic collision - no energy loss
+        T impulse = 2 * velocityAlongNormal * reducedMass;
+        
+        // Apply impulse to conserve momentum perfectly
+        velocity = velocity - normal * (impulse * inverseMass);
+        other.velocity = other.velocity + normal * (impulse * other.inverseMass);
+    }
+    
+#ifndef PHYSICS_SIM_NO_SDL
+    void render(SDL_Renderer* renderer) {
+        SDL_SetRenderDrawColor(renderer, color.r, color.g, color.b, color.a);
+        
+        // Optimized circle drawing
+        int r = (int)radius;
+        int x = (int)position.x;
+        int y = (int)position.y;
+        
+        // Use a more efficient circle drawing algorithm
+        for (int dy = -r; dy <= r; dy++) {
+            int width = (int)std::sqrt(r*r - dy*dy);
+            SDL_RenderDrawLine(renderer, x - width, y + dy, x + width, y + dy);
+        }
+    }
+#endif
+};
+
+// Running totals of the quantities watched for conservation: kinetic energy,
+// momentum and the speed histogram printed by printStats. The same struct holds
+// the change made by a batch of velocity updates, so a collision only has to
+// take both balls out, change them and put them back in. Summed in double for
+// every precision; speeds are binned on their square, so no sqrt is needed.
+struct MotionStats {
+    double energy;
+    double momentumX, momentumY;
+    long long slow, medium, fast;   // Below 100, 100 - 150 and above 150 px/s
+    
+    MotionStats() {
+        clear();
+    }
+    
+    void clear() {
+        energy = 0;
+        momentumX = momentumY = 0;
+        slow = medium = fast = 0;
+    }
+    
+    void addBall(double m, double vx, double vy) {
+        double speedSquared = vx * vx + vy * vy;
+        energy += 0.5 * m * speedSquared;
+        momentumX += m * vx;
+        momentumY += m * vy;
+        speedBin(speedSquared)++;
+    }
+    
+    void removeBall(double m, double vx, double vy) {
+        double speedSquared = vx * vx + vy * vy;
+        energy -= 0.5 * m * speedSquared;
+        momentumX -= m * vx;
+        momentumY -= m * vy;
+        speedBin(speedSquared)--;
+    }
+    
+    void add(const MotionStats& other) {
+        energy += other.energy;
+        momentumX += other.momentumX;
+        momentumY += other.momentumY;
+        slow += other.slow;
+        medium += other.medium;
+        fast += other.fast;
+    }
+    
+private:
+    long long& speedBin(double speedSquared) {
+        if (speedSquared < 100.0 * 100.0) return slow;
+        if (speedSquared < 150.0 * 150.0) return medium;
+        return fast;
+    }
+};
+
+// ---------------------------------------------------------------------------
+// Per-ball step kernels over the hot SoA arrays. The scalar versions are the
+// reference; the SIMD versions replace the branches with masked blends but do
+// exactly the same arithmetic (no FMA), so every variant gives identical results.
+// The wall kernels add the momentum the walls hand back to motion; a reflection
+// only flips a sign, so energy and speeds are untouched. Flips are added ball by
+// ball, x before y, in every variant, so the sums are identical too.
+// ---------------------------------------------------------------------------
+
+template <typename T>
+void integrateScalar(T* x, T* y, const T* vx, const T* vy, size_t n, T dt) {
+    // Pure constant velocity motion - no forces applied
+    for (size_t i = 0; i < n; i++) {
+        x[i] = x[i] + vx[i] * dt;
+        y[i] = y[i] + vy[i] * dt;
+    }
+}
+
+template <typename T>
+void bounceOffWallsScalar(T* x, T* y, T* vx, T* vy, const T* r, const T* m, size_t n,
+                          T width, T height, MotionStats& motion) {
+    // Perfect elastic collision with walls, same rules as Ball::bounceOffWalls
+    for (size_t i = 0; i < n; i++) {
+        if (x[i] - r[i] <= 0) {
+            x[i] = r[i];
+            vx[i] = -vx[i];
+            motion.momentumX += 2.0 * m[i] * vx[i];
+        } else if (x[i] + r[i] >= width) {
+            x[i] = width - r[i];
+            vx[i] = -vx[i];
+            motion.momentumX += 2.0 * m[i] * vx[i];
+        }
+        
+        if (y[i] - r[i] <= 0) {
+            y[i] = r[i];
+            vy[i] = -vy[i];
+            motion.momentumY += 2.0 * m[i] * vy[i];
+        } else if (y[i] + r[i] >= height) {
+            y[i] = height - r[i];
+            vy[i] = -vy[i];
+            motion.momentumY += 2.0 * m[i] * vy[i];
+        }
+    }
+}
+
+// Momentum change of the lanes a SIMD block flipped, given as lane bit masks.
+// Walls are hit rarely, so the blocks only come here when a mask is non-zero.
+template <typename T>
+static inline void addWallFlips(const T* vx, const T* vy, const T* m, int lanes,
+                                unsigned flipsX, unsigned flipsY, MotionStats& motion) {
+    for (int lane = 0; lane < lanes; lane++) {
+        if (flipsX & (1u << lane)) motion.momentumX += 2.0 * m[lane] * vx[lane];
+        if (flipsY & (1u << lane)) motion.momentumY += 2.0 * m[lane] * vy[lane];
+    }
+}
+
+#ifdef PHYSICS_SIM_X86
+PHYSICS_SIM_TARGET_AVX2
+inline void integrateAVX2(double* x, double* y, const double* vx, const double* vy, size_t n, double dt) {
+    const __m256d step = _mm256_set1_pd(dt);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256d px = _mm256_add_pd(_mm256_loadu_pd(x + i), _mm256_mul_pd(_mm256_loadu_pd(vx + i), step));
+        __m256d py = _mm256_add_pd(_mm256_loadu_pd(y + i), _mm256_mul_pd(_mm256_loadu_pd(vy + i), step));
+        _mm256_storeu_pd(x + i, px);
+        _mm256_storeu_pd(y + i, py);
+    }
+    integrateScalar(x + i, y + i, vx + i, vy + i, n - i, dt);
+}
+
+PHYSICS_SIM_TARGET_AVX2
+inline void integrateAVX2(float* x, float* y, const float* vx, const float* vy, size_t n, float dt) {
+    const __m256 step = _mm256_set1_ps(dt);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256 px = _mm256_add_ps(_mm256_loadu_ps(x + i), _mm256_mul_ps(_mm256_loadu_ps(vx + i), step));
+        __m256 py = _mm256_add_ps(_mm256_loadu_ps(y + i), _mm256_mul_ps(_mm256_loadu_ps(vy + i), step));
+        _mm256_storeu_ps(x + i, px);
+        _mm256_storeu_ps(y + i, py);
+    }
+    integrateScalar(x + i, y + i, vx + i, vy + i, n - i, dt);
+}
+
+// Clamp-and-reflect one axis: the low wall wins, the high wall only applies
+// where the low one did not (the "else if" of the scalar code)
+PHYSICS_SIM_TARGET_AVX2
+static inline __m256d reflectAxisAVX2(__m256d& p, __m256d& v, __m256d rad, __m256d limit) {
+    const __m256d zero = _mm256_setzero_pd();
+    const __m256d signBit = _mm256_set1_pd(-0.0);
+    
+    __m256d hitLow = _mm256_cmp_pd(_mm256_sub_pd(p, rad), zero, _CMP_LE_OQ);
+    __m256d hitHigh = _mm256_andnot_pd(hitLow, _mm256_cmp_pd(_mm256_add_pd(p, rad), limit, _CMP_GE_OQ));
+    
+    p = _mm256_blendv_pd(p, rad, hitLow);
+    p = _mm256_blendv_pd(p, _mm256_sub_pd(limit, rad), hitHigh);
+    __m256d hit = _mm256_or_pd(hitLow, hitHigh);
+    v = _mm256_blendv_pd(v, _mm256_xor_pd(v, signBit), hit);
+    return hit;
+}
+
+PHYSICS_SIM_TARGET_AVX2
+static inline __m256 reflectAxisAVX2(__m256& p, __m256& v, __m256 rad, __m256 limit) {
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 signBit = _mm256_set1_ps(-0.0f);
+    
+    __m256 hitLow = _mm256_cmp_ps(_mm256_sub_ps(p, rad), zero, _CMP_LE_OQ);
+    __m256 hitHigh = _mm256_andnot_ps(hitLow, _mm256_cmp_ps(_mm256_add_ps(p, rad), limit, _CMP_GE_OQ));
+    
+    p = _mm256_blendv_ps(p, rad, hitLow);
+    p = _mm256_blendv_ps(p, _mm256_sub_ps(limit, rad), hitHigh);
+    __m256 hit = _mm256_or_ps(hitLow, hitHigh);
+    v = _mm256_blendv_ps(v, _mm256_xor_ps(v, signBit), hit);
+    return hit;
+}
+
+PHYSICS_SIM_TARGET_AVX2
+inline void bounceOffWallsAVX2(double* x, double* y, double* vx, double* vy, const double* r, const double* m,
+                               size_t n, double width, double height, MotionStats& motion) {
+    const __m256d w = _mm256_set1_pd(width);
+    const __m256d h = _mm256_set1_pd(height);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256d rad = _mm256_loadu_pd(r + i);
+        __m256d px = _mm256_loadu_pd(x + i), pvx = _mm256_loadu_pd(vx + i);
+        __m256d py = _mm256_loadu_pd(y + i), pvy = _mm256_loadu_pd(vy + i);
+        
+        unsigned flipsX = (unsigned)_mm256_movemask_pd(reflectAxisAVX2(px, pvx, rad, w));
+        unsigned flipsY = (unsigned)_mm256_movemask_pd(reflectAxisAVX2(py, pvy, rad, h));
+        
+        _mm256_storeu_pd(x + i, px);
+        _mm256_storeu_pd(vx + i, pvx);
+        _mm256_storeu_pd(y + i, py);
+        _mm256_storeu_pd(vy + i, pvy);
+        if (flipsX | flipsY) addWallFlips(vx + i, vy + i, m + i, 4, flipsX, flipsY, motion);
+    }
+    bounceOffWallsScalar(x + i, y + i, vx + i, vy + i, r + i, m + i, n - i, width, height, motion);
+}
+
+PHYSICS_SIM_TARGET_AVX2
+inline void bounceOffWallsAVX2(float* x, float* y, float* vx, float* vy, const float* r, const float* m,
+                               size_t n, float width, float height, MotionStats& motion) {
+    const __m256 w = _mm256_set1_ps(width);
+    const __m256 h = _mm256_set1_ps(height);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256 rad = _mm256_loadu_ps(r + i);
+        __m256 px = _mm256_loadu_ps(x + i), pvx = _mm256_loadu_ps(vx + i);
+        __m256 py = _mm256_loadu_ps(y + i), pvy = _mm256_loadu_ps(vy + i);
+        
+        unsigned flipsX = (unsigned)_mm256_movemask_ps(reflectAxisAVX2(px, pvx, rad, w));
+        unsigned flipsY = (unsigned)_mm256_movemask_ps(reflectAxisAVX2(py, pvy, rad, h));
+        
+        _mm256_storeu_ps(x + i, px);
+        _mm256_storeu_ps(vx + i, pvx);
+        _mm256_storeu_ps(y + i, py);
+        _mm256_storeu_ps(vy + i, pvy);
+        if (flipsX | flipsY) addWallFlips(vx + i, vy + i, m + i, 8, flipsX, flipsY, motion);
+    }
+    bounceOffWallsScalar(x + i, y + i, vx + i, vy + i, r + i, m + i, n - i, width, height, motion);
+}
+
+// Runtime check for AVX2 (including OS support for the YMM state)
+inline bool cpuSupportsAVX2() {
+#if defined(__GNUC__) || defined(__clang__)
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+#elif defined(_MSC_VER)
+    int regs[4];
+    __cpuid(regs, 0);
+    if (regs[0] < 7) return false;
+    __cpuid(regs, 1);
+    bool osxsave = (regs[2] & (1 << 27)) != 0;
+    bool avx = (regs[2] & (1 << 28)) != 0;
+    if (!osxsave || !avx || (_xgetbv(0) & 0x6) != 0x6) return false;
+    __cpuidex(regs, 7, 0);
+    return (regs[1] & (1 << 5)) != 0;
+#else
+    return false;
+#endif
+}
+#endif
+
+#ifdef PHYSICS_SIM_NEON
+inline void integrateNEON(double* x, double* y, const double* vx, const double* vy, size_t n, double dt) {
+    const float64x2_t step = vdupq_n_f64(dt);
+    size_t i = 0;
+    for (; i + 2 <= n; i += 2) {
+        vst1q_f64(x + i, vaddq_f64(vld1q_f64(x + i), vmulq_f64(vld1q_f64(vx + i), step)));
+        vst1q_f64(y + i, vaddq_f64(vld1q_f64(y + i), vmulq_f64(vld1q_f64(vy + i), step)));
+    }
+    integrateScalar(x + i, y + i, vx + i, vy + i, n - i, dt);
+}
+
+inline void integrateNEON(float* x, float* y, const float* vx, const float* vy, size_t n, float dt) {
+    const float32x4_t step = vdupq_n_f32(dt);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        vst1q_f32(x + i, vaddq_f32(vld1q_f32(x + i), vmulq_f32(vld1q_f32(vx + i), step)));
+        vst1q_f32(y + i, vaddq_f32(vld1q_f32(y + i), vmulq_f32(vld1q_f32(vy + i), step)));
+    }
+    integrateScalar(x + i, y + i, vx + i, vy + i, n - i, dt);
+}
+
+static inline unsigned reflectAxisNEON(float64x2_t& p, float64x2_t& v, float64x2_t rad, float64x2_t limit) {
+    uint64x2_t hitLow = vcleq_f64(vsubq_f64(p, rad), vdupq_n_f64(0.0));
+    uint64x2_t hitHigh = vbicq_u64(vcgeq_f64(vaddq_f64(p, rad), limit), hitLow);
+    
+    p = vbslq_f64(hitLow, rad, p);
+    p = vbslq_f64(hitHigh, vsubq_f64(limit, rad), p);
+    uint64x2_t hit = vorrq_u64(hitLow, hitHigh);
+    v = vbslq_f64(hit, vnegq_f64(v), v);
+    return (unsigned)(vgetq_lane_u64(hit, 0) & 1) | (unsigned)(vgetq_lane_u64(hit, 1) & 1) << 1;
+}
+
+static inline unsigned reflectAxisNEON(float32x4_t& p, float32x4_t& v, float32x4_t rad, float32x4_t limit) {
+    uint32x4_t hitLow = vcleq_f32(vsubq_f32(p, rad), vdupq_n_f32(0.0f));
+    uint32x4_t hitHigh = vbicq_u32(vcgeq_f32(vaddq_f32(p, rad), limit), hitLow);
+    
+    p = vbslq_f32(hitLow, rad, p);
+    p = vbslq_f32(hitHigh, vsubq_f32(limit, rad), p);
+    uint32x4_t hit = vorrq_u32(hitLow, hitHigh);
+    v = vbslq_f32(hit, vnegq_f32(v), v);
+    if (vmaxvq_u32(hit) == 0) return 0;
+    return (vgetq_lane_u32(hit, 0) & 1) | (vgetq_lane_u32(hit, 1) & 1) << 1
+         | (vgetq_lane_u32(hit, 2) & 1) << 2 | (vgetq_lane_u32(hit, 3) & 1) << 3;
+}
+
+inline void bounceOffWallsNEON(double* x, double* y, double* vx, double* vy, const double* r, const double* m,
+                               size_t n, double width, double height, MotionStats& motion) {
+    const float64x2_t w = vdupq_n_f64(width);
+    const float64x2_t h = vdupq_n_f64(height);
+    size_t i = 0;
+    for (; i + 2 <= n; i += 2) {
+        float64x2_t rad = vld1q_f64(r + i);
+        float64x2_t px = vld1q_f64(x + i), pvx = vld1q_f64(vx + i);
+        float64x2_t py = vld1q_f64(y + i), pvy = vld1q_f64(vy + i);
+        
+        unsigned flipsX = reflectAxisNEON(px, pvx, rad, w);
+        unsigned flipsY = reflectAxisNEON(py, pvy, rad, h);
+        
+        vst1q_f64(x + i, px);
+        vst1q_f64(vx + i, pvx);
+        vst1q_f64(y + i, py);
+        vst1q_f64(vy + i, pvy);
+        if (flipsX | flipsY) addWallFlips(vx + i, vy + i, m + i, 2, flipsX, flipsY, motion);
+    }
+    bounceOffWallsScalar(x + i, y + i, vx + i, vy + i, r + i, m + i, n - i, width, height, motion);
+}
+
+inline void bounceOffWallsNEON(float* x, float* y, float* vx, float* vy, const float* r, const float* m,
+                               size_t n, float width, float height, MotionStats& motion) {
+    const float32x4_t w = vdupq_n_f32(width);
+    const float32x4_t h = vdupq_n_f32(height);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        float32x4_t rad = vld1q_f32(r + i);
+        float32x4_t px = vld1q_f32(x + i), pvx = vld1q_f32(vx + i);
+        float32x4_t py = vld1q_f32(y + i), pvy = vld1q_f32(vy + i);
+        
+        unsigned flipsX = reflectAxisNEON(px, pvx, rad, w);
+        unsigned flipsY = reflectAxisNEON(py, pvy, rad, h);
+        
+        vst1q_f32(x + i, px);
+        vst1q_f32(vx + i, pvx);
+        vst1q_f32(y + i, py);
+        vst1q_f32(vy + i, pvy);
+        if (flipsX | flipsY) addWallFlips(vx + i, vy + i, m + i, 4, flipsX, flipsY, motion);
+    }
+    bounceOffWallsScalar(x + i, y + i, vx + i, vy + i, r + i, m + i, n - i, width, height, motion);
+}
+#endif
+
+// Kernel table picked once from the CPU features. The SIMD kernels are
+// overloaded for float and double, so the table for T picks the right lanes.
+template <typename T>
+struct StepKernels {
+    const char* name;
+    void (*integrate)(T*, T*, const T*, const T*, size_t, T);
+    void (*bounceOffWalls)(T*, T*, T*, T*, const T*, const T*, size_t, T, T, MotionStats&);
+    
+    static StepKernels scalar() {
+        return {"scalar", integrateScalar<T>, bounceOffWallsScalar<T>};
+    }
+    
+    // Best variant for this CPU, or the scalar path when SIMD is not allowed
+    static StepKernels detect(bool allowSimd = true) {
+        if (!allowSimd) return scalar();
+#if defined(PHYSICS_SIM_X86)
+        if (cpuSupportsAVX2()) return {"AVX2", integrateAVX2, bounceOffWallsAVX2};
+#elif defined(PHYSICS_SIM_NEON)
+        return {"NEON", integrateNEON, bounceOffWallsNEON};
+#endif
+        return scalar();
+    }
+};
+
+// Render-only and bookkeeping data, kept out of the hot arrays
+struct BallInfo {
+    SDL_Color color;
+    int id;
+};
+
+// How BallStore::resolveCollision reads the masses. PerBallMass looks every
+// ball up; UniformMass holds the constants of a population where all balls
+// weigh the same, so a contact loads no mass and divides nothing. On such a
+// population both give bit-identical results.
+template <typename T>
+struct PerBallMass {
+    const T* m;
+    const T* invM;
+    
+    T mass(size_t i) const { return m[i]; }
+    T inverse(size_t i) const { return invM[i]; }
+    T reduced(size_t i, size_t j) const { return T(1) / (invM[i] + invM[j]); }
+};
+
+template <typename T>
+struct UniformMass {
+    T m;
+    T invM;
+    T reducedMass;  // 1 / (invM + invM), rounded as PerBallMass rounds it
+    
+    UniformMass() : m(1), invM(1), reducedMass(T(1) / (invM + invM)) {}
+    UniformMass(T mass, T inverseMass) : m(mass), invM(inverseMass), reducedMass(T(1) / (invM + invM)) {}
+    
+    T mass(size_t) const { return m; }
+    T inverse(size_t) const { return invM; }
+    T reduced(size_t, size_t) const { return reducedMass; }
+};
+
+// Structure-of-arrays ball storage. The integration, wall and collision passes
+// stream over the contiguous hot arrays only; colour and id live in a separate
+// cold array so they are never pulled through the cache during a step.
+template <typename T>
+class BallStore {
+public:
+    // Hot data
+    std::vector<T> x, y;
+    std::vector<T> vx, vy;
+    std::vector<T> r;
+    std::vector<T> m;
+    std::vector<T> invM;    // 1 / m, what the collision response actually uses
+    
+    // Cold data
+    std::vector<BallInfo> info;
+    
+    size_t size() const {
+        return x.size();
+    }
+    
+    size_t capacity() const {
+        return x.capacity();
+    }
+    
+    void clear() {
+        x.clear(); y.clear();
+        vx.clear(); vy.clear();
+        r.clear(); m.clear(); invM.clear();
+        info.clear();
+    }
+    
+    void reserve(size_t n) {
+        x.reserve(n); y.reserve(n);
+        vx.reserve(n); vy.reserve(n);
+        r.reserve(n); m.reserve(n); invM.reserve(n);
+        info.reserve(n);
+    }
+    
+    // Room for n balls with a quarter to spare, for a store that is refilled
+    // every step with about n; it grows by doubling, so a count that wobbles
+    // or drifts upwards settles after a few reallocations
+    void reserveWithHeadroom(size_t n) {
+        if (x.capacity() < n + n / 4) reserve(2 * n);
+    }
+    
+    // Size every array to n balls at once, to be filled in place with set()
+    void resize(size_t n) {
+        x.resize(n); y.resize(n);
+        vx.resize(n); vy.resize(n);
+        r.resize(n); m.resize(n); invM.resize(n);
+        info.resize(n);
+    }
+    
+    // Append ball i of another store
+    void append(const BallStore& from, size_t i) {
+        x.push_back(from.x[i]);
+        y.push_back(from.y[i]);
+        vx.push_back(from.vx[i]);
+        vy.push_back(from.vy[i]);
+        r.push_back(from.r[i]);
+        m.push_back(from.m[i]);
+        invM.push_back(from.invM[i]);
+        info.push_back(from.info[i]);
+    }
+    
+    // Slots [begin, end) of a store already sized like from: slot k takes
+    // ball order[k] of from
+    void gather(const BallStore& from, const std::vector<int>& order, size_t begin, size_t end) {
+        for (size_t k = begin; k < end; k++) {
+            const size_t i = order[k];
+            x[k] = from.x[i];
+            y[k] = from.y[i];
+            vx[k] = from.vx[i];
+            vy[k] = from.vy[i];
+            r[k] = from.r[i];
+            m[k] = from.m[i];
+            invM[k] = from.invM[i];
+            info[k] = from.info[i];
+        }
+    }
+    
+    void add(const Ball<T>& ball) {
+        x.push_back(ball.position.x);
+        y.push_back(ball.position.y);
+        vx.push_back(ball.velocity.x);
+        vy.push_back(ball.velocity.y);
+        r.push_back(ball.radius);
+        m.push_back(ball.mass);
+        invM.push_back(ball.inverseMass);
+        info.push_back({ball.color, ball.id});
+    }
+    
+    // Thin Ball view for call sites that work on whole balls
+    Ball<T> get(size_t i) const {
+        return Ball<T>(info[i].id, x[i], y[i], vx[i], vy[i], r[i], m[i], info[i].color);
+    }
+    
+    void set(size_t i, const Ball<T>& ball) {
+        x[i] = ball.position.x;
+        y[i] = ball.position.y;
+        vx[i] = ball.velocity.x;
+        vy[i] = ball.velocity.y;
+        r[i] = ball.radius;
+        m[i] = ball.mass;
+        invM[i] = ball.inverseMass;
+        info[i] = {ball.color, ball.id};
+    }
+    
+    // Run the step kernels over balls [begin, end)
+    void integrate(const StepKernels<T>& kernels, T dt, size_t begin, size_t end) {
+        kernels.integrate(x.data() + begin, y.data() + begin, vx.data() + begin, vy.data() + begin,
+                          end - begin, dt);
+    }
+    
+    void bounceOffWalls(const StepKernels<T>& kernels, int windowWidth, int windowHeight,
+                        size_t begin, size_t end, MotionStats& motion) {
+        kernels.bounceOffWalls(x.data() + begin, y.data() + begin, vx.data() + begin, vy.data() + begin,
+                               r.data() + begin, m.data() + begin, end - begin,
+                               T(windowWidth), T(windowHeight), motion);
+    }
+    
+    // Index-based equivalents of Ball::isCollidingWith / Ball::resolveCollision.
+    // The arithmetic is kept in the same order so both give identical results.
+    bool isColliding(size_t i, size_t j) const {
+        T dx = x[i] - x[j];
+        T dy = y[i] - y[j];
+        T reach = r[i] + r[j];
+        return dx * dx + dy * dy <= reach * reach;
+    }
+    
+    // motion, when given, receives the change in the tracked totals
+    void resolveCollision(size_t i, size_t j, MotionStats* motion = nullptr) {
+        resolveCollision(i, j, PerBallMass<T>{m.data(), invM.data()}, motion);
+    }
+    
+    // resolveCollision with the masses read through a PerBallMass or UniformMass
+    template <typename Mass>
+    void resolveCollision(size_t i, size_t j, const Mass& mass, MotionStats* motion) {
+        T dx = x[i] - x[j];
+        T dy = y[i] - y[j];
+        T d = std::sqrt(dx * dx + dy * dy);
+        
+        // Avoid division by zero
+        if (d == 0) {
+            dx = 1;
+            dy = 0;
+            d = 1;
+        }
+        
+        // Normalize collision vector
+        T invD = T(1) / d;
+        T nx = dx * invD;
+        T ny = dy * invD;
+        
+        // Separate overlapping balls, each moving in proportion to its inverse mass
+        T overlap = (r[i] + r[j]) - d;
+        T reducedMass = mass.reduced(i, j);
+        T push = overlap * reducedMass;
+        T pushI = push * mass.inverse(i);
+        T pushJ = push * mass.inverse(j);
+        
+        x[i] = x[i] + nx * pushI;
+        y[i] = y[i] + ny * pushI;
+        x[j] = x[j] - nx * pushJ;
+        y[j] = y[j] - ny * pushJ;
+        
+        applyImpulse(i, j, nx, ny, reducedMass, mass, motion);
+    }
+    
+    // Velocity half of resolveCollision: elastic impulse along the unit normal
+    // (nx, ny) pointing from ball j to ball i
+    void exchangeMomentum(size_t i, size_t j, T nx, T ny, MotionStats* motion = nullptr) {
+        applyImpulse(i, j, nx, ny, T(1) / (invM[i] + invM[j]), motion);
+    }
+    
+    // exchangeMomentum with the reduced mass 1 / (1/m[i] + 1/m[j]) already known
+    void applyImpulse(size_t i, size_t j, T nx, T ny, T reducedMass, MotionStats* motion = nullptr) {
+        applyImpulse(i, j, nx, ny, reducedMass, PerBallMass<T>{m.data(), invM.data()}, motion);
+    }
+    
+    template <typename Mass>
+    void applyImpulse(size_t i, size_t j, T nx, T ny, T reducedMass, const Mass& mass, MotionStats* motion) {
+        // Relative velocity along the collision normal
+        T velocityAlongNormal = (vx[i] - vx[j]) * nx + (vy[i] - vy[j]) * ny;
+        
+        // Do not resolve if velocities are separating
+        if (velocityAlongNormal > 0) return;
+        
+        // Perfect elastic collision - no energy loss
+        T impulse = 2 * velocityAlongNormal * reducedMass;
+        T impulseI = impulse * mass.inverse(i);
+        T impulseJ = impulse * mass.inverse(j);
+        
+        if (motion) {
+            motion->removeBall(mass.mass(i), vx[i], vy[i]);
+            motion->removeBall(mass.mass(j), vx[j], vy[j]);
+        }
+        
+        vx[i] = vx[i] - nx * impulseI;
+        vy[i] = vy[i] - ny * impulseI;
+        vx[j] = vx[j] + nx * impulseJ;
+        vy[j] = vy[j] + ny * impulseJ;
+        
+        if (motion) {
+            motion->addBall(mass.mass(i), vx[i], vy[i]);
+            motion->addBall(mass.mass(j), vx[j], vy[j]);
+        }
+    }
+};
+
+// Neon color palette - bright, vibrant, refreshing colors
+static const SDL_Color NEON_COLORS[] = {
+    {0, 255, 255, 255},     // Electric Cyan
+    {255, 0, 255, 255},     // Electric Magenta
+    {255, 255, 0, 255},     // Electric Yellow
+    {0, 255, 0, 255},       // Electric Green
+    {255, 64, 255, 255},    // Hot Pink
+    {64, 255, 64, 255},     // Lime Green
+    {255, 128, 0, 255},     // Electric Orange
+    {128, 255, 255, 255},   // Light Cyan
+    {255, 128, 255, 255},   // Light Magenta
+    {255, 255, 128, 255},   // Light Yellow
+    {128, 255, 128, 255},   // Light Green
+    {255, 64, 128, 255},    // Pink Neon
+    {64, 255, 255, 255},    // Aqua Neon
+    {255, 255, 64, 255},    // Bright Yellow
+    {128, 128, 255, 255},   // Electric Blue
+    {255, 128, 128, 255},   // Light Red
+    {192, 255, 64, 255},    // Electric Lime
+    {255, 64, 192, 255},    // Hot Pink 2
+    {64, 192, 255, 255},    // Sky Blue Neon
+    {255, 192, 64, 255}     // Golden Neon
+};
+static const int NEON_COLOR_COUNT = sizeof(NEON_COLORS) / sizeof(NEON_COLORS[0]);
+
+// Counter-based random numbers: draw d of stream s is a pure hash of
+// (key, s, d), so any ball can be generated independently of the others, in
+// any order and on any thread, and still get the same values.
+class CounterRng {
+private:
+    uint64_t base;
+    uint64_t counter;
+    
+    // SplitMix64 finalizer
+    static uint64_t mix(uint64_t z) {
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        return z ^ (z >> 31);
+    }
+    
+public:
+    CounterRng(uint64_t key, uint64_t stream)
+        : base(mix(key + mix(stream + 0x9E3779B97F4A7C15ULL))), counter(0) {}
+    
+    uint64_t next() {
+        return mix(base + 0x9E3779B97F4A7C15ULL * ++counter);
+    }
+    
+    // Uniform in [lo, hi)
+    double uniform(double lo, double hi) {
+        return lo + (hi - lo) * ((next() >> 11) * (1.0 / 9007199254740992.0));
+    }
+    
+    // Uniform in [0, n)
+    int below(int n) {
+        return (int)((next() >> 32) * (uint64_t)n >> 32);
+    }
+};
+
+// Largest population a run accepts. The broad phases budget 16 grid cells
+// per ball in int indices, and the scene grid squares its side, so this
+// keeps both well inside 32 bits.
+static const int MAX_BALLS = 100000000;
+
+// Initial scene: balls on a jittered grid with random radius, mass, velocity
+// and colour. Every ball depends only on (seed, scene, index), so fill() can
+// split the population across threads and the result is identical for any
+// split. scene numbers the resets of one run, so each reset gets a fresh but
+// reproducible layout. A uniformMass above 0 gives every ball that mass
+// instead of one drawn from [0.5, 1.5); the other draws are unchanged.
+class SceneGenerator {
+private:
+    uint64_t key;
+    int numBalls;
+    double minRadius, maxRadius;
+    double uniformMass;
+    int width, height;
+    int gridSize;
+    double spacingX, spacingY;
+    
+public:
+    SceneGenerator(unsigned int seed, unsigned int scene, int count, double minR, double maxR,
+                   int worldWidth, int worldHeight, double mass = 0)
+        : key(((uint64_t)seed << 32) | scene), numBalls(count), minRadius(minR), maxRadius(maxR),
+          uniformMass(mass), width(worldWidth), height(worldHeight) {
+        // Calculate grid size based on number of balls
+        gridSize = std::max(1, (int)std::ceil(std::sqrt((double)numBalls)));
+        if ((int64_t)gridSize * gridSize < numBalls) gridSize++;
+        
+        // A single column or row has no spacing (and must not divide by zero)
+        spacingX = gridSize > 1 ? (width - 100) / (double)(gridSize - 1) : 0;
+        spacingY = gridSize > 1 ? (height - 100) / (double)(gridSize - 1) : 0;
+    }
+    
+    // Generate balls [begin, end) into a store already sized to numBalls.
+    // Written straight into the arrays; going through Ball and set() costs a
+    // third of the time for a large population.
+    template <typename T>
+    void fill(BallStore<T>& balls, size_t begin, size_t end) const {
+        for (size_t i = begin; i < end; i++) {
+            CounterRng rng(key, i);
+            int row = (int)(i / gridSize);
+            int col = (int)(i % gridSize);
+            
+            // Small random offset to avoid a perfect grid
+            double x = 50 + col * spacingX + rng.uniform(-15.0, 15.0);
+            double y = 50 + row * spacingY + rng.uniform(-15.0, 15.0);
+            
+            // Ensure ball stays within bounds
+            double radius = rng.uniform(minRadius, maxRadius);
+            x = std::max(radius + 5, std::min(x, width - radius - 5));
+            y = std::max(radius + 5, std::min(y, height - radius - 5));
+            
+            // Random velocity
+            double vx = rng.uniform(80.0, 200.0) * (rng.below(2) ? 1 : -1);
+            double vy = rng.uniform(80.0, 200.0) * (rng.below(2) ? 1 : -1);
+            
+            double mass = rng.uniform(0.5, 1.5);
+            if (uniformMass > 0) mass = uniformMass;
+            SDL_Color color = NEON_COLORS[rng.below(NEON_COLOR_COUNT)];
+            
+            // Drawn in double for every precision, so a seed gives the same scene
+            balls.x[i] = T(x);
+            balls.y[i] = T(y);
+            balls.vx[i] = T(vx);
+            balls.vy[i] = T(vy);
+            balls.r[i] = T(radius);
+            balls.m[i] = T(mass);
+            balls.invM[i] = T(1) / T(mass);
+            balls.info[i] = {color, (int)i + 1};
+        }
+    }
+};
+
+// Broad phase used to find candidate pairs for the narrow phase
+enum class BroadPhase {
+    BruteForce,     // Test every i<j pair (reference implementation)
+    UniformGrid,    // Only test pairs from neighbouring grid cells
+    ParallelGrid,   // Grid with multithreaded detection and a cell-coloured resolution order
+    SweepAndPrune,  // Sorted x intervals, kept sorted between frames
+    HierarchicalGrid    // One grid level per power-of-two radius class
+};
+
+inline const char* broadPhaseName(BroadPhase mode) {
+    switch (mode) {
+        case BroadPhase::BruteForce:   return "brute force";
+        case BroadPhase::UniformGrid:  return "uniform grid";
+        case BroadPhase::ParallelGrid: return "parallel grid";
+        case BroadPhase::SweepAndPrune: return "sweep and prune";
+        case BroadPhase::HierarchicalGrid: return "hierarchical grid";
+    }
+    return "unknown";
+}
+
+// Uniform grid broad phase. Cells are at least as wide as the largest possible
+// contact distance (2 * maxRadius), so any touching pair lies in the same or an
+// adjacent cell and only the 3x3 neighbourhood of a ball has to be tested.
+// Callers size the cells with cellSizeFor, which widens them in sparse worlds
+// so the cell count stays proportional to the ball count.
+class UniformGrid {
+private:
+    double cellSize;
+    int cols;
+    int rows;
+    int firstRow;                  // World row of the grid's row 0
+    std::vector<int> cellStart;    // Offset of each cell's first entry in cellBalls
+    std::vector<int> cellBalls;    // Ball indices bucketed by cell, ascending within a cell
+    std::vector<int> ballCell;     // Cell index of every ball
+    std::vector<int> cellAwake;    // Awake balls per cell, when built with sleep flags
+    std::vector<int> cellFill;     // Build scratch: next free slot of every cell
+    
+    int cellCoord(double v, int limit) const {
+        return coordinate(v, cellSize, limit);
+    }
+    
+    // Reserve a quarter to spare before growing: resize() alone reallocates
+    // to the exact size, i.e. every step while a slab's population creeps up
+    static void growTo(std::vector<int>& v, size_t n) {
+        if (v.capacity() < n) v.reserve(n + n / 4);
+    }
+    
+public:
+    // Cell budget: MAX_CELLS_PER_BALL per ball (at least MIN_CELLS), far below
+    // what an int cell index can reach
+    static constexpr size_t MAX_CELLS_PER_BALL = 16;
+    static constexpr size_t MIN_CELLS = 4096;
+    
+    UniformGrid() : cellSize(1), cols(1), rows(1), firstRow(0) {}
+    
+    static double cellBudget(size_t balls) {
+        return std::min((double)std::max(MIN_CELLS, MAX_CELLS_PER_BALL * balls), (double)(INT32_MAX / 2));
+    }
+    
+    // Cell size for a contact distance: the distance itself, or wider if a
+    // world this large would otherwise need more cells than the budget for
+    // `balls` balls. Without the cap a few balls in a huge world would clear
+    // and prefix-sum millions of empty cells every step.
+    static double cellSizeFor(double contact, int worldWidth, int worldHeight, size_t balls) {
+        const double budget = cellBudget(balls);
+        const double w = std::max(1, worldWidth), h = std::max(1, worldHeight);
+        double size = std::max(contact > 0 ? contact : 1, std::sqrt(w * h / budget));
+        while (std::ceil(w / size) * std::ceil(h / size) > budget) size *= 1.0625;
+        return size;
+    }
+    
+    // Column or row of coordinate v for cells of the given size, clamped to
+    // [0, limit)
+    static int coordinate(double v, double size, int limit) {
+        int c = (int)(v / size);
+        return std::max(0, std::min(c, limit - 1));
+    }
+    
+    // Rows of cells a world of this height is split into
+    static int rowCount(double size, int worldHeight) {
+        return std::max(1, (int)ceil(worldHeight / (size > 0 ? size : 1)));
+    }
+    
+    // asleep (one flag per ball, optional) also counts the awake balls of
+    // every cell for anyAwakeAround
+    template <typename T>
+    void build(const BallStore<T>& balls, double size, int worldWidth, int worldHeight,
+               const uint8_t* asleep = nullptr) {
+        buildRows(balls, size, worldWidth, worldHeight, 0, rowCount(size, worldHeight), asleep);
+    }
+    
+    // Grid over world rows [first, first + count) only, for a slab of the
+    // world; balls outside them are clamped into the nearest row
+    template <typename T>
+    void buildRows(const BallStore<T>& balls, double size, int worldWidth, int worldHeight,
+                   int first, int count, const uint8_t* asleep = nullptr) {
+        cellSize = size > 0 ? size : 1;
+        cols = std::max(1, (int)ceil(worldWidth / cellSize));
+        const int worldRows = rowCount(cellSize, worldHeight);
+        firstRow = first;
+        rows = std::max(1, count);
+        
+        // Counting sort of ball indices by cell keeps each cell in index order
+        const size_t cells = (size_t)cols * rows;
+        growTo(cellStart, cells + 1);
+        cellStart.assign(cells + 1, 0);
+        growTo(ballCell, balls.size());
+        ballCell.resize(balls.size());
+        for (size_t i = 0; i < balls.size(); i++) {
+            int row = std::max(0, std::min(cellCoord(balls.y[i], worldRows) - firstRow, rows - 1));
+            int cell = row * cols + cellCoord(balls.x[i], cols);
+            ballCell[i] = cell;
+            cellStart[cell + 1]++;
+        }
+        for (size_t c = 0; c < cells; c++) {
+            cellStart[c + 1] += cellStart[c];
+        }
+        
+        if (asleep) {
+            growTo(cellAwake, cells);
+            cellAwake.assign(cells, 0);
+            for (size_t i = 0; i < balls.size(); i++) {
+                if (!asleep[i]) cellAwake[ballCell[i]]++;
+            }
+        }
+        
+        growTo(cellBalls, balls.size());
+        cellBalls.resize(balls.size());
+        growTo(cellFill, cells);
+        cellFill.assign(cellStart.begin(), cellStart.end() - 1);
+        for (size_t i = 0; i < balls.size(); i++) {
+            cellBalls[cellFill[ballCell[i]]++] = (int)i;
+        }
+    }
+    
+    int getCols() const { return cols; }
+    int getRows() const { return rows; }
+    int getFirstRow() const { return firstRow; }
+    int cellBegin(int cell) const { return cellStart[cell]; }
+    int cellEnd(int cell) const { return cellStart[cell + 1]; }
+    int ballAt(int k) const { return cellBalls[k]; }
+    
+    // Collect every ball index j > i from the 3x3 cells around ball i, sorted
+    // ascending so pairs are visited in the same order as the brute-force loop
+    void gatherNeighbours(int i, std::vector<int>& out) const {
+        out.clear();
+        int cx = ballCell[i] % cols;
+        int cy = ballCell[i] / cols;
+        
+        for (int y = std::max(0, cy - 1); y <= std::min(rows - 1, cy + 1); y++) {
+            for (int x = std::max(0, cx - 1); x <= std::min(cols - 1, cx + 1); x++) {
+                int cell = y * cols + x;
+                for (int k = cellStart[cell]; k < cellStart[cell + 1]; k++) {
+                    if (cellBalls[k] > i) out.push_back(cellBalls[k]);
+                }
+            }
+        }
+        std::sort(out.begin(), out.end());
+    }
+    
+    // Whether any ball in the 3x3 cells around ball i was awake at build time
+    // (needs the sleep flags passed to build)
+    bool anyAwakeAround(int i) const {
+        int cx = ballCell[i] % cols;
+        int cy = ballCell[i] / cols;
+        for (int y = std::max(0, cy - 1); y <= std::min(rows - 1, cy + 1); y++) {
+            for (int x = std::max(0, cx - 1); x <= std::min(cols - 1, cx + 1); x++) {
+                if (cellAwake[y * cols + x] > 0) return true;
+            }
+        }
+        return false;
+    }
+};
+
+// Candidate pairs of a broad phase that finds them in no particular order,
+// grouped by lower index i with their j values ascending, so they can be
+// walked in the same (i, j) order as the brute-force loop
+class CandidatePairs {
+private:
+    std::vector<int> pairStart;        // Candidate pairs bucketed by lower index...
+    std::vector<int> pairOther;        // ...holding the higher index
+    std::vector<int> cursor;
+    
+public:
+    // found holds each pair once as (lower, higher)
+    void build(int n, const std::vector<std::pair<int, int>>& found) {
+        // Counting sort by lower index, then order each (small) bucket
+        pairStart.assign(n + 1, 0);
+        for (const std::pair<int, int>& pair : found) pairStart[pair.first + 1]++;
+        for (int i = 0; i < n; i++) pairStart[i + 1] += pairStart[i];
+        
+        pairOther.resize(found.size());
+        cursor.assign(pairStart.begin(), pairStart.end() - 1);
+        for (const std::pair<int, int>& pair : found) {
+            pairOther[cursor[pair.first]++] = pair.second;
+        }
+        for (int i = 0; i < n; i++) {
+            std::sort(pairOther.begin() + pairStart[i], pairOther.begin() + pairStart[i + 1]);
+        }
+    }
+    
+    size_t size() const {
+        return pairOther.size();
+    }
+    
+    int begin(int i) const { return pairStart[i]; }
+    int end(int i) const { return pairStart[i + 1]; }
+    int at(int k) const { return pairOther[k]; }
+};
+
+// Sort-and-sweep broad phase on the x axis. Each ball is an interval
+// [x - r, x + r]; with the intervals sorted by their start, a ball only has to
+// be compared with the following intervals that start before it ends. Unlike
+// the grid this does not depend on a cell size, so it copes with mixed radii.
+//
+// The sorted order is kept between frames. Balls move only a little per step,
+// so the list is nearly sorted and insertion sort fixes it in close to O(n),
+// which makes a frame close to O(n + k) for k overlapping intervals.
+class SweepAndPrune {
+private:
+    struct Interval {
+        double minX;
+        double maxX;
+        int ball;
+    };
+    
+    std::vector<Interval> intervals;   // Sorted by minX
+    std::vector<std::pair<int, int>> found;
+    CandidatePairs pairs;
+    
+public:
+    // Forget the sorted order (ball count or indices changed)
+    void invalidate() {
+        intervals.clear();
+    }
+    
+    // Find the candidate pairs for the current positions. Afterwards pairs are
+    // grouped by lower index i, with their j values ascending, so they can be
+    // walked in the same (i, j) order as the brute-force loop.
+    template <typename T>
+    void update(const BallStore<T>& balls) {
+        const int n = (int)balls.size();
+        
+        if ((int)intervals.size() != n) {
+            intervals.resize(n);
+            for (int i = 0; i < n; i++) intervals[i].ball = i;
+            for (Interval& interval : intervals) {
+                interval.minX = balls.x[interval.ball] - balls.r[interval.ball];
+            }
+            std::sort(intervals.begin(), intervals.end(),
+                      [](const Interval& a, const Interval& b) { return a.minX < b.minX; });
+        }
+        
+        // Refresh the bounds in the existing order, then repair it by insertion sort
+        for (Interval& interval : intervals) {
+            interval.minX = balls.x[interval.ball] - balls.r[interval.ball];
+            interval.maxX = balls.x[interval.ball] + balls.r[interval.ball];
+        }
+        for (int k = 1; k < n; k++) {
+            Interval moving = intervals[k];
+            int slot = k;
+            while (slot > 0 && intervals[slot - 1].minX > moving.minX) {
+                intervals[slot] = intervals[slot - 1];
+                slot--;
+            }
+            intervals[slot] = moving;
+        }
+        
+        // Sweep: overlapping x intervals whose y ranges also overlap
+        found.clear();
+        for (int k = 0; k < n; k++) {
+            const Interval& a = intervals[k];
+            for (int l = k + 1; l < n && intervals[l].minX <= a.maxX; l++) {
+                int i = a.ball;
+                int j = intervals[l].ball;
+                if (std::abs(balls.y[i] - balls.y[j]) <= balls.r[i] + balls.r[j]) {
+                    found.push_back({std::min(i, j), std::max(i, j)});
+                }
+            }
+        }
+        
+        pairs.build(n, found);
+    }
+    
+    size_t candidateCount() const {
+        return pairs.size();
+    }
+    
+    int pairsBegin(int i) const { return pairs.begin(i); }
+    int pairsEnd(int i) const { return pairs.end(i); }
+    int pairAt(int k) const { return pairs.at(k); }
+};
+
+// Hierarchical grid for widely mixed radii. The coarsest level has the
+// uniform grid's cells (the largest contact distance) and each finer level
+// halves them; every ball lives in the finest level whose cells are at least
+// its diameter, so no level holds balls much smaller than its cells.
+// A ball is tested against the 3x3 neighbourhood of its position on its own
+// level and on every coarser one: for balls on levels a <= b the contact
+// distance r + r' is at most (size_a + size_b) / 2 <= size_b, which the 3x3
+// block on level b covers. Each pair is therefore found exactly once, by the
+// ball on the finer level (or the lower index on a shared level).
+//
+// Like sweep and prune it covers exactly the contacts present when it is
+// built, without the uniform grid's slack, so with mixed radii a contact only
+// created by a push-out during the same step is resolved one step later than
+// brute force would.
+class HierarchicalGrid {
+private:
+    struct Level {
+        double cellSize;
+        int cols;
+        int rows;
+        std::vector<int> cellStart;    // Offset of each cell's first entry in cellBalls
+        std::vector<int> cellBalls;    // Ball indices bucketed by cell
+        int ballCount;
+    };
+    
+    std::vector<Level> levels;
+    std::vector<int> ballLevel;
+    std::vector<int> cursor;
+    std::vector<std::pair<int, int>> found;
+    CandidatePairs pairs;
+    
+    static int cellCoord(double v, double size, int limit) {
+        int c = (int)(v / size);
+        return std::max(0, std::min(c, limit - 1));
+    }
+    
+public:
+    // Rebuild every level for the current positions and find the candidate
+    // pairs, grouped like SweepAndPrune's
+    template <typename T>
+    void update(const BallStore<T>& balls, int worldWidth, int worldHeight) {
+        const int n = (int)balls.size();
+        found.clear();
+        if (n == 0) {
+            levels.clear();
+            pairs.build(0, found);
+            return;
+        }
+        
+        double smallest = balls.r[0], largest = balls.r[0];
+        for (int i = 1; i < n; i++) {
+            smallest = std::min(smallest, (double)balls.r[i]);
+            largest = std::max(largest, (double)balls.r[i]);
+        }
+        
+        // Halve down to the smallest ball, but never so fine that a level has
+        // far more cells than there are balls. Every level is at least as
+        // coarse as the finest, which is within the uniform grid's cell
+        // budget; so is the top one, widened as well in a sparse world.
+        const double top = UniformGrid::cellSizeFor(std::max(2 * largest, 1e-6), worldWidth, worldHeight, n);
+        const double finest = UniformGrid::cellSizeFor(2 * smallest, worldWidth, worldHeight, n);
+        int levelCount = 1;
+        while (levelCount < 30 && top / (1 << levelCount) >= finest) levelCount++;
+        
+        levels.resize(levelCount);
+        for (int l = 0; l < levelCount; l++) {
+            Level& level = levels[l];
+            level.cellSize = top / (1 << (levelCount - 1 - l));
+            level.cols = std::max(1, (int)ceil(worldWidth / level.cellSize));
+            level.rows = std::max(1, (int)ceil(worldHeight / level.cellSize));
+            level.cellStart.assign((size_t)level.cols * level.rows + 1, 0);
+            level.ballCount = 0;
+        }
+        
+        // Counting sort of every level at once, as in UniformGrid
+        ballLevel.resize(n);
+        cursor.resize(n);
+        for (int i = 0; i < n; i++) {
+            int l = 0;
+            while (l + 1 < levelCount && 2 * balls.r[i] > levels[l].cellSize) l++;
+            Level& level = levels[l];
+            int cell = cellCoord(balls.y[i], level.cellSize, level.rows) * level.cols
+                     + cellCoord(balls.x[i], level.cellSize, level.cols);
+            ballLevel[i] = l;
+            cursor[i] = cell;
+            level.cellStart[cell + 1]++;
+            level.ballCount++;
+        }
+        for (Level& level : levels) {
+            const size_t cells = (size_t)level.cols * level.rows;
+            for (size_t c = 0; c < cells; c++) level.cellStart[c + 1] += level.cellStart[c];
+            level.cellBalls.resize(level.ballCount);
+        }
+        for (int i = 0; i < n; i++) {
+            Level& level = levels[ballLevel[i]];
+            // cellStart[cell] is used as the fill position and restored below
+            level.cellBalls[level.cellStart[cursor[i]]++] = i;
+        }
+        for (Level& level : levels) {
+            for (size_t c = (size_t)level.cols * level.rows; c > 0; c--) level.cellStart[c] = level.cellStart[c - 1];
+            level.cellStart[0] = 0;
+        }
+        
+        for (int i = 0; i < n; i++) {
+            for (int l = ballLevel[i]; l < levelCount; l++) {
+                const Level& level = levels[l];
+                if (level.ballCount == 0) continue;
+                int cx = cellCoord(balls.x[i], level.cellSize, level.cols);
+                int cy = cellCoord(balls.y[i], level.cellSize, level.rows);
+                bool ownLevel = l == ballLevel[i];
+                
+                for (int y = std::max(0, cy - 1); y <= std::min(level.rows - 1, cy + 1); y++) {
+                    for (int x = std::max(0, cx - 1); x <= std::min(level.cols - 1, cx + 1); x++) {
+                        int cell = y * level.cols + x;
+                        for (int k = level.cellStart[cell]; k < level.cellStart[cell + 1]; k++) {
+                            int j = level.cellBalls[k];
+                            if (ownLevel && j <= i) continue;
+                            found.push_back({std::min(i, j), std::max(i, j)});
+                        }
+                    }
+                }
+            }
+        }
+        pairs.build(n, found);
+    }
+    
+    int getLevelCount() const {
+        return (int)levels.size();
+    }
+    
+    size_t candidateCount() const {
+        return pairs.size();
+    }
+    
+    int pairsBegin(int i) const { return pairs.begin(i); }
+    int pairsEnd(int i) const { return pairs.end(i); }
+    int pairAt(int k) const { return pairs.at(k); }
+};
+
+// Event-driven continuous collision detection. Instead of moving every ball by
+// velocity * dt and repairing overlaps afterwards, the solver computes the exact
+// time of impact of every upcoming ball-ball and ball-wall contact, keeps them
+// in a priority queue and jumps from event to event, so nothing tunnels and no
+// overlap push-out (and its energy drift) is needed.
+//
+// Positions are advanced lazily: ball i's stored position is valid at
+// localTime[i]. Each ball also has an event counter that is bumped whenever its
+// velocity changes; queued events remember the counters they were predicted
+// with and are simply dropped when they no longer match.
+//
+// To keep predictions local, balls live in a grid of cells at least one contact
+// distance (2 * maxRadius) wide, tracked exactly with cell-crossing events.
+// Touching balls are always in neighbouring cells, so a ball only has to be
+// predicted against its 3x3 neighbourhood whenever its velocity or cell changes.
+//
+// Overlaps cannot arise between exact events, only in the scene handed in. The
+// schedule rebuild pushes them apart first; in a scene packed too tightly for
+// that, overlapping approaching pairs collide at once, but only a few times per
+// ball and step, after which such pairs are left to pass through each other
+// instead of bouncing against each other forever without time advancing.
+template <typename T>
+class EventDrivenSolver {
+private:
+    enum EventType { BALL, WALL_X, WALL_Y, CELL_X, CELL_Y };
+    
+    static const int PUSH_OUT_PASSES = 4;
+    static const int MAX_OVERLAP_CONTACTS = 8;      // Per ball and advance()
+    
+    struct Event {
+        double time;
+        int a, b;               // b is only used by BALL events
+        int countA, countB;
+        int type;
+        
+        // Earliest first; ties broken by ball index so runs are deterministic
+        bool operator>(const Event& other) const {
+            if (time != other.time) return time > other.time;
+            if (a != other.a) return a > other.a;
+            if (b != other.b) return b > other.b;
+            return type > other.type;
+        }
+    };
+    
+    // Min-heap of events (std::push_heap/pop_heap, so stale entries can be purged)
+    std::vector<Event> queue;
+    std::vector<double> localTime;
+    std::vector<int> eventCount;
+    std::vector<int> overlapContacts;   // Zero-time contacts scheduled this advance()
+    size_t purgeAt;                     // Heap size that triggers the next purge
+    
+    // Cell lists as intrusive doubly linked lists so balls can move cell by cell
+    std::vector<int> cellHead;
+    std::vector<int> cellOf;
+    std::vector<int> nextInCell;
+    std::vector<int> prevInCell;
+    
+    double now;
+    double cellSize;
+    int cols, rows;
+    double width, height;
+    bool valid;
+    long long predictions;
+    
+    double positionX(const BallStore<T>& balls, int i, double t) const {
+        return balls.x[i] + balls.vx[i] * (t - localTime[i]);
+    }
+    
+    double positionY(const BallStore<T>& balls, int i, double t) const {
+        return balls.y[i] + balls.vy[i] * (t - localTime[i]);
+    }
+    
+    void advanceBall(BallStore<T>& balls, int i, double t) {
+        balls.x[i] = T(positionX(balls, i, t));
+        balls.y[i] = T(positionY(balls, i, t));
+        localTime[i] = t;
+    }
+    
+    void linkToCell(int i, int cell) {
+        cellOf[i] = cell;
+        prevInCell[i] = -1;
+        nextInCell[i] = cellHead[cell];
+        if (cellHead[cell] >= 0) prevInCell[cellHead[cell]] = i;
+        cellHead[cell] = i;
+    }
+    
+    void unlinkFromCell(int i) {
+        int cell = cellOf[i];
+        if (prevInCell[i] >= 0) nextInCell[prevInCell[i]] = nextInCell[i];
+        else cellHead[cell] = nextInCell[i];
+        if (nextInCell[i] >= 0) prevInCell[nextInCell[i]] = prevInCell[i];
+    }
+    
+    bool isStale(const Event& event) const {
+        return event.countA != eventCount[event.a] ||
+               (event.type == BALL && event.countB != eventCount[event.b]);
+    }
+    
+    void push(double time, int a, int b, int type) {
+        queue.push_back({time, a, b, eventCount[a], b >= 0 ? eventCount[b] : 0, type});
+        std::push_heap(queue.begin(), queue.end(), std::greater<Event>());
+    }
+    
+    // Invalidated events are normally dropped lazily when they reach the top,
+    // but far-future ones would pile up and make every heap operation slower.
+    // Once the heap has doubled since the last purge (and is several times the
+    // ball count) the stale entries are filtered out in one linear pass, so
+    // the purges cost amortized O(1) per event even when most entries are live.
+    void purgeStaleEvents() {
+        if (queue.size() < purgeAt) return;
+        queue.erase(std::remove_if(queue.begin(), queue.end(),
+                                   [&](const Event& event) { return isStale(event); }),
+                    queue.end());
+        std::make_heap(queue.begin(), queue.end(), std::greater<Event>());
+        purgeAt = std::max(4 * localTime.size() + 1024, 2 * queue.size());
+    }
+    
+    void predictPair(const BallStore<T>& balls, int i, int j) {
+        predictions++;
+        double dx = balls.x[i] - positionX(balls, j, localTime[i]);
+        double dy = balls.y[i] - positionY(balls, j, localTime[i]);
+        double dvx = balls.vx[i] - balls.vx[j];
+        double dvy = balls.vy[i] - balls.vy[j];
+        
+        double dvdr = dx * dvx + dy * dvy;
+        if (dvdr >= 0) return;   // Moving apart
+        
+        double sigma = balls.r[i] + balls.r[j];
+        double drdr = dx * dx + dy * dy;
+        if (drdr < sigma * sigma) {
+            // Already overlapping (a scene too dense to push apart): collide right
+            // away, unless one of the two has done so too often this step
+            if (overlapContacts[i] >= MAX_OVERLAP_CONTACTS || overlapContacts[j] >= MAX_OVERLAP_CONTACTS) return;
+            overlapContacts[i]++;
+            overlapContacts[j]++;
+            push(now, i, j, BALL);
+            return;
+        }
+        
+        double dvdv = dvx * dvx + dvy * dvy;
+        double discriminant = dvdr * dvdr - dvdv * (drdr - sigma * sigma);
+        if (discriminant < 0) return;   // Miss
+        
+        push(localTime[i] - (dvdr + std::sqrt(discriminant)) / dvdv, i, j, BALL);
+    }
+    
+    // Wall and cell-crossing events for ball i, whose position is current
+    void predictSelf(const BallStore<T>& balls, int i) {
+        double t = localTime[i];
+        double r = balls.r[i];
+        int cx = cellOf[i] % cols;
+        int cy = cellOf[i] / cols;
+        
+        if (balls.vx[i] < 0) {
+            push(t + std::max(0.0, (r - balls.x[i]) / balls.vx[i]), i, -1, WALL_X);
+            if (cx > 0) push(t + std::max(0.0, (cx * cellSize - balls.x[i]) / balls.vx[i]), i, -1, CELL_X);
+        } else if (balls.vx[i] > 0) {
+            push(t + std::max(0.0, (width - r - balls.x[i]) / balls.vx[i]), i, -1, WALL_X);
+            if (cx < cols - 1) push(t + std::max(0.0, ((cx + 1) * cellSize - balls.x[i]) / balls.vx[i]), i, -1, CELL_X);
+        }
+        
+        if (balls.vy[i] < 0) {
+            push(t + std::max(0.0, (r - balls.y[i]) / balls.vy[i]), i, -1, WALL_Y);
+            if (cy > 0) push(t + std::max(0.0, (cy * cellSize - balls.y[i]) / balls.vy[i]), i, -1, CELL_Y);
+        } else if (balls.vy[i] > 0) {
+            push(t + std::max(0.0, (height - r - balls.y[i]) / balls.vy[i]), i, -1, WALL_Y);
+            if (cy < rows - 1) push(t + std::max(0.0, ((cy + 1) * cellSize - balls.y[i]) / balls.vy[i]), i, -1, CELL_Y);
+        }
+    }
+    
+    // All events for ball i against its 3x3 neighbourhood. With onlyHigher set,
+    // only pairs (i, j > i) are predicted, which avoids duplicates on a rebuild.
+    void predictBall(const BallStore<T>& balls, int i, bool onlyHigher) {
+        predictSelf(balls, i);
+        
+        int cx = cellOf[i] % cols;
+        int cy = cellOf[i] / cols;
+        for (int y = std::max(0, cy - 1); y <= std::min(rows - 1, cy + 1); y++) {
+            for (int x = std::max(0, cx - 1); x <= std::min(cols - 1, cx + 1); x++) {
+                for (int j = cellHead[y * cols + x]; j >= 0; j = nextInCell[j]) {
+                    if (j != i && (!onlyHigher || j > i)) predictPair(balls, i, j);
+                }
+            }
+        }
+    }
+    
+    // Balls outside the walls (never the case after a CCD step) are put back
+    // inside and sent away from the wall
+    void keepInside(BallStore<T>& balls, int i) {
+        double r = balls.r[i];
+        if (balls.x[i] < r) { balls.x[i] = T(r); balls.vx[i] = std::abs(balls.vx[i]); }
+        if (balls.x[i] > width - r) { balls.x[i] = T(width - r); balls.vx[i] = -std::abs(balls.vx[i]); }
+        if (balls.y[i] < r) { balls.y[i] = T(r); balls.vy[i] = std::abs(balls.vy[i]); }
+        if (balls.y[i] > height - r) { balls.y[i] = T(height - r); balls.vy[i] = -std::abs(balls.vy[i]); }
+    }
+    
+    void linkAll(const BallStore<T>& balls) {
+        std::fill(cellHead.begin(), cellHead.end(), -1);
+        for (int i = 0; i < (int)balls.size(); i++) {
+            int cx = std::max(0, std::min((int)(balls.x[i] / cellSize), cols - 1));
+            int cy = std::max(0, std::min((int)(balls.y[i] / cellSize), rows - 1));
+            linkToCell(i, cy * cols + cx);
+        }
+    }
+    
+    // Separate the overlaps of the scene, each ball moving in proportion to its
+    // inverse mass as in the fixed-step push-out; positions only, the
+    // velocities are left to the events
+    void pushOutOverlaps(BallStore<T>& balls) {
+        const int n = (int)balls.size();
+        for (int pass = 0; pass < PUSH_OUT_PASSES; pass++) {
+            bool moved = false;
+            for (int i = 0; i < n; i++) {
+                int cx = cellOf[i] % cols;
+                int cy = cellOf[i] / cols;
+                for (int y = std::max(0, cy - 1); y <= std::min(rows - 1, cy + 1); y++) {
+                    for (int x = std::max(0, cx - 1); x <= std::min(cols - 1, cx + 1); x++) {
+                        for (int j = cellHead[y * cols + x]; j >= 0; j = nextInCell[j]) {
+                            if (j <= i) continue;
+                            double dx = balls.x[i] - balls.x[j];
+                            double dy = balls.y[i] - balls.y[j];
+                            double sigma = balls.r[i] + balls.r[j];
+                            double dd = dx * dx + dy * dy;
+                            if (dd >= sigma * sigma) continue;
+                            
+                            double d = std::sqrt(dd);
+                            double nx = 1, ny = 0;
+                            if (d > 0) { nx = dx / d; ny = dy / d; }
+                            double push = (sigma - d) / (balls.invM[i] + balls.invM[j]);
+                            balls.x[i] = T(balls.x[i] + nx * push * balls.invM[i]);
+                            balls.y[i] = T(balls.y[i] + ny * push * balls.invM[i]);
+                            balls.x[j] = T(balls.x[j] - nx * push * balls.invM[j]);
+                            balls.y[j] = T(balls.y[j] - ny * push * balls.invM[j]);
+                            keepInside(balls, i);
+                            keepInside(balls, j);
+                            moved = true;
+                        }
+                    }
+                }
+            }
+            linkAll(balls);
+            if (!moved) break;
+        }
+    }
+    
+    // Fresh schedule from the current state
+    void rebuild(BallStore<T>& balls) {
+        const int n = (int)balls.size();
+        now = 0;
+        queue.clear();
+        purgeAt = 4 * (size_t)n + 1024;
+        localTime.assign(n, 0.0);
+        eventCount.assign(n, 0);
+        overlapContacts.assign(n, 0);
+        
+        cellHead.assign((size_t)cols * rows, -1);
+        cellOf.resize(n);
+        nextInCell.resize(n);
+        prevInCell.resize(n);
+        
+        for (int i = 0; i < n; i++) keepInside(balls, i);
+        linkAll(balls);
+        pushOutOverlaps(balls);
+        
+        for (int i = 0; i < n; i++) predictBall(balls, i, true);
+        valid = true;
+    }
+    
+public:
+    EventDrivenSolver() : purgeAt(0), now(0), cellSize(1), cols(1), rows(1), width(0), height(0),
+                          valid(false), predictions(0) {}
+    
+    // Forget the schedule; the next advance() rebuilds it. Needed whenever the
+    // balls are changed from outside (reset, mode switch, ...).
+    void invalidate() {
+        valid = false;
+    }
+    
+    // Prediction count of the last advance(), i.e. the pairs looked at
+    long long getPredictions() const {
+        return predictions;
+    }
+    
+    // Whether every ball fits between the walls. One wider than the world
+    // would bounce from wall to wall forever without time advancing.
+    static bool fitsWorld(const BallStore<T>& balls, int worldWidth, int worldHeight) {
+        for (size_t i = 0; i < balls.size(); i++) {
+            if (2 * balls.r[i] >= worldWidth || 2 * balls.r[i] >= worldHeight) return false;
+        }
+        return true;
+    }
+    
+    // Process every event in the next dt seconds and leave all balls at the end
+    // of the interval. Returns the number of ball-ball collisions; the velocity
+    // changes are added to motion. Returns -1, with nothing moved, for a scene
+    // that fails fitsWorld.
+    int advance(BallStore<T>& balls, double dt, double maxRadius, int worldWidth, int worldHeight,
+                MotionStats& motion) {
+        predictions = 0;
+        std::fill(overlapContacts.begin(), overlapContacts.end(), 0);
+        if (!valid || width != worldWidth || height != worldHeight || localTime.size() != balls.size()) {
+            if (!fitsWorld(balls, worldWidth, worldHeight)) return -1;
+            width = worldWidth;
+            height = worldHeight;
+            // A hair wider than the contact distance so rounding at cell
+            // boundaries can never hide a touching pair, and widened further
+            // in a sparse world like the uniform grid's cells
+            cellSize = UniformGrid::cellSizeFor(std::max(2 * maxRadius * (1 + 1e-9) + 1e-9, 1.0),
+                                                worldWidth, worldHeight, balls.size());
+            cols = std::max(1, (int)ceil(width / cellSize));
+            rows = std::max(1, (int)ceil(height / cellSize));
+            rebuild(balls);
+        }
+        
+        const double end = now + dt;
+        int collisions = 0;
+        
+        while (!queue.empty() && queue.front().time <= end) {
+            std::pop_heap(queue.begin(), queue.end(), std::greater<Event>());
+            Event event = queue.back();
+            queue.pop_back();
+            
+            // Stale: one of the balls changed velocity or cell since the prediction
+            if (isStale(event)) continue;
+            
+            now = std::max(now, event.time);
+            int i = event.a;
+            advanceBall(balls, i, now);
+            
+            switch (event.type) {
+                case BALL: {
+                    int j = event.b;
+                    advanceBall(balls, j, now);
+                    double dx = balls.x[i] - balls.x[j];
+                    double dy = balls.y[i] - balls.y[j];
+                    double d = std::sqrt(dx * dx + dy * dy);
+                    if (d > 0) balls.exchangeMomentum(i, j, T(dx / d), T(dy / d), &motion);
+                    else balls.exchangeMomentum(i, j, 1, 0, &motion);
+                    collisions++;
+                    
+                    eventCount[i]++;
+                    eventCount[j]++;
+                    predictBall(balls, i, false);
+                    predictBall(balls, j, false);
+                    break;
+                }
+                case WALL_X:
+                    // Land exactly on the wall so rounding never leaves a ball outside
+                    balls.x[i] = balls.vx[i] < 0 ? balls.r[i] : T(width - balls.r[i]);
+                    balls.vx[i] = -balls.vx[i];
+                    motion.momentumX += 2.0 * balls.m[i] * balls.vx[i];
+                    eventCount[i]++;
+                    predictBall(balls, i, false);
+                    break;
+                case WALL_Y:
+                    balls.y[i] = balls.vy[i] < 0 ? balls.r[i] : T(height - balls.r[i]);
+                    balls.vy[i] = -balls.vy[i];
+                    motion.momentumY += 2.0 * balls.m[i] * balls.vy[i];
+                    eventCount[i]++;
+                    predictBall(balls, i, false);
+                    break;
+                case CELL_X:
+                case CELL_Y: {
+                    int cx = cellOf[i] % cols;
+                    int cy = cellOf[i] / cols;
+                    if (event.type == CELL_X) cx += balls.vx[i] > 0 ? 1 : -1;
+                    else cy += balls.vy[i] > 0 ? 1 : -1;
+                    unlinkFromCell(i);
+                    linkToCell(i, cy * cols + cx);
+                    
+                    // New neighbours to predict against; the velocity is unchanged,
+                    // but re-predicting everything keeps the bookkeeping simple
+                    eventCount[i]++;
+                    predictBall(balls, i, false);
+                    break;
+                }
+            }
+            purgeStaleEvents();
+        }
+        
+        // Bring every ball to the end of the interval
+        now = end;
+        for (int i = 0; i < (int)balls.size(); i++) {
+            advanceBall(balls, i, now);
+        }
+        return collisions;
+    }
+};
+
+// Hot-path profiler. In builds with PHYSICS_SIM_PROFILE (the CMake option of
+// the same name) PHYSICS_SIM_PROFILE_SCOPE(phase) times the rest of the
+// enclosing block with the CPU's cycle counter; otherwise it expands to
+// nothing and the step carries no timing code at all. Every scope adds its
+// time to a running total per phase, which the HUD and the headless report
+// sample from other threads, and while a trace is being captured it is also
+// logged as one event for Chrome's trace viewer (chrome://tracing, Perfetto).
+//
+// A phase's time leaves out the phase scopes nested in it, so the contacts
+// resolved inside the serial narrow phases count as resolve. Scopes on the
+// worker threads add to the same totals, so with a pool the phase totals are
+// thread time; only Step, the whole update(), is wall time.
+enum class ProfilePhase {
+    Step,
+    Integrate,
+    WallBounce,
+    BroadPhase,
+    NarrowPhase,
+    Resolve,
+    Reorder,
+    Render,
+    Present,
+    Count
+};
+
+inline const char* profilePhaseName(ProfilePhase phase) {
+    switch (phase) {
+        case ProfilePhase::Step:        return "step";
+        case ProfilePhase::Integrate:   return "integrate";
+        case ProfilePhase::WallBounce:  return "wall bounce";
+        case ProfilePhase::BroadPhase:  return "broad phase";
+        case ProfilePhase::NarrowPhase: return "narrow phase";
+        case ProfilePhase::Resolve:     return "resolve";
+        case ProfilePhase::Reorder:     return "reorder";
+        case ProfilePhase::Render:      return "render";
+        case ProfilePhase::Present:     return "present";
+        default:                        return "?";
+    }
+}
+
+// The cycle counter where reading it is a single instruction, the steady
+// clock elsewhere; Profiler calibrates either against the steady clock
+inline uint64_t profileTimestamp() {
+#if defined(PHYSICS_SIM_X86)
+    return __rdtsc();
+#elif defined(PHYSICS_SIM_NEON) && (defined(__GNUC__) || defined(__clang__))
+    uint64_t ticks;
+    asm volatile("mrs %0, cntvct_el0" : "=r"(ticks));
+    return ticks;
+#else
+    return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+// Per-phase totals at one point in time
+struct ProfileSample {
+    static const int PHASES = (int)ProfilePhase::Count;
+    uint64_t ticks[PHASES] = {};
+    long long calls[PHASES] = {};
+    double ticksPerSecond = 0;
+    
+    double milliseconds(ProfilePhase phase) const {
+        return ticksPerSecond > 0 ? ticks[(int)phase] * 1e3 / ticksPerSecond : 0;
+    }
+    
+    long long count(ProfilePhase phase) const {
+        return calls[(int)phase];
+    }
+    
+    // What was added between earlier and this sample
+    ProfileSample since(const ProfileSample& earlier) const {
+        ProfileSample d;
+        for (int p = 0; p < PHASES; p++) {
+            d.ticks[p] = ticks[p] - earlier.ticks[p];
+            d.calls[p] = calls[p] - earlier.calls[p];
+        }
+        d.ticksPerSecond = ticksPerSecond;
+        return d;
+    }
+};
+
+class Profiler {
+private:
+    static const int PHASES = (int)ProfilePhase::Count;
+    static constexpr size_t TRACE_CAPACITY = 1 << 20;     // Events per capture, 32 MB
+    
+    struct TraceEvent {
+        uint64_t begin;
+        uint64_t end;
+        int thread;
+        ProfilePhase phase;
+        std::atomic<bool> written;      // Set last, so a half-written event is skipped
+    };
+    
+    std::atomic<uint64_t> ticks[PHASES];
+    std::atomic<long long> calls[PHASES];
+    uint64_t startTicks;
+    std::chrono::steady_clock::time_point startTime;
+    std::atomic<int> threadCount;
+    
+    // Allocated by the first capture and kept, so a scope that is still
+    // writing when a capture stops never writes into freed memory
+    std::unique_ptr<TraceEvent[]> events;
+    std::atomic<size_t> nextEvent;
+    std::atomic<bool> tracing;
+    
+    Profiler() : startTicks(profileTimestamp()), startTime(std::chrono::steady_clock::now()),
+                 threadCount(0), nextEvent(0), tracing(false) {
+        clear();
+    }
+    
+    // Small id per thread for the trace, in order of first use
+    int threadId() {
+        thread_local int id = threadCount.fetch_add(1);
+        return id;
+    }
+    
+public:
+    static Profiler& global() {
+        static Profiler profiler;
+        return profiler;
+    }
+    
+    Profiler(const Profiler&) = delete;
+    Profiler& operator=(const Profiler&) = delete;
+    
+    // From ProfileScope: own is the time spent outside nested scopes
+    void add(ProfilePhase phase, uint64_t begin, uint64_t end, uint64_t own, bool traced) {
+        ticks[(int)phase].fetch_add(own, std::memory_order_relaxed);
+        calls[(int)phase].fetch_add(1, std::memory_order_relaxed);
+        if (!traced || !tracing.load(std::memory_order_acquire)) return;
+        
+        size_t slot = nextEvent.fetch_add(1, std::memory_order_relaxed);
+        if (slot >= TRACE_CAPACITY) return;
+        TraceEvent& event = events[slot];
+        event.begin = begin;
+        event.end = end;
+        event.thread = threadId();
+        event.phase = phase;
+        event.written.store(true, std::memory_order_release);
+    }
+    
+    // Cycle counter rate, measured against the steady clock since startup
+    double ticksPerSecond() const {
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+        return seconds > 0 ? (profileTimestamp() - startTicks) / seconds : 0;
+    }
+    
+    ProfileSample sample() const {
+        ProfileSample s;
+        for (int p = 0; p < PHASES; p++) {
+            s.ticks[p] = ticks[p].load(std::memory_order_relaxed);
+            s.calls[p] = calls[p].load(std::memory_order_relaxed);
+        }
+        s.ticksPerSecond = ticksPerSecond();
+        return s;
+    }
+    
+    void clear() {
+        for (int p = 0; p < PHASES; p++) {
+            ticks[p].store(0, std::memory_order_relaxed);
+            calls[p].store(0, std::memory_order_relaxed);
+        }
+    }
+    
+    bool isTracing() const {
+        return tracing.load(std::memory_order_relaxed);
+    }
+    
+    // Start logging every traced scope, up to TRACE_CAPACITY events
+    void startTrace() {
+        if (tracing) return;
+        if (!events) events.reset(new TraceEvent[TRACE_CAPACITY]);
+        for (size_t i = 0; i < TRACE_CAPACITY; i++) events[i].written.store(false, std::memory_order_relaxed);
+        nextEvent.store(0, std::memory_order_relaxed);
+        tracing.store(true, std::memory_order_release);
+    }
+    
+    void stopTrace() {
+        tracing.store(false, std::memory_order_release);
+    }
+    
+    // The events of the last capture as Chrome trace JSON (timestamps in
+    // microseconds since startup). Stop the capture first.
+    bool writeTrace(const std::string& path) const {
+        std::ofstream file(path);
+        if (!file) return false;
+        
+        const double ticksPerMicrosecond = ticksPerSecond() / 1e6;
+        const size_t captured = events ? std::min(nextEvent.load(), TRACE_CAPACITY) : 0;
+        size_t written = 0;
+        char line[160];
+        file << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+        for (size_t i = 0; i < captured; i++) {
+            const TraceEvent& event = events[i];
+            if (!event.written.load(std::memory_order_acquire)) continue;
+            std::snprintf(line, sizeof(line),
+                          "%s\n{\"name\":\"%s\",\"cat\":\"physics\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,"
+                          "\"ts\":%.3f,\"dur\":%.3f}",
+                          written > 0 ? "," : "", profilePhaseName(event.phase), event.thread,
+                          (event.begin - startTicks) / ticksPerMicrosecond,
+                          (event.end - event.begin) / ticksPerMicrosecond);
+            file << line;
+            written++;
+        }
+        file << "\n]}\n";
+        
+        std::cout << "🧵 Wrote " << written << " trace events to " << path << std::endl;
+        if (nextEvent.load() > TRACE_CAPACITY) {
+            std::cout << "⚠️  Trace buffer full, " << nextEvent.load() - TRACE_CAPACITY << " events dropped" << std::endl;
+        }
+        return (bool)file;
+    }
+    
+    // Time per step of every phase since the last clear()
+    void printReport() const {
+        ProfileSample s = sample();
+        long long steps = s.count(ProfilePhase::Step);
+        long long frames = s.count(ProfilePhase::Present);
+        double phaseTotal = 0;
+        for (int p = (int)ProfilePhase::Integrate; p < (int)ProfilePhase::Render; p++) {
+            phaseTotal += s.milliseconds((ProfilePhase)p);
+        }
+        
+        std::cout << "\n📊 PROFILE (" << steps << " steps; ms per step, phases summed over threads):" << std::endl;
+        char line[160];
+        for (int p = 0; p < PHASES; p++) {
+            ProfilePhase phase = (ProfilePhase)p;
+            long long per = phase >= ProfilePhase::Render ? frames : steps;
+            if (s.count(phase) == 0 || per == 0) continue;
+            double ms = s.milliseconds(phase) / per;
+            if (phase == ProfilePhase::Step) {
+                std::snprintf(line, sizeof(line), "   %-13s %9.4f ms (wall)", profilePhaseName(phase), ms);
+            } else if (phase >= ProfilePhase::Render) {
+                std::snprintf(line, sizeof(line), "   %-13s %9.4f ms per frame", profilePhaseName(phase), ms);
+            } else {
+                std::snprintf(line, sizeof(line), "   %-13s %9.4f ms %6.1f %%", profilePhaseName(phase), ms,
+                              phaseTotal > 0 ? s.milliseconds(phase) / phaseTotal * 100 : 0);
+            }
+            std::cout << line << std::endl;
+        }
+    }
+};
+
+// Times its own lifetime for Profiler::global(); use it through the macros
+class ProfileScope {
+private:
+    static inline thread_local uint64_t nestedTicks = 0;   // Time of finished scopes nested in the open one
+    
+    ProfilePhase phase;
+    bool traced;
+    uint64_t outerNested;
+    uint64_t begin;
+    
+public:
+    explicit ProfileScope(ProfilePhase profilePhase, bool trace = true)
+        : phase(profilePhase), traced(trace), outerNested(nestedTicks) {
+        nestedTicks = 0;
+        begin = profileTimestamp();
+    }
+    
+    ~ProfileScope() {
+        uint64_t end = profileTimestamp();
+        uint64_t elapsed = end - begin;
+        uint64_t own = phase == ProfilePhase::Step ? elapsed : elapsed - std::min(elapsed, nestedTicks);
+        Profiler::global().add(phase, begin, end, own, traced);
+        nestedTicks = outerNested + elapsed;
+    }
+    
+    ProfileScope(const ProfileScope&) = delete;
+    ProfileScope& operator=(const ProfileScope&) = delete;
+};
+
+#define PHYSICS_SIM_PROFILE_JOIN2(a, b) a##b
+#define PHYSICS_SIM_PROFILE_JOIN(a, b) PHYSICS_SIM_PROFILE_JOIN2(a, b)
+#ifdef PHYSICS_SIM_PROFILE
+static const bool PROFILER_AVAILABLE = true;
+#define PHYSICS_SIM_PROFILE_SCOPE(phase) \
+    ProfileScope PHYSICS_SIM_PROFILE_JOIN(profileScope, __LINE__)(ProfilePhase::phase)
+// For scopes inside per-pair loops: counted, but far too many to trace
+#define PHYSICS_SIM_PROFILE_HOT(phase) \
+    ProfileScope PHYSICS_SIM_PROFILE_JOIN(profileScope, __LINE__)(ProfilePhase::phase, false)
+#else
+static const bool PROFILER_AVAILABLE = false;
+#define PHYSICS_SIM_PROFILE_SCOPE(phase) ((void)0)
+#define PHYSICS_SIM_PROFILE_HOT(phase) ((void)0)
+#endif
+
+#ifndef PHYSICS_SIM_NO_SDL
+// Batched ball renderer. One white disk texture is pre-rasterized per radius
+// bucket (4, 8, 16, ... 128 px) and every ball becomes a textured quad whose
+// vertex colour tints the disk, so a whole frame is one SDL_RenderGeometry
+// call per bucket in use instead of 2r+1 line draws per ball.
+class CircleRenderer {
+private:
+    static const int BUCKETS = 6;
+    static const int SMALLEST_RADIUS = 4;
+    
+    SDL_Renderer* owner;
+    SDL_Texture* textures[BUCKETS];
+    std::vector<SDL_Vertex> vertices[BUCKETS];
+    std::vector<int> indices[BUCKETS];
+    bool available;
+    
+    static int bucketRadius(int bucket) {
+        return SMALLEST_RADIUS << bucket;
+    }
+    
+    // Smallest bucket at least as large as the ball, so disks are only scaled down
+    static int bucketFor(double radius) {
+        int bucket = 0;
+        while (bucket < BUCKETS - 1 && bucketRadius(bucket) < radius) bucket++;
+        return bucket;
+    }
+    
+    SDL_Texture* createDisk(SDL_Renderer* renderer, int radius) {
+        int size = radius * 2;
+        std::vector<Uint32> pixels(size * size);
+        Uint8* bytes = (Uint8*)pixels.data();
+        
+        for (int py = 0; py < size; py++) {
+            for (int px = 0; px < size; px++) {
+                // 1px smooth edge so scaled-down disks stay round
+                double dx = px + 0.5 - radius;
+                double dy = py + 0.5 - radius;
+                double coverage = std::max(0.0, std::min(1.0, radius - std::sqrt(dx * dx + dy * dy) + 0.5));
+                Uint8* texel = bytes + 4 * (py * size + px);
+                texel[0] = texel[1] = texel[2] = 255;
+                texel[3] = (Uint8)(coverage * 255);
+            }
+        }
+        
+        SDL_Texture* texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGBA32,
+                                                 SDL_TEXTUREACCESS_STATIC, size, size);
+        if (!texture) return nullptr;
+        SDL_UpdateTexture(texture, nullptr, pixels.data(), size * 4);
+        SDL_SetTextureBlendMode(texture, SDL_BLENDMODE_BLEND);
+        return texture;
+    }
+    
+    bool prepare(SDL_Renderer* renderer) {
+        if (owner == renderer) return available;
+        
+        release();
+        owner = renderer;
+        available = true;
+        for (int b = 0; b < BUCKETS; b++) {
+            textures[b] = createDisk(renderer, bucketRadius(b));
+            if (!textures[b]) available = false;
+        }
+        return available;
+    }
+    
+public:
+    CircleRenderer() : owner(nullptr), available(false) {
+        for (int b = 0; b < BUCKETS; b++) textures[b] = nullptr;
+    }
+    
+    // Textures belong to the renderer; call this before SDL_DestroyRenderer.
+    // (SDL frees them with the renderer anyway, so skipping it does not leak.)
+    void release() {
+        for (int b = 0; b < BUCKETS; b++) {
+            if (textures[b]) SDL_DestroyTexture(textures[b]);
+            textures[b] = nullptr;
+        }
+        owner = nullptr;
+        available = false;
+    }
+    
+    // Draw n balls at (x, y) with radius r and the given colours. Returns false
+    // if batched drawing is not available, so the caller can fall back to
+    // Ball::render.
+    template <typename T>
+    bool draw(SDL_Renderer* renderer, size_t n, const T* x, const T* y, const T* r, const SDL_Color* colors) {
+#if SDL_VERSION_ATLEAST(2, 0, 18)
+        if (!prepare(renderer)) return false;
+        
+        for (int b = 0; b < BUCKETS; b++) {
+            vertices[b].clear();
+            indices[b].clear();
+        }
+        
+        for (size_t i = 0; i < n; i++) {
+            int b = bucketFor(r[i]);
+            std::vector<SDL_Vertex>& v = vertices[b];
+            std::vector<int>& idx = indices[b];
+            
+            float x0 = (float)(x[i] - r[i]);
+            float y0 = (float)(y[i] - r[i]);
+            float x1 = (float)(x[i] + r[i]);
+            float y1 = (float)(y[i] + r[i]);
+            SDL_Color c = colors[i];
+            
+            int first = (int)v.size();
+            v.push_back({{x0, y0}, c, {0, 0}});
+            v.push_back({{x1, y0}, c, {1, 0}});
+            v.push_back({{x1, y1}, c, {1, 1}});
+            v.push_back({{x0, y1}, c, {0, 1}});
+            
+            idx.push_back(first);
+            idx.push_back(first + 1);
+            idx.push_back(first + 2);
+            idx.push_back(first);
+            idx.push_back(first + 2);
+            idx.push_back(first + 3);
+        }
+        
+        for (int b = 0; b < BUCKETS; b++) {
+            if (vertices[b].empty()) continue;
+            if (SDL_RenderGeometry(renderer, textures[b], vertices[b].data(), (int)vertices[b].size(),
+                                   indices[b].data(), (int)indices[b].size()) != 0) {
+                // Renderer without geometry support: use the fallback from now on
+                available = false;
+                return false;
+            }
+        }
+        return true;
+#else
+        (void)renderer;
+        (void)n;
+        (void)x;
+        (void)y;
+        (void)r;
+        (void)colors;
+        return false;
+#endif
+    }
+};
+#endif
+
+// Everything needed to draw one physics state, copied out of the simulation
+// so the renderer never reads arrays that are being stepped
+template <typename T>
+struct RenderState {
+    std::vector<T> x, y;                    // Positions after the step
+    std::vector<T> previousX, previousY;    // Positions before it, for interpolation
+    std::vector<T> r;
+    std::vector<SDL_Color> colors;
+    long long step = 0;
+    std::chrono::steady_clock::time_point time;     // When the step finished
+};
+
+// Lock-free single-producer single-consumer triple buffer. The writer fills
+// its back slot and publishes it by swapping it with the shared middle slot;
+// the reader swaps the middle slot with its front slot when a new one is
+// there. Neither side ever waits, the writer never touches what the reader is
+// looking at, and the reader always gets the most recent complete value
+// (intermediate ones are simply overwritten).
+template <typename Value>
+class TripleBuffer {
+private:
+    static const int INDEX = 3;
+    static const int FRESH = 4;     // Set while the middle slot has not been read
+    
+    Value slots[3];
+    std::atomic<int> middle;
+    int back;                       // Writer only
+    int front;                      // Reader only
+    
+public:
+    TripleBuffer() : middle(1), back(0), front(2) {}
+    
+    // Writer: the slot to fill, then publish()
+    Value& writeSlot() {
+        return slots[back];
+    }
+    
+    void publish() {
+        back = middle.exchange(back | FRESH, std::memory_order_acq_rel) & INDEX;
+    }
+    
+    // Reader: take the newest published value, if any; false when there is
+    // nothing new (readSlot() then still holds the previous one)
+    bool acquire() {
+        if (!(middle.load(std::memory_order_relaxed) & FRESH)) return false;
+        front = middle.exchange(front, std::memory_order_acq_rel) & INDEX;
+        return true;
+    }
+    
+    const Value& readSlot() const {
+        return slots[front];
+    }
+};
+
+#ifndef PHYSICS_SIM_NO_SDL
+// On-screen profiler panel: time per step of every physics phase and per
+// frame of render and present, averaged over half-second windows. Text uses
+// a built-in 3x5 pixel font, so no font library is needed.
+class ProfilerHud {
+private:
+    static const int SCALE = 2;                     // Screen pixels per font pixel
+    static const int ADVANCE = 4 * SCALE;
+    static const int LINE = 7 * SCALE;
+    static const int PADDING = 6;
+    static const int LABEL_WIDTH = 13 * ADVANCE;
+    static const int BAR_WIDTH = 160;
+    static const int VALUE_WIDTH = 10 * ADVANCE;
+    
+    ProfileSample windowStart;
+    ProfileSample shown;            // The last complete window
+    double shownSeconds;
+    std::chrono::steady_clock::time_point windowTime;
+    std::vector<SDL_Rect> pixels;
+    
+    // Five rows of three bits, top row first (one octal digit per row)
+    static int glyph(char c) {
+        static const int DIGITS[10] = {
+            075557, 026227, 071747, 071717, 055711, 074717, 074757, 071111, 075757, 075717
+        };
+        static const int LETTERS[26] = {
+            025755, 065656, 034443, 065556, 074647, 074644, 034553, 055755, 072227, 011152, 055655, 044447, 057755,
+            065555, 025552, 065644, 025563, 065655, 034216, 072222, 055557, 055552, 055775, 055255, 055222, 071247
+        };
+        if (c >= '0' && c <= '9') return DIGITS[c - '0'];
+        if (c >= 'a' && c <= 'z') return LETTERS[c - 'a'];
+        if (c >= 'A' && c <= 'Z') return LETTERS[c - 'A'];
+        switch (c) {
+            case '.': return 000002;
+            case ':': return 002020;
+            case '/': return 011244;
+            case '-': return 000700;
+            case '%': return 051245;
+            default:  return 0;
+        }
+    }
+    
+    // Queue the lit pixels of s; they are drawn in one call at the end
+    void text(int x, int y, const char* s) {
+        for (; *s; s++, x += ADVANCE) {
+            int bits = glyph(*s);
+            for (int row = 0; row < 5; row++) {
+                int rowBits = (bits >> (3 * (4 - row))) & 7;
+                for (int col = 0; col < 3; col++) {
+                    if (rowBits & (4 >> col)) pixels.push_back({x + col * SCALE, y + row * SCALE, SCALE, SCALE});
+                }
+            }
+        }
+    }
+    
+public:
+    ProfilerHud() : shownSeconds(0), windowTime(std::chrono::steady_clock::now()) {}
+    
+    void draw(SDL_Renderer* renderer) {
+        auto now = std::chrono::steady_clock::now();
+        double seconds = std::chrono::duration<double>(now - windowTime).count();
+        if (seconds >= 0.5) {
+            ProfileSample current = Profiler::global().sample();
+            shown = current.since(windowStart);
+            shownSeconds = seconds;
+            windowStart = current;
+            windowTime = now;
+        }
+        
+        const int FIRST = (int)ProfilePhase::Integrate;
+        const int PHASES = ProfileSample::PHASES;
+        long long steps = shown.count(ProfilePhase::Step);
+        long long frames = shown.count(ProfilePhase::Present);
+        double perCall[PHASES];
+        double largest = 0;
+        for (int p = 0; p < PHASES; p++) {
+            long long per = (ProfilePhase)p >= ProfilePhase::Render ? frames : steps;
+            perCall[p] = per > 0 ? shown.milliseconds((ProfilePhase)p) / per : 0;
+            if (p >= FIRST) largest = std::max(largest, perCall[p]);
+        }
+        
+        const int x = 12;
+        const int y = 12;
+        const int rows = PHASES - FIRST + 2;
+        SDL_Rect panel = {x, y, 2 * PADDING + LABEL_WIDTH + BAR_WIDTH + ADVANCE + VALUE_WIDTH,
+                          2 * PADDING + rows * LINE - (LINE - 5 * SCALE)};
+        SDL_SetRenderDrawBlendMode(renderer, SDL_BLENDMODE_BLEND);
+        SDL_SetRenderDrawColor(renderer, 0, 0, 0, 190);
+        SDL_RenderFillRect(renderer, &panel);
+        
+        pixels.clear();
+        char line[64];
+        std::snprintf(line, sizeof(line), "step %.2f ms  %.0f steps/s  %.0f fps", perCall[(int)ProfilePhase::Step],
+                      shownSeconds > 0 ? steps / shownSeconds : 0, shownSeconds > 0 ? frames / shownSeconds : 0);
+        text(x + PADDING, y + PADDING, line);
+        
+        for (int p = FIRST; p < PHASES; p++) {
+            int rowY = y + PADDING + (p - FIRST + 1) * LINE;
+            text(x + PADDING, rowY, profilePhaseName((ProfilePhase)p));
+            
+            SDL_Color color = NEON_COLORS[p % NEON_COLOR_COUNT];
+            SDL_SetRenderDrawColor(renderer, color.r, color.g, color.b, 255);
+            int length = largest > 0 ? (int)(BAR_WIDTH * perCall[p] / largest) : 0;
+            SDL_Rect bar = {x + PADDING + LABEL_WIDTH, rowY, std::max(1, length), 5 * SCALE};
+            SDL_RenderFillRect(renderer, &bar);
+            
+            std::snprintf(line, sizeof(line), "%7.2f ms", perCall[p]);
+            text(x + PADDING + LABEL_WIDTH + BAR_WIDTH + ADVANCE, rowY, line);
+        }
+        text(x + PADDING, y + PADDING + (rows - 1) * LINE, "physics per step, all threads");
+        
+        SDL_SetRenderDrawColor(renderer, 255, 255, 255, 255);
+        if (!pixels.empty()) SDL_RenderFillRects(renderer, pixels.data(), (int)pixels.size());
+        SDL_SetRenderDrawBlendMode(renderer, SDL_BLENDMODE_NONE);
+    }
+};
+
+// Draws RenderStates: box, then the balls interpolated between the two
+// stored positions, batched through CircleRenderer when possible, and the
+// profiler panel when it is switched on
+template <typename T>
+class FrameRenderer {
+private:
+    CircleRenderer circles;
+    std::vector<T> blendX, blendY;
+    ProfilerHud hud;
+    bool showHud;
+    
+    // Everything but the present
+    void render(SDL_Renderer* renderer, const RenderState<T>& state, double alpha, int width, int height) {
+        PHYSICS_SIM_PROFILE_SCOPE(Render);
+        const size_t n = state.x.size();
+        const T* drawX = state.x.data();
+        const T* drawY = state.y.data();
+        if (alpha < 1.0 && state.previousX.size() == n) {
+            blendX.resize(n);
+            blendY.resize(n);
+            for (size_t i = 0; i < n; i++) {
+                blendX[i] = T(state.previousX[i] + (state.x[i] - state.previousX[i]) * alpha);
+                blendY[i] = T(state.previousY[i] + (state.y[i] - state.previousY[i]) * alpha);
+            }
+            drawX = blendX.data();
+            drawY = blendY.data();
+        }
+        
+        // Clear screen with black background
+        SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
+        SDL_RenderClear(renderer);
+        
+        // Draw blue box outline (closed container)
+        SDL_SetRenderDrawColor(renderer, 0, 100, 255, 255);
+        for (int i = 0; i < 4; i++) {
+            SDL_Rect border = {i, i, width - 2*i, height - 2*i};
+            SDL_RenderDrawRect(renderer, &border);
+        }
+        
+        // Render all balls, one batch per radius bucket when the renderer supports it
+        if (!circles.draw(renderer, n, drawX, drawY, state.r.data(), state.colors.data())) {
+            for (size_t i = 0; i < n; i++) {
+                Ball<T> ball(0, drawX[i], drawY[i], 0, 0, state.r[i], 1, state.colors[i]);
+                ball.render(renderer);
+            }
+        }
+        
+        if (showHud) hud.draw(renderer);
+    }
+    
+public:
+    FrameRenderer() : showHud(false) {}
+    
+    // alpha in [0, 1] blends from the positions before the step (0) to the
+    // ones after it (1)
+    void draw(SDL_Renderer* renderer, const RenderState<T>& state, double alpha, int width, int height) {
+        render(renderer, state, alpha, width, height);
+        
+        PHYSICS_SIM_PROFILE_SCOPE(Present);
+        SDL_RenderPresent(renderer);
+    }
+    
+    void setProfileHud(bool enabled) {
+        showHud = enabled;
+    }
+    
+    bool getProfileHud() const {
+        return showHud;
+    }
+    
+    // Free the textures; call before destroying the renderer
+    void release() {
+        circles.release();
+    }
+};
+#endif
+
+// Small fixed pool of worker threads. run() hands task indices out through an
+// atomic counter and returns once every task has finished; the calling thread
+// works on tasks too, so a pool of size 1 has no worker threads at all. The
+// job is held as a pointer to the caller's callable plus a trampoline rather
+// than a std::function, which would allocate for most lambdas on every run.
+class ThreadPool {
+private:
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable done;
+    const void* job;
+    void (*invoke)(const void* job, int task, int worker);
+    std::atomic<int> nextTask;
+    int taskCount;
+    int busy;
+    unsigned long long generation;
+    bool stopping;
+    
+    void drain(int worker) {
+        int task;
+        while ((task = nextTask.fetch_add(1)) < taskCount) {
+            invoke(job, task, worker);
+        }
+    }
+    
+    void workerLoop(int worker) {
+        unsigned long long seen = 0;
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            wake.wait(lock, [&] { return stopping || generation != seen; });
+            if (stopping) return;
+            seen = generation;
+            
+            lock.unlock();
+            drain(worker);
+            lock.lock();
+            
+            if (--busy == 0) done.notify_one();
+        }
+    }
+    
+public:
+    explicit ThreadPool(int threads)
+        : job(nullptr), invoke(nullptr), nextTask(0), taskCount(0), busy(0), generation(0), stopping(false) {
+        for (int w = 1; w < threads; w++) {
+            workers.emplace_back(&ThreadPool::workerLoop, this, w);
+        }
+    }
+    
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (std::thread& worker : workers) {
+            worker.join();
+        }
+    }
+    
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+    
+    int size() const {
+        return (int)workers.size() + 1;
+    }
+    
+    // Call fn(task, worker) for every task in [0, tasks); worker is in [0, size())
+    template <typename Fn>
+    void run(int tasks, const Fn& fn) {
+        if (tasks <= 0) return;
+        if (workers.empty() || tasks == 1) {
+            for (int t = 0; t < tasks; t++) fn(t, 0);
+            return;
+        }
+        
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            job = &fn;
+            invoke = [](const void* callable, int task, int worker) {
+                (*static_cast<const Fn*>(callable))(task, worker);
+            };
+            taskCount = tasks;
+            nextTask = 0;
+            busy = (int)workers.size();
+            generation++;
+        }
+        wake.notify_all();
+        drain(0);
+        
+        std::unique_lock<std::mutex> lock(mutex);
+        done.wait(lock, [&] { return busy == 0; });
+    }
+};
+
+// Worker threads for batches of independent jobs of very different length
+// (the runs of an ensemble). The jobs are dealt round-robin, in the order
+// given, onto one deque per worker; a worker takes its own jobs from the
+// front and, when it has none left, steals the next one from the front of
+// another worker's deque. Dealt longest first, the long jobs start early
+// and the short ones fill in at the end. Jobs are expected to take
+// milliseconds or more, so one lock per deque costs nothing; ThreadPool is
+// the one for the fine-grained tasks inside a step.
+class WorkStealingPool {
+private:
+    struct Queue {
+        std::mutex mutex;
+        std::deque<int> jobs;
+    };
+    
+    int threads;
+    std::vector<std::unique_ptr<Queue>> queues;
+    std::atomic<long long> steals;
+    
+    bool take(int worker, int& job) {
+        for (int k = 0; k < threads; k++) {
+            Queue& queue = *queues[(worker + k) % threads];
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            if (queue.jobs.empty()) continue;
+            job = queue.jobs.front();
+            queue.jobs.pop_front();
+            if (k > 0) steals++;
+            return true;
+        }
+        return false;
+    }
+    
+public:
+    explicit WorkStealingPool(int threadCount) : threads(std::max(1, threadCount)), steals(0) {
+        for (int w = 0; w < threads; w++) queues.emplace_back(new Queue());
+    }
+    
+    int size() const {
+        return threads;
+    }
+    
+    // Jobs taken from another worker's deque during the last run()
+    long long getSteals() const {
+        return steals;
+    }
+    
+    // Call fn(job, worker) for every job in jobs, worker in [0, size()). The
+    // calling thread is worker 0; returns once every job has finished.
+    template <typename Fn>
+    void run(const std::vector<int>& jobs, const Fn& fn) {
+        steals = 0;
+        for (size_t k = 0; k < jobs.size(); k++) queues[k % threads]->jobs.push_back(jobs[k]);
+        
+        auto work = [&](int worker) {
+            int job;
+            while (take(worker, job)) fn(job, worker);
+        };
+        std::vector<std::thread> workers;
+        for (int w = 1; w < std::min<int>(threads, (int)jobs.size()); w++) workers.emplace_back(work, w);
+        work(0);
+        for (std::thread& worker : workers) worker.join();
+    }
+};
+
+// Linear per-step buffer (contact lists): reset() at the start of a step,
+// push() during it. The storage is kept, and reset() tops it up to half again
+// the largest step seen so far, so the usual step-to-step ups and downs never
+// reallocate mid-step and a step stops allocating once the workload has
+// peaked. A std::vector reused with clear() leaves anywhere between no and 2x
+// headroom, which is what kept the old per-row lists allocating.
+template <typename Item>
+class FrameArena {
+private:
+    std::vector<Item> items;    // Its size is the capacity; it only grows
+    size_t used;
+    size_t peak;
+    
+public:
+    FrameArena() : used(0), peak(0) {}
+    
+    // expected: a size the coming step may reach besides this arena's own
+    // history (a worker's arena can end up with every row of a step)
+    void reset(size_t expected = 0) {
+        peak = std::max(peak, std::max(used, expected));
+        if (items.size() < peak + peak / 2) items.resize(peak + peak / 2);
+        used = 0;
+    }
+    
+    void push(const Item& item) {
+        if (used == items.size()) items.resize(std::max<size_t>(64, 2 * used));
+        items[used++] = item;
+    }
+    
+    size_t size() const {
+        return used;
+    }
+    
+    const Item& operator[](size_t k) const {
+        return items[k];
+    }
+};
+
+// Morton (Z-curve) order of the balls, for re-sorting the storage so balls
+// that are close in the world stay close in memory. Positions are quantized
+// to cells of the given size and the column and row bits interleaved into a
+// 32-bit key; a stable LSD radix sort, 8 bits per pass, gives the new order.
+// Ties keep their index order, and the passes are split into fixed chunks
+// rather than per worker, so the order is the same for every thread count.
+class MortonOrder {
+private:
+    static const size_t CHUNK = 16384;
+    static const int RADIX = 256;
+    std::vector<uint32_t> keys, sortedKeys;
+    std::vector<int> order, sortedOrder;
+    std::vector<int> offsets;       // [chunk * RADIX + digit]: counts, then scatter positions
+    
+    // The low 16 bits of v moved to the even bits
+    static uint32_t spread(uint32_t v) {
+        v &= 0xffff;
+        v = (v | (v << 8)) & 0x00ff00ff;
+        v = (v | (v << 4)) & 0x0f0f0f0f;
+        v = (v | (v << 2)) & 0x33333333;
+        v = (v | (v << 1)) & 0x55555555;
+        return v;
+    }
+    
+    template <typename Fn>
+    static void forChunks(ThreadPool* pool, int chunks, const Fn& fn) {
+        if (pool && chunks > 1) {
+            pool->run(chunks, [&](int task, int) { fn(task); });
+        } else {
+            for (int task = 0; task < chunks; task++) fn(task);
+        }
+    }
+    
+public:
+    static uint32_t code(int col, int row) {
+        return spread(col) | (spread(row) << 1);
+    }
+    
+    // The new order: slot k of the sorted storage takes ball order[k]. Valid
+    // until the next call.
+    template <typename T>
+    const std::vector<int>& sort(const BallStore<T>& balls, double cellSize, int worldWidth, int worldHeight,
+                                 ThreadPool* pool = nullptr) {
+        const size_t n = balls.size();
+        const int chunks = (int)((n + CHUNK - 1) / CHUNK);
+        const int cols = std::min(65536, UniformGrid::rowCount(cellSize, worldWidth));
+        const int rows = std::min(65536, UniformGrid::rowCount(cellSize, worldHeight));
+        keys.resize(n);
+        sortedKeys.resize(n);
+        order.resize(n);
+        sortedOrder.resize(n);
+        offsets.resize((size_t)chunks * RADIX);
+        
+        forChunks(pool, chunks, [&](int task) {
+            const size_t end = std::min(n, (task + 1) * CHUNK);
+            for (size_t i = task * CHUNK; i < end; i++) {
+                keys[i] = code(UniformGrid::coordinate(balls.x[i], cellSize, cols),
+                               UniformGrid::coordinate(balls.y[i], cellSize, rows));
+                order[i] = (int)i;
+            }
+        });
+        
+        // Digits above the largest possible key are zero for every ball
+        const uint32_t top = code(cols - 1, rows - 1);
+        for (int shift = 0; shift < 32 && (top >> shift) != 0; shift += 8) {
+            forChunks(pool, chunks, [&](int task) {
+                int* counts = &offsets[(size_t)task * RADIX];
+                std::fill(counts, counts + RADIX, 0);
+                const size_t end = std::min(n, (task + 1) * CHUNK);
+                for (size_t i = task * CHUNK; i < end; i++) counts[(keys[i] >> shift) & (RADIX - 1)]++;
+            });
+            
+            // Digit by digit, earlier chunks first: that is what keeps it stable
+            int position = 0;
+            for (int digit = 0; digit < RADIX; digit++) {
+                for (int task = 0; task < chunks; task++) {
+                    int& slot = offsets[(size_t)task * RADIX + digit];
+                    int count = slot;
+                    slot = position;
+                    position += count;
+                }
+            }
+            
+            forChunks(pool, chunks, [&](int task) {
+                int* next = &offsets[(size_t)task * RADIX];
+                const size_t end = std::min(n, (task + 1) * CHUNK);
+                for (size_t i = task * CHUNK; i < end; i++) {
+                    int slot = next[(keys[i] >> shift) & (RADIX - 1)]++;
+                    sortedKeys[slot] = keys[i];
+                    sortedOrder[slot] = order[i];
+                }
+            });
+            keys.swap(sortedKeys);
+            order.swap(sortedOrder);
+        }
+        return order;
+    }
+};
+
+// Plain copy of the telemetry counters at one point in time
+struct TelemetrySample {
+    long long steps = 0;
+    long long totalCollisions = 0;
+    long long frameCollisions = 0;
+    long long broadPhaseCandidates = 0;   // Pairs handed to the narrow phase last step
+    long long narrowPhaseHits = 0;        // Candidates that were actually overlapping
+    long long stepNanoseconds = 0;        // Wall time of the last update()
+};
+
+// Counters published once per step by the physics thread. They are relaxed
+// atomics so another thread can sample them at any time without locking and
+// without the step itself ever doing I/O.
+struct StepTelemetry {
+    std::atomic<long long> steps{0};
+    std::atomic<long long> totalCollisions{0};
+    std::atomic<long long> frameCollisions{0};
+    std::atomic<long long> broadPhaseCandidates{0};
+    std::atomic<long long> narrowPhaseHits{0};
+    std::atomic<long long> stepNanoseconds{0};
+    
+    void publish(long long collisions, long long candidates, long long hits, long long nanoseconds) {
+        frameCollisions.store(collisions, std::memory_order_relaxed);
+        broadPhaseCandidates.store(candidates, std::memory_order_relaxed);
+        narrowPhaseHits.store(hits, std::memory_order_relaxed);
+        stepNanoseconds.store(nanoseconds, std::memory_order_relaxed);
+        totalCollisions.fetch_add(collisions, std::memory_order_relaxed);
+        steps.fetch_add(1, std::memory_order_relaxed);
+    }
+    
+    void clear() {
+        publish(0, 0, 0, 0);
+        steps.store(0, std::memory_order_relaxed);
+        totalCollisions.store(0, std::memory_order_relaxed);
+    }
+    
+    TelemetrySample sample() const {
+        TelemetrySample s;
+        s.steps = steps.load(std::memory_order_relaxed);
+        s.totalCollisions = totalCollisions.load(std::memory_order_relaxed);
+        s.frameCollisions = frameCollisions.load(std::memory_order_relaxed);
+        s.broadPhaseCandidates = broadPhaseCandidates.load(std::memory_order_relaxed);
+        s.narrowPhaseHits = narrowPhaseHits.load(std::memory_order_relaxed);
+        s.stepNanoseconds = stepNanoseconds.load(std::memory_order_relaxed);
+        return s;
+    }
+};
+
+// Snapshot file layout: this header, then the SoA arrays (x, y, vx, vy, r, m,
+// invM in the scalar type named by scalarSize, then BallInfo), each at a
+// 64-byte aligned offset so a mapped file can be read in place. Native byte
+// order; files are meant to move between runs, not between architectures.
+struct SnapshotHeader {
+    static const int ARRAYS = 8;
+    
+    char magic[8];              // "NEONSNAP"
+    uint32_t version;
+    uint32_t scalarSize;        // 4 = float, 8 = double
+    uint64_t ballCount;
+    uint32_t seed;
+    uint32_t scene;
+    int32_t width;
+    int32_t height;
+    double minRadius;
+    double maxRadius;
+    int64_t stepCount;
+    int64_t collisionCount;
+    uint64_t offsets[ARRAYS];
+};
+
+static const char SNAPSHOT_MAGIC[8] = {'N', 'E', 'O', 'N', 'S', 'N', 'A', 'P'};
+static const uint32_t SNAPSHOT_VERSION = 1;
+static_assert(sizeof(BallInfo) == 8, "BallInfo is stored raw in snapshots");
+
+// Read-only memory mapping of a whole file (mmap / MapViewOfFile)
+class MappedFile {
+private:
+    const char* bytes;
+    size_t length;
+#ifdef _WIN32
+    HANDLE file;
+    HANDLE mapping;
+#endif
+    
+public:
+    MappedFile() : bytes(nullptr), length(0) {
+#ifdef _WIN32
+        file = INVALID_HANDLE_VALUE;
+        mapping = nullptr;
+#endif
+    }
+    
+    ~MappedFile() {
+        close();
+    }
+    
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    
+    bool open(const std::string& path) {
+        close();
+#ifdef _WIN32
+        file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+                           FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+        if (file == INVALID_HANDLE_VALUE) return false;
+        LARGE_INTEGER fileSize;
+        if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart == 0) {
+            close();
+            return false;
+        }
+        mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (!mapping) {
+            close();
+            return false;
+        }
+        bytes = (const char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+        if (!bytes) {
+            close();
+            return false;
+        }
+        length = (size_t)fileSize.QuadPart;
+#else
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+        struct stat info;
+        if (fstat(fd, &info) != 0 || info.st_size == 0) {
+            ::close(fd);
+            return false;
+        }
+        void* view = mmap(nullptr, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);    // The mapping keeps the file alive
+        if (view == MAP_FAILED) return false;
+        madvise(view, (size_t)info.st_size, MADV_SEQUENTIAL);
+        bytes = (const char*)view;
+        length = (size_t)info.st_size;
+#endif
+        return true;
+    }
+    
+    void close() {
+#ifdef _WIN32
+        if (bytes) UnmapViewOfFile(bytes);
+        if (mapping) CloseHandle(mapping);
+        if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+        mapping = nullptr;
+        file = INVALID_HANDLE_VALUE;
+#else
+        if (bytes) munmap((void*)bytes, length);
+#endif
+        bytes = nullptr;
+        length = 0;
+    }
+    
+    const char* data() const { return bytes; }
+    size_t size() const { return length; }
+};
+
+// Writes snapshots on a background thread. The caller serializes the state
+// into a buffer (a plain copy, so the simulation can keep stepping) and hands
+// it over; only one write is in flight, a new one waits for the previous.
+class SnapshotWriter {
+private:
+    std::thread thread;
+    std::atomic<bool> lastOk;
+    
+public:
+    SnapshotWriter() : lastOk(true) {}
+    
+    ~SnapshotWriter() {
+        wait();
+    }
+    
+    SnapshotWriter(const SnapshotWriter&) = delete;
+    SnapshotWriter& operator=(const SnapshotWriter&) = delete;
+    
+    void write(std::vector<char>&& bytes, const std::string& path) {
+        wait();
+        thread = std::thread([this, path](std::vector<char> buffer) {
+            // Written under a temporary name and renamed, so a crash never
+            // leaves a half-written snapshot behind
+            std::string temporary = path + ".tmp";
+            FILE* file = fopen(temporary.c_str(), "wb");
+            bool ok = file && fwrite(buffer.data(), 1, buffer.size(), file) == buffer.size();
+            if (file) ok = (fclose(file) == 0) && ok;
+#ifdef _WIN32
+            ok = ok && MoveFileExA(temporary.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING);
+#else
+            ok = ok && rename(temporary.c_str(), path.c_str()) == 0;
+#endif
+            if (!ok) std::remove(temporary.c_str());
+            lastOk = ok;
+            std::cout << (ok ? "💾 Snapshot saved: " : "❌ Snapshot write failed: ") << path << std::endl;
+        }, std::move(bytes));
+    }
+    
+    // Block until the pending write (if any) is done; false if it failed
+    bool wait() {
+        if (thread.joinable()) thread.join();
+        return lastOk;
+    }
+};
+
+// Largest world side a snapshot may have: float positions still resolve
+// single pixels up to 2^24
+static const int32_t SNAPSHOT_MAX_WORLD = 1 << 24;
+
+// The per-ball values of a snapshot stored in scalar type S: finite state,
+// radii within the header's range (the grids are sized from it), masses
+// positive with the matching inverse. nullptr if they are fine, else why not.
+template <typename S>
+const char* checkSnapshotBalls(const char* data, const SnapshotHeader* header) {
+    const S* x = (const S*)(data + header->offsets[0]);
+    const S* y = (const S*)(data + header->offsets[1]);
+    const S* vx = (const S*)(data + header->offsets[2]);
+    const S* vy = (const S*)(data + header->offsets[3]);
+    const S* r = (const S*)(data + header->offsets[4]);
+    const S* m = (const S*)(data + header->offsets[5]);
+    const S* invM = (const S*)(data + header->offsets[6]);
+    for (uint64_t i = 0; i < header->ballCount; i++) {
+        if (!std::isfinite(x[i]) || !std::isfinite(y[i]) || !std::isfinite(vx[i]) || !std::isfinite(vy[i])) {
+            return "a position or velocity is not finite";
+        }
+        if (!(r[i] >= S(header->minRadius) && r[i] <= S(header->maxRadius))) return "a radius is outside the radius range";
+        if (!(m[i] > 0) || !std::isfinite(m[i]) || invM[i] != S(1) / m[i]) return "a mass is not positive or its inverse does not match";
+    }
+    return nullptr;
+}
+
+// Validate a snapshot image and return its header, or nullptr with the reason
+// in *problem. Besides the layout this checks the world and radius range, the
+// ball values (checkSnapshotBalls) and that the ball ids are 1..n, each once:
+// recordings and the stream index their output arrays by id.
+inline const SnapshotHeader* checkSnapshot(const char* data, size_t size, const char** problem = nullptr) {
+    auto fail = [&](const char* why) -> const SnapshotHeader* {
+        if (problem) *problem = why;
+        return nullptr;
+    };
+    if (size < sizeof(SnapshotHeader)) return fail("too short");
+    const SnapshotHeader* header = (const SnapshotHeader*)data;
+    if (memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0) return fail("not a snapshot");
+    if (header->version != SNAPSHOT_VERSION) return fail("unknown version");
+    if (header->scalarSize != 4 && header->scalarSize != 8) return fail("unknown scalar size");
+    if (header->ballCount == 0 || header->ballCount > (uint64_t)MAX_BALLS) return fail("bad ball count");
+    if (header->width <= 0 || header->height <= 0 ||
+        header->width > SNAPSHOT_MAX_WORLD || header->height > SNAPSHOT_MAX_WORLD) return fail("bad world size");
+    if (!std::isfinite(header->minRadius) || !std::isfinite(header->maxRadius) || !(header->minRadius > 0) ||
+        header->minRadius > header->maxRadius ||
+        2 * header->maxRadius >= std::min(header->width, header->height)) return fail("bad radius range for the world");
+    if (header->stepCount < 0 || header->collisionCount < 0) return fail("negative step or collision count");
+    
+    for (int a = 0; a < SnapshotHeader::ARRAYS; a++) {
+        uint64_t element = a < SnapshotHeader::ARRAYS - 1 ? header->scalarSize : sizeof(BallInfo);
+        if (header->offsets[a] % 64 != 0 || header->offsets[a] > size ||
+            header->ballCount * element > size - header->offsets[a]) return fail("arrays outside the file");
+    }
+    
+    const char* balls = header->scalarSize == 4 ? checkSnapshotBalls<float>(data, header)
+                                                : checkSnapshotBalls<double>(data, header);
+    if (balls) return fail(balls);
+    
+    const BallInfo* info = (const BallInfo*)(data + header->offsets[SnapshotHeader::ARRAYS - 1]);
+    std::vector<bool> seen(header->ballCount, false);
+    for (uint64_t i = 0; i < header->ballCount; i++) {
+        int id = info[i].id;
+        if (id < 1 || (uint64_t)id > header->ballCount || seen[id - 1]) return fail("ball ids are not 1..n");
+        seen[id - 1] = true;
+    }
+    return header;
+}
+
+// Copy one snapshot array into a store array, converting precision if needed
+template <typename T>
+void readSnapshotArray(std::vector<T>& out, const char* source, size_t count, uint32_t scalarSize) {
+    out.resize(count);
+    if (scalarSize == sizeof(T)) {
+        memcpy(out.data(), source, count * sizeof(T));
+    } else if (scalarSize == sizeof(float)) {
+        const float* values = (const float*)source;
+        for (size_t i = 0; i < count; i++) out[i] = T(values[i]);
+    } else {
+        const double* values = (const double*)source;
+        for (size_t i = 0; i < count; i++) out[i] = T(values[i]);
+    }
+}
+
+// Trajectory file layout:
+//   TrajectoryHeader, then the per-ball radius (float) and colour arrays
+//   chunks: TrajectoryChunk header + encoded frames
+//   index: one TrajectoryChunk copy per chunk, with its file offset
+//   TrajectoryFooter
+// Balls are stored in id order (ball id - 1), independent of the storage
+// order of the simulation that recorded them.
+// A frame stores its step number and x, y, vx, vy of every ball, quantized to
+// integer multiples of positionQuantum / velocityQuantum. The first frame of a
+// chunk holds the values themselves, later frames the difference to the frame
+// before, zigzag and varint coded; balls move a few pixels per step and most
+// velocities do not change at all, so a ball costs about 6 bytes per frame.
+// Every chunk decodes on its own, so playback can start at any chunk.
+struct TrajectoryHeader {
+    char magic[8];              // "NEONTRAJ"
+    uint32_t version;
+    uint32_t chunkFrames;       // Frames per chunk (the last one may be shorter)
+    uint64_t ballCount;
+    int32_t width;
+    int32_t height;
+    double positionQuantum;     // Pixels per unit
+    double velocityQuantum;     // Pixels per second per unit
+};
+
+struct TrajectoryChunk {
+    uint64_t offset;            // File offset of the encoded frames
+    uint64_t byteCount;
+    uint64_t firstFrame;        // Ordinal of the chunk's first frame in the file
+    int64_t firstStep;          // Simulation step of that frame
+    uint32_t frameCount;
+    uint32_t reserved;
+};
+
+struct TrajectoryFooter {
+    uint64_t indexOffset;
+    uint64_t chunkCount;
+    uint64_t frameCount;
+    char magic[8];              // "NEONTRAJ", also marks a complete file
+};
+
+static const char TRAJECTORY_MAGIC[8] = {'N', 'E', 'O', 'N', 'T', 'R', 'A', 'J'};
+static const uint32_t TRAJECTORY_VERSION = 1;
+
+inline void putVarint(std::vector<uint8_t>& out, int64_t value) {
+    uint64_t zigzag = ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+    while (zigzag >= 0x80) {
+        out.push_back((uint8_t)(zigzag | 0x80));
+        zigzag >>= 7;
+    }
+    out.push_back((uint8_t)zigzag);
+}
+
+inline int64_t getVarint(const uint8_t*& in) {
+    uint64_t zigzag = 0;
+    int shift = 0;
+    uint8_t byte;
+    do {
+        byte = *in++;
+        zigzag |= (uint64_t)(byte & 0x7F) << shift;
+        shift += 7;
+    } while (byte & 0x80);
+    return (int64_t)(zigzag >> 1) ^ -(int64_t)(zigzag & 1);
+}
+
+// getVarint for untrusted input (files, the network): false instead of
+// reading past end
+inline bool getVarint(const uint8_t*& in, const uint8_t* end, int64_t& value) {
+    uint64_t zigzag = 0;
+    for (int shift = 0; shift < 64 && in < end; shift += 7) {
+        uint8_t byte = *in++;
+        zigzag |= (uint64_t)(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) {
+            value = (int64_t)(zigzag >> 1) ^ -(int64_t)(zigzag & 1);
+            return true;
+        }
+    }
+    return false;
+}
+
+// Records every step into a trajectory file without ever blocking the
+// physics thread on disk. record() copies the ball arrays into whichever of
+// two frame buffers the I/O thread is not using and hands it over; the I/O
+// thread quantizes, encodes and writes it. If the I/O thread falls so far
+// behind that both buffers are taken, the step is dropped (and counted)
+// rather than waiting; the frame's step number shows the gap. A lossless
+// recorder (headless runs) waits for the I/O thread instead, so every step
+// is written at the cost of running no faster than the encoder.
+template <typename T>
+class TrajectoryRecorder {
+private:
+    struct Frame {
+        long long step;
+        std::vector<T> x, y, vx, vy;
+    };
+    
+    FILE* file;
+    TrajectoryHeader header;
+    Frame frames[2];
+    int pending;                // Buffer handed over but not yet taken, or -1
+    int processing;             // Buffer the I/O thread is encoding, or -1
+    bool stopping;
+    bool lossless;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable taken;      // The pending buffer was picked up
+    std::thread thread;
+    
+    // Physics thread only
+    long long dropped;
+    
+    // I/O thread only
+    std::vector<int64_t> previous;
+    std::vector<uint8_t> chunk;
+    std::vector<TrajectoryChunk> index;
+    TrajectoryChunk current;
+    long long lastStep;
+    uint64_t frameCount;
+    uint64_t bytesWritten;
+    bool failed;
+    
+    void writeBytes(const void* data, size_t size) {
+        if (!failed && fwrite(data, 1, size, file) != size) failed = true;
+        bytesWritten += size;
+    }
+    
+    void flushChunk() {
+        if (current.frameCount == 0) return;
+        current.offset = bytesWritten;
+        current.byteCount = chunk.size();
+        writeBytes(chunk.data(), chunk.size());
+        index.push_back(current);
+        chunk.clear();
+        current.firstFrame += current.frameCount;
+        current.frameCount = 0;
+    }
+    
+    void encode(const Frame& frame) {
+        const size_t n = header.ballCount;
+        const bool key = current.frameCount == 0;
+        if (key) {
+            current.firstStep = frame.step;
+            std::fill(previous.begin(), previous.end(), 0);
+        }
+        putVarint(chunk, key ? frame.step : frame.step - lastStep);
+        lastStep = frame.step;
+        
+        const double toPosition = 1.0 / header.positionQuantum;
+        const double toVelocity = 1.0 / header.velocityQuantum;
+        const std::vector<T>* arrays[] = {&frame.x, &frame.y, &frame.vx, &frame.vy};
+        for (size_t i = 0; i < n; i++) {
+            for (int a = 0; a < 4; a++) {
+                int64_t q = std::llround((*arrays[a])[i] * (a < 2 ? toPosition : toVelocity));
+                putVarint(chunk, q - previous[4 * i + a]);
+                previous[4 * i + a] = q;
+            }
+        }
+        
+        frameCount++;
+        if (++current.frameCount == header.chunkFrames) flushChunk();
+    }
+    
+    void run() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            wake.wait(lock, [&] { return pending >= 0 || stopping; });
+            if (pending < 0) break;
+            processing = pending;
+            pending = -1;
+            taken.notify_one();
+            lock.unlock();
+            encode(frames[processing]);
+            lock.lock();
+            processing = -1;
+        }
+    }
+    
+public:
+    TrajectoryRecorder() : file(nullptr), pending(-1), processing(-1), stopping(false), lossless(false),
+                           dropped(0), lastStep(0), frameCount(0), bytesWritten(0), failed(false) {}
+    
+    ~TrajectoryRecorder() {
+        close();
+    }
+    
+    TrajectoryRecorder(const TrajectoryRecorder&) = delete;
+    TrajectoryRecorder& operator=(const TrajectoryRecorder&) = delete;
+    
+    // Start a recording of balls (radii and colours are stored once). The
+    // quanta trade size for precision; the defaults keep 1/256 px.
+    bool open(const std::string& path, const BallStore<T>& balls, int width, int height,
+              double positionQuantum = 1.0 / 256, double velocityQuantum = 1.0 / 256,
+              uint32_t chunkFrames = 64) {
+        close();
+        file = fopen(path.c_str(), "wb");
+        if (!file) return false;
+        
+        const size_t n = balls.size();
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, TRAJECTORY_MAGIC, sizeof(TRAJECTORY_MAGIC));
+        header.version = TRAJECTORY_VERSION;
+        header.chunkFrames = std::max(1u, chunkFrames);
+        header.ballCount = n;
+        header.width = width;
+        header.height = height;
+        header.positionQuantum = positionQuantum;
+        header.velocityQuantum = velocityQuantum;
+        
+        failed = false;
+        bytesWritten = 0;
+        writeBytes(&header, sizeof(header));
+        std::vector<float> radii(n);
+        std::vector<SDL_Color> colours(n);
+        for (size_t i = 0; i < n; i++) {
+            radii[balls.info[i].id - 1] = (float)balls.r[i];
+            colours[balls.info[i].id - 1] = balls.info[i].color;
+        }
+        writeBytes(radii.data(), n * sizeof(float));
+        writeBytes(colours.data(), n * sizeof(SDL_Color));
+        
+        for (Frame& frame : frames) {
+            frame.x.resize(n); frame.y.resize(n);
+            frame.vx.resize(n); frame.vy.resize(n);
+        }
+        previous.assign(4 * n, 0);
+        chunk.clear();
+        index.clear();
+        memset(&current, 0, sizeof(current));
+        frameCount = 0;
+        dropped = 0;
+        pending = processing = -1;
+        stopping = false;
+        thread = std::thread(&TrajectoryRecorder::run, this);
+        return true;
+    }
+    
+    bool isOpen() const {
+        return file != nullptr;
+    }
+    
+    // Wait for the I/O thread rather than drop a step when both buffers are
+    // taken; off by default, so a window never stalls on the disk
+    void setLossless(bool enabled) {
+        lossless = enabled;
+    }
+    
+    // Physics thread: queue the state after `step`. Only waits for the disk
+    // when lossless.
+    void record(const BallStore<T>& balls, long long step) {
+        if (!file || balls.size() != header.ballCount) return;
+        
+        int target;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            if (pending >= 0) {
+                if (!lossless) {
+                    dropped++;
+                    return;
+                }
+                taken.wait(lock, [&] { return pending < 0; });
+            }
+            target = processing == 0 ? 1 : 0;
+        }
+        
+        // The I/O thread never touches a buffer that is neither pending nor
+        // being processed, so the copy needs no lock. Frames are in id order,
+        // whatever order the simulation keeps its storage in.
+        Frame& frame = frames[target];
+        frame.step = step;
+        for (size_t i = 0; i < balls.size(); i++) {
+            size_t slot = balls.info[i].id - 1;
+            frame.x[slot] = balls.x[i];
+            frame.y[slot] = balls.y[i];
+            frame.vx[slot] = balls.vx[i];
+            frame.vy[slot] = balls.vy[i];
+        }
+        
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            pending = target;
+        }
+        wake.notify_one();
+    }
+    
+    // Finish the queued frames, write the index and close the file
+    void close() {
+        if (!file) return;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_one();
+        thread.join();
+        
+        flushChunk();
+        TrajectoryFooter footer;
+        memset(&footer, 0, sizeof(footer));
+        footer.indexOffset = bytesWritten;
+        footer.chunkCount = index.size();
+        footer.frameCount = frameCount;
+        memcpy(footer.magic, TRAJECTORY_MAGIC, sizeof(TRAJECTORY_MAGIC));
+        writeBytes(index.data(), index.size() * sizeof(TrajectoryChunk));
+        writeBytes(&footer, sizeof(footer));
+        if (fclose(file) != 0) failed = true;
+        file = nullptr;
+        
+        double raw = (double)frameCount * header.ballCount * 4 * sizeof(T);
+        std::cout << (failed ? "❌ Trajectory write failed: " : "🎞️  Trajectory: ") << frameCount
+                  << " frames, " << dropped << " dropped, " << bytesWritten / 1e6 << " MB ("
+                  << (bytesWritten > 0 ? raw / bytesWritten : 0) << "x smaller than raw)" << std::endl;
+    }
+};
+
+// Random-access reader for trajectory files, working on a mapped file. The
+// index and footer sit at whatever offset the frames end at, so they are
+// copied out rather than read in place.
+class TrajectoryReader {
+private:
+    MappedFile file;
+    const TrajectoryHeader* header;
+    std::vector<TrajectoryChunk> chunks;
+    TrajectoryFooter footer;
+    
+public:
+    TrajectoryReader() : header(nullptr) {
+        memset(&footer, 0, sizeof(footer));
+    }
+    
+    // Map and validate a trajectory: the header, the radius and colour arrays,
+    // the chunks back to back and the index have to fill the file exactly, and
+    // the frame ordinals have to run on from chunk to chunk. The frame data
+    // itself is checked as it is decoded.
+    bool open(const std::string& path) {
+        header = nullptr;
+        chunks.clear();
+        memset(&footer, 0, sizeof(footer));
+        if (!file.open(path)) return false;
+        const char* data = file.data();
+        const size_t size = file.size();
+        if (size < sizeof(TrajectoryHeader) + sizeof(TrajectoryFooter)) return false;
+        
+        const TrajectoryHeader* h = (const TrajectoryHeader*)data;
+        TrajectoryFooter f;
+        memcpy(&f, data + size - sizeof(TrajectoryFooter), sizeof(TrajectoryFooter));
+        if (memcmp(h->magic, TRAJECTORY_MAGIC, 8) != 0 || h->version != TRAJECTORY_VERSION) return false;
+        if (memcmp(f.magic, TRAJECTORY_MAGIC, 8) != 0) return false;    // Recording never closed
+        if (h->ballCount == 0 || h->ballCount > (uint64_t)INT32_MAX || h->chunkFrames == 0) return false;
+        if (!(h->positionQuantum > 0) || !(h->velocityQuantum > 0)) return false;
+        
+        const uint64_t framesBegin = sizeof(TrajectoryHeader) + h->ballCount * (sizeof(float) + sizeof(SDL_Color));
+        const uint64_t indexEnd = size - sizeof(TrajectoryFooter);
+        if (f.indexOffset < framesBegin || f.indexOffset > indexEnd ||
+            f.chunkCount != (indexEnd - f.indexOffset) / sizeof(TrajectoryChunk) ||
+            (indexEnd - f.indexOffset) % sizeof(TrajectoryChunk) != 0) return false;
+        
+        std::vector<TrajectoryChunk> c(f.chunkCount);
+        if (f.chunkCount > 0) memcpy(c.data(), data + f.indexOffset, f.chunkCount * sizeof(TrajectoryChunk));
+        uint64_t frames = 0;
+        uint64_t offset = framesBegin;
+        for (uint64_t k = 0; k < f.chunkCount; k++) {
+            if (c[k].offset != offset || c[k].byteCount > f.indexOffset - offset ||
+                c[k].frameCount == 0 || c[k].frameCount > h->chunkFrames || c[k].firstFrame != frames) return false;
+            offset += c[k].byteCount;
+            frames += c[k].frameCount;
+        }
+        if (offset != f.indexOffset || frames != f.frameCount) return false;
+        
+        header = h;
+        footer = f;
+        chunks.swap(c);
+        return true;
+    }
+    
+    uint64_t frameCount() const { return header ? footer.frameCount : 0; }
+    uint64_t chunkCount() const { return header ? footer.chunkCount : 0; }
+    uint64_t ballCount() const { return header ? header->ballCount : 0; }
+    size_t fileSize() const { return file.size(); }
+    
+    const float* radii() const {
+        return (const float*)(file.data() + sizeof(TrajectoryHeader));
+    }
+    
+    const SDL_Color* colours() const {
+        return (const SDL_Color*)(radii() + header->ballCount);
+    }
+    
+    // Decode frame `frame` (0-based ordinal): find its chunk in the index and
+    // run the deltas forward from that chunk's first frame. False if there is
+    // no such frame or the chunk's data is cut short.
+    bool readFrame(uint64_t frame, long long& step, std::vector<double>& x, std::vector<double>& y,
+                   std::vector<double>& vx, std::vector<double>& vy) const {
+        if (!header || frame >= footer.frameCount) return false;
+        const TrajectoryChunk* chunk = std::upper_bound(chunks.data(), chunks.data() + chunks.size(), frame,
+            [](uint64_t value, const TrajectoryChunk& c) { return value < c.firstFrame; }) - 1;
+        
+        const size_t n = header->ballCount;
+        std::vector<int64_t> values(4 * n, 0);
+        const uint8_t* in = (const uint8_t*)file.data() + chunk->offset;
+        const uint8_t* chunkEnd = in + chunk->byteCount;
+        step = 0;
+        for (uint64_t f = chunk->firstFrame; f <= frame; f++) {
+            int64_t delta;
+            if (!getVarint(in, chunkEnd, delta)) return false;
+            step += delta;
+            for (size_t k = 0; k < 4 * n; k++) {
+                if (!getVarint(in, chunkEnd, delta)) return false;
+                values[k] += delta;
+            }
+        }
+        
+        x.resize(n); y.resize(n); vx.resize(n); vy.resize(n);
+        for (size_t i = 0; i < n; i++) {
+            x[i] = values[4 * i] * header->positionQuantum;
+            y[i] = values[4 * i + 1] * header->positionQuantum;
+            vx[i] = values[4 * i + 2] * header->velocityQuantum;
+            vy[i] = values[4 * i + 3] * header->velocityQuantum;
+        }
+        return true;
+    }
+};
+
+// Non-blocking TCP sockets for the state stream: Winsock on Windows, BSD
+// sockets elsewhere
+#ifdef _WIN32
+typedef SOCKET SocketHandle;
+static const SocketHandle NO_SOCKET = INVALID_SOCKET;
+#else
+typedef int SocketHandle;
+static const SocketHandle NO_SOCKET = -1;
+#endif
+
+// Winsock has to be started once per process before the first socket
+inline bool startSockets() {
+#ifdef _WIN32
+    static const bool started = [] {
+        WSADATA data;
+        return WSAStartup(MAKEWORD(2, 2), &data) == 0;
+    }();
+    return started;
+#else
+    return true;
+#endif
+}
+
+inline void closeSocket(SocketHandle socket) {
+#ifdef _WIN32
+    closesocket(socket);
+#else
+    close(socket);
+#endif
+}
+
+// Non-blocking, no Nagle delay, and (where send() has no MSG_NOSIGNAL) no
+// SIGPIPE when the peer has gone away
+inline bool prepareSocket(SocketHandle socket) {
+    int on = 1;
+    setsockopt(socket, IPPROTO_TCP, TCP_NODELAY, (const char*)&on, sizeof(on));
+#ifdef SO_NOSIGPIPE
+    setsockopt(socket, SOL_SOCKET, SO_NOSIGPIPE, (const char*)&on, sizeof(on));
+#endif
+#ifdef _WIN32
+    u_long nonBlocking = 1;
+    return ioctlsocket(socket, FIONBIO, &nonBlocking) == 0;
+#else
+    int flags = fcntl(socket, F_GETFL, 0);
+    return flags >= 0 && fcntl(socket, F_SETFL, flags | O_NONBLOCK) == 0;
+#endif
+}
+
+inline bool socketWouldBlock() {
+#ifdef _WIN32
+    return WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+    return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+#endif
+}
+
+// Bytes sent, 0 if the socket buffer is full, -1 if the connection is gone
+inline long sendSome(SocketHandle socket, const uint8_t* data, size_t size) {
+#ifdef _WIN32
+    int sent = send(socket, (const char*)data, (int)std::min(size, (size_t)INT_MAX), 0);
+#elif defined(MSG_NOSIGNAL)
+    ssize_t sent = send(socket, data, size, MSG_NOSIGNAL);
+#else
+    ssize_t sent = send(socket, data, size, 0);
+#endif
+    if (sent < 0) return socketWouldBlock() ? 0 : -1;
+    return (long)sent;
+}
+
+// Bytes received, 0 if there is nothing yet, -1 if the connection is closed
+inline long receiveSome(SocketHandle socket, uint8_t* data, size_t size) {
+#ifdef _WIN32
+    int received = recv(socket, (char*)data, (int)std::min(size, (size_t)INT_MAX), 0);
+#else
+    ssize_t received = recv(socket, data, size, 0);
+#endif
+    if (received == 0) return -1;
+    if (received < 0) return socketWouldBlock() ? 0 : -1;
+    return (long)received;
+}
+
+// Wait up to seconds for socket to become readable (or writable)
+inline bool waitForSocket(SocketHandle socket, double seconds, bool forWriting = false) {
+    fd_set set;
+    FD_ZERO(&set);
+    FD_SET(socket, &set);
+    timeval timeout = {(long)seconds, (long)((seconds - (long)seconds) * 1e6)};
+    return select((int)socket + 1, forWriting ? nullptr : &set, forWriting ? &set : nullptr,
+                  nullptr, &timeout) > 0;
+}
+
+// SHA-1, only for the WebSocket handshake
+inline void sha1(const uint8_t* data, size_t size, uint8_t digest[20]) {
+    uint32_t h[5] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0};
+    std::vector<uint8_t> message(data, data + size);
+    message.push_back(0x80);
+    while (message.size() % 64 != 56) message.push_back(0);
+    const uint64_t bits = (uint64_t)size * 8;
+    for (int i = 7; i >= 0; i--) message.push_back((uint8_t)(bits >> (8 * i)));
+    
+    auto rotate = [](uint32_t v, int s) { return (v << s) | (v >> (32 - s)); };
+    for (size_t block = 0; block < message.size(); block += 64) {
+        uint32_t w[80];
+        for (int t = 0; t < 16; t++) {
+            const uint8_t* b = &message[block + 4 * t];
+            w[t] = (uint32_t)b[0] << 24 | (uint32_t)b[1] << 16 | (uint32_t)b[2] << 8 | b[3];
+        }
+        for (int t = 16; t < 80; t++) w[t] = rotate(w[t - 3] ^ w[t - 8] ^ w[t - 14] ^ w[t - 16], 1);
+        
+        uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+        for (int t = 0; t < 80; t++) {
+            uint32_t f, k;
+            if (t < 20) { f = (b & c) | (~b & d); k = 0x5A827999; }
+            else if (t < 40) { f = b ^ c ^ d; k = 0x6ED9EBA1; }
+            else if (t < 60) { f = (b & c) | (b & d) | (c & d); k = 0x8F1BBCDC; }
+            else { f = b ^ c ^ d; k = 0xCA62C1D6; }
+            uint32_t next = rotate(a, 5) + f + e + k + w[t];
+            e = d;
+            d = c;
+            c = rotate(b, 30);
+            b = a;
+            a = next;
+        }
+        h[0] += a; h[1] += b; h[2] += c; h[3] += d; h[4] += e;
+    }
+    for (int i = 0; i < 20; i++) digest[i] = (uint8_t)(h[i / 4] >> (24 - 8 * (i % 4)));
+}
+
+inline std::string base64(const uint8_t* data, size_t size) {
+    static const char DIGITS[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    std::string out;
+    for (size_t i = 0; i < size; i += 3) {
+        uint32_t group = (uint32_t)data[i] << 16;
+        if (i + 1 < size) group |= (uint32_t)data[i + 1] << 8;
+        if (i + 2 < size) group |= data[i + 2];
+        out += DIGITS[(group >> 18) & 63];
+        out += DIGITS[(group >> 12) & 63];
+        out += i + 1 < size ? DIGITS[(group >> 6) & 63] : '=';
+        out += i + 2 < size ? DIGITS[group & 63] : '=';
+    }
+    return out;
+}
+
+// Sec-WebSocket-Accept for a Sec-WebSocket-Key (RFC 6455)
+inline std::string webSocketAccept(const std::string& key) {
+    const std::string text = key + "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+    uint8_t digest[20];
+    sha1((const uint8_t*)text.data(), text.size(), digest);
+    return base64(digest, sizeof(digest));
+}
+
+// Value of an HTTP header (name in lower case) in a request or response head,
+// or "" when it is missing
+inline std::string httpHeader(const std::string& head, const std::string& name) {
+    std::string lower = head;
+    for (char& c : lower) c = (char)std::tolower((unsigned char)c);
+    size_t at = lower.find("\r\n" + name + ":");
+    if (at == std::string::npos) return "";
+    size_t begin = at + name.size() + 3;
+    size_t end = head.find("\r\n", begin);
+    if (end == std::string::npos) end = head.size();
+    while (begin < end && head[begin] == ' ') begin++;
+    while (end > begin && head[end - 1] == ' ') end--;
+    return head.substr(begin, end - begin);
+}
+
+static const uint8_t WEBSOCKET_BINARY = 0x2;
+static const uint8_t WEBSOCKET_CLOSE = 0x8;
+static const uint8_t WEBSOCKET_PING = 0x9;
+static const uint8_t WEBSOCKET_PONG = 0xA;
+
+// Append a whole (unfragmented) WebSocket message. Clients must mask what
+// they send; the only thing the viewer sends is an empty close.
+inline void appendWebSocketMessage(std::vector<uint8_t>& out, uint8_t opcode, const uint8_t* payload,
+                                   size_t size, bool masked = false) {
+    out.push_back((uint8_t)(0x80 | opcode));
+    const uint8_t maskBit = masked ? 0x80 : 0;
+    if (size < 126) {
+        out.push_back((uint8_t)(maskBit | size));
+    } else if (size < 65536) {
+        out.push_back(maskBit | 126);
+        out.push_back((uint8_t)(size >> 8));
+        out.push_back((uint8_t)size);
+    } else {
+        out.push_back(maskBit | 127);
+        for (int i = 7; i >= 0; i--) out.push_back((uint8_t)((uint64_t)size >> (8 * i)));
+    }
+    if (masked) out.insert(out.end(), 4, 0);    // Zero mask: the payload goes out as is
+    out.insert(out.end(), payload, payload + size);
+}
+
+// Header of the WebSocket message at the start of data. Returns false until
+// the whole message has arrived.
+struct WebSocketMessage {
+    uint8_t opcode;
+    size_t payloadOffset;
+    uint64_t payloadSize;
+    uint8_t mask[4];
+    bool masked;
+};
+
+inline bool parseWebSocketMessage(const uint8_t* data, size_t size, WebSocketMessage& message) {
+    if (size < 2) return false;
+    message.opcode = data[0] & 0x0F;
+    message.masked = (data[1] & 0x80) != 0;
+    uint64_t length = data[1] & 0x7F;
+    size_t offset = 2;
+    if (length >= 126) {
+        const int bytes = length == 126 ? 2 : 8;
+        if (size < offset + bytes) return false;
+        length = 0;
+        for (int i = 0; i < bytes; i++) length = (length << 8) | data[offset + i];
+        offset += bytes;
+    }
+    if (message.masked) {
+        if (size < offset + 4) return false;
+        memcpy(message.mask, data + offset, 4);
+        offset += 4;
+    }
+    message.payloadOffset = offset;
+    message.payloadSize = length;
+    return length <= size - offset;
+}
+
+// State stream protocol: a WebSocket connection carrying binary messages
+// from a StateStreamer (--stream) to its viewers (--connect). Every message
+// starts with its type byte.
+//   STREAM_SCENE: StreamSceneHeader, then the radius (float) and NEON_COLORS
+//     index (uint8) of every ball in id order. Sent before the first frame
+//     and again whenever the balls change (reset, snapshot load).
+//   STREAM_FRAME: varint step, then x and y of every ball in id order,
+//     quantized to positionQuantum, as zigzag varint differences to the last
+//     frame that viewer received; the first frame after a scene is relative
+//     to 0. A ball that moves a few pixels costs 2 - 3 bytes.
+// A viewer is only sent its next frame once the last one has left the
+// socket, so a slow link gets fewer frames instead of a growing backlog.
+struct StreamSceneHeader {
+    char magic[8];              // "NEONSTRM"
+    uint32_t version;
+    uint32_t ballCount;
+    int32_t width;
+    int32_t height;
+    double positionQuantum;     // Pixels per unit
+};
+
+static const char STREAM_MAGIC[8] = {'N', 'E', 'O', 'N', 'S', 'T', 'R', 'M'};
+static const uint32_t STREAM_VERSION = 1;
+static const uint8_t STREAM_SCENE = 1;
+static const uint8_t STREAM_FRAME = 2;
+
+// Which NEON_COLORS entry a ball has; colours from elsewhere become entry 0
+inline uint8_t paletteIndex(SDL_Color color) {
+    for (int c = 0; c < NEON_COLOR_COUNT; c++) {
+        if (NEON_COLORS[c].r == color.r && NEON_COLORS[c].g == color.g && NEON_COLORS[c].b == color.b) return (uint8_t)c;
+    }
+    return 0;
+}
+
+// Serves the simulation state to remote viewers without ever blocking the
+// physics thread on the network. The I/O thread asks for a frame (wantsFrame)
+// when some viewer is ready for one; publish() then copies the positions into
+// whichever of two buffers the I/O thread is not using, like
+// TrajectoryRecorder::record. Quantizing, encoding and sending all happen on
+// the I/O thread, and with no viewer ready a step costs one atomic load.
+template <typename T>
+class StateStreamer {
+private:
+    struct Frame {
+        long long step;
+        int width, height;
+        std::vector<T> x, y, r;
+        std::vector<SDL_Color> colors;
+    };
+    
+    struct Viewer {
+        SocketHandle socket;
+        std::string address;
+        bool open;                      // Handshake done
+        bool closing;
+        std::string request;            // Handshake bytes so far
+        std::vector<uint8_t> inbox;     // Messages from the viewer, possibly partial
+        std::vector<uint8_t> out;       // Queued bytes; out[0, outSent) are already sent
+        size_t outSent;
+        uint64_t scene;                 // Scene the viewer has, 0 = none yet
+        uint64_t frame;                 // Last frame it was sent
+        std::vector<int64_t> sentX, sentY;  // Its quantized positions, the base of the next deltas
+        std::chrono::steady_clock::time_point connected, lastFrame;
+        long long frames;
+        uint64_t bytes;
+    };
+    
+    static const size_t SEND_BUFFER = 256 * 1024;   // Kernel buffer per viewer: bounds the lag of a slow link
+    static const size_t MAX_REQUEST = 8192;
+    
+    SocketHandle listener;
+    int port;
+    double frameInterval;       // Seconds between frames to one viewer, at least
+    Frame frames[2];
+    int pending;                // Buffer handed over but not yet taken, or -1
+    int processing;             // Buffer the I/O thread is reading, or -1
+    bool stopping;
+    std::mutex mutex;
+    std::atomic<bool> wanted;
+    std::thread thread;
+    
+    // I/O thread only
+    std::vector<Viewer> viewers;
+    std::vector<T> sceneR;
+    std::vector<SDL_Color> sceneColors;
+    int sceneWidth, sceneHeight;
+    uint64_t sceneSerial;
+    std::vector<uint8_t> sceneMessage;  // Complete WebSocket message
+    std::vector<int64_t> currentX, currentY;
+    long long currentStep;
+    uint64_t frameSerial;
+    std::vector<uint8_t> payload;
+    long long viewersServed;
+    long long framesSent;
+    uint64_t bytesSent;
+    
+    static constexpr double QUANTUM = 1.0 / 16;
+    
+    // A new frame from the physics thread: rebuild the scene message if the
+    // balls are not the ones the viewers have, then quantize the positions
+    void take(const Frame& frame) {
+        const size_t n = frame.x.size();
+        bool sameScene = n == sceneR.size() && n > 0 && frame.width == sceneWidth && frame.height == sceneHeight &&
+                         std::equal(frame.r.begin(), frame.r.end(), sceneR.begin()) &&
+                         memcmp(frame.colors.data(), sceneColors.data(), n * sizeof(SDL_Color)) == 0;
+        if (!sameScene) {
+            sceneR = frame.r;
+            sceneColors = frame.colors;
+            sceneWidth = frame.width;
+            sceneHeight = frame.height;
+            sceneSerial++;
+            
+            StreamSceneHeader header;
+            memset(&header, 0, sizeof(header));
+            memcpy(header.magic, STREAM_MAGIC, sizeof(STREAM_MAGIC));
+            header.version = STREAM_VERSION;
+            header.ballCount = (uint32_t)n;
+            header.width = sceneWidth;
+            header.height = sceneHeight;
+            header.positionQuantum = QUANTUM;
+            payload.clear();
+            payload.push_back(STREAM_SCENE);
+            const uint8_t* bytes = (const uint8_t*)&header;
+            payload.insert(payload.end(), bytes, bytes + sizeof(header));
+            for (size_t i = 0; i < n; i++) {
+                float radius = (float)sceneR[i];
+                bytes = (const uint8_t*)&radius;
+                payload.insert(payload.end(), bytes, bytes + sizeof(radius));
+            }
+            for (size_t i = 0; i < n; i++) payload.push_back(paletteIndex(sceneColors[i]));
+            sceneMessage.clear();
+            appendWebSocketMessage(sceneMessage, WEBSOCKET_BINARY, payload.data(), payload.size());
+        }
+        
+        currentX.resize(n);
+        currentY.resize(n);
+        for (size_t i = 0; i < n; i++) {
+            currentX[i] = std::llround(frame.x[i] * (1 / QUANTUM));
+            currentY[i] = std::llround(frame.y[i] * (1 / QUANTUM));
+        }
+        currentStep = frame.step;
+        frameSerial++;
+    }
+    
+    void sendFrame(Viewer& viewer, std::chrono::steady_clock::time_point now) {
+        const size_t n = currentX.size();
+        if (viewer.scene != sceneSerial) {
+            viewer.out.insert(viewer.out.end(), sceneMessage.begin(), sceneMessage.end());
+            viewer.scene = sceneSerial;
+            viewer.sentX.assign(n, 0);
+            viewer.sentY.assign(n, 0);
+        }
+        
+        payload.clear();
+        payload.push_back(STREAM_FRAME);
+        putVarint(payload, currentStep);
+        for (size_t i = 0; i < n; i++) {
+            putVarint(payload, currentX[i] - viewer.sentX[i]);
+            putVarint(payload, currentY[i] - viewer.sentY[i]);
+        }
+        std::copy(currentX.begin(), currentX.end(), viewer.sentX.begin());
+        std::copy(currentY.begin(), currentY.end(), viewer.sentY.begin());
+        appendWebSocketMessage(viewer.out, WEBSOCKET_BINARY, payload.data(), payload.size());
+        
+        viewer.frame = frameSerial;
+        viewer.lastFrame = now;
+        viewer.frames++;
+        framesSent++;
+        flush(viewer);
+    }
+    
+    void flush(Viewer& viewer) {
+        while (viewer.outSent < viewer.out.size()) {
+            long sent = sendSome(viewer.socket, viewer.out.data() + viewer.outSent, viewer.out.size() - viewer.outSent);
+            if (sent < 0) {
+                viewer.closing = true;
+                return;
+            }
+            if (sent == 0) return;
+            viewer.outSent += sent;
+            viewer.bytes += sent;
+            bytesSent += sent;
+        }
+        viewer.out.clear();
+        viewer.outSent = 0;
+    }
+    
+    void acceptViewers() {
+        while (true) {
+            sockaddr_in address;
+            socklen_t length = sizeof(address);
+            SocketHandle socket = accept(listener, (sockaddr*)&address, &length);
+            if (socket == NO_SOCKET) return;
+#ifndef _WIN32
+            // select() cannot watch descriptors beyond FD_SETSIZE
+            if (socket >= FD_SETSIZE) {
+                closeSocket(socket);
+                continue;
+            }
+#endif
+            int buffer = (int)SEND_BUFFER;
+            setsockopt(socket, SOL_SOCKET, SO_SNDBUF, (const char*)&buffer, sizeof(buffer));
+            if (!prepareSocket(socket)) {
+                closeSocket(socket);
+                continue;
+            }
+            
+            char text[INET_ADDRSTRLEN] = "?";
+            inet_ntop(AF_INET, &address.sin_addr, text, sizeof(text));
+            Viewer viewer;
+            viewer.socket = socket;
+            viewer.address = std::string(text) + ":" + std::to_string(ntohs(address.sin_port));
+            viewer.open = false;
+            viewer.closing = false;
+            viewer.outSent = 0;
+            viewer.scene = 0;
+            viewer.frame = 0;
+            viewer.connected = viewer.lastFrame = std::chrono::steady_clock::now();
+            viewer.frames = 0;
+            viewer.bytes = 0;
+            viewers.push_back(std::move(viewer));
+        }
+    }
+    
+    void handshake(Viewer& viewer) {
+        size_t end = viewer.request.find("\r\n\r\n");
+        if (end == std::string::npos) {
+            if (viewer.request.size() > MAX_REQUEST) viewer.closing = true;
+            return;
+        }
+        std::string key = httpHeader(viewer.request.substr(0, end), "sec-websocket-key");
+        if (key.empty()) {
+            const char reply[] = "HTTP/1.1 400 Bad Request\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+            viewer.out.insert(viewer.out.end(), reply, reply + sizeof(reply) - 1);
+            flush(viewer);
+            viewer.closing = true;
+            return;
+        }
+        
+        std::string reply = "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+                            "Sec-WebSocket-Accept: " + webSocketAccept(key) + "\r\n\r\n";
+        viewer.out.insert(viewer.out.end(), reply.begin(), reply.end());
+        viewer.inbox.assign(viewer.request.begin() + end + 4, viewer.request.end());
+        viewer.request.clear();
+        viewer.open = true;
+        std::cout << "📺 Viewer connected: " << viewer.address << std::endl;
+        flush(viewer);
+    }
+    
+    // Viewers only send pings and the close; anything else is ignored
+    void receive(Viewer& viewer) {
+        uint8_t buffer[4096];
+        while (!viewer.closing) {
+            long received = receiveSome(viewer.socket, buffer, sizeof(buffer));
+            if (received < 0) viewer.closing = true;
+            if (received <= 0) break;
+            if (viewer.open) {
+                viewer.inbox.insert(viewer.inbox.end(), buffer, buffer + received);
+            } else {
+                viewer.request.append((const char*)buffer, received);
+                handshake(viewer);
+            }
+        }
+        
+        size_t used = 0;
+        WebSocketMessage message;
+        while (viewer.open && !viewer.closing &&
+               parseWebSocketMessage(viewer.inbox.data() + used, viewer.inbox.size() - used, message)) {
+            uint8_t* body = viewer.inbox.data() + used + message.payloadOffset;
+            if (message.opcode == WEBSOCKET_CLOSE) {
+                viewer.closing = true;
+            } else if (message.opcode == WEBSOCKET_PING) {
+                if (message.masked) {
+                    for (uint64_t k = 0; k < message.payloadSize; k++) body[k] ^= message.mask[k % 4];
+                }
+                appendWebSocketMessage(viewer.out, WEBSOCKET_PONG, body, (size_t)message.payloadSize);
+                flush(viewer);
+            }
+            used += message.payloadOffset + (size_t)message.payloadSize;
+        }
+        viewer.inbox.erase(viewer.inbox.begin(), viewer.inbox.begin() + used);
+        if (viewer.inbox.size() > MAX_REQUEST) viewer.closing = true;
+    }
+    
+    void drop(Viewer& viewer) {
+        closeSocket(viewer.socket);
+        if (!viewer.open) return;
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - viewer.connected).count();
+        std::cout << "📺 Viewer left: " << viewer.address << ", " << viewer.frames << " frames ("
+                  << (seconds > 0 ? viewer.frames / seconds : 0) << " fps), " << viewer.bytes / 1e6 << " MB" << std::endl;
+        viewersServed++;
+    }
+    
+    void run() {
+        while (true) {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (stopping) break;
+                if (pending >= 0) {
+                    processing = pending;
+                    pending = -1;
+                }
+            }
+            if (processing >= 0) {
+                take(frames[processing]);
+                std::lock_guard<std::mutex> lock(mutex);
+                processing = -1;
+            }
+            
+            // Viewers whose last frame has left the socket and is old enough
+            // get the newest frame; if they already have it, ask for another
+            const auto now = std::chrono::steady_clock::now();
+            bool anyWaiting = false;
+            double untilDue = 0.01;
+            for (Viewer& viewer : viewers) {
+                if (!viewer.open || viewer.closing || viewer.outSent < viewer.out.size()) continue;
+                double due = frameInterval - std::chrono::duration<double>(now - viewer.lastFrame).count();
+                if (due > 0) {
+                    untilDue = std::min(untilDue, due);
+                } else if (viewer.frame < frameSerial) {
+                    sendFrame(viewer, now);
+                } else {
+                    anyWaiting = true;
+                }
+            }
+            wanted.store(anyWaiting, std::memory_order_relaxed);
+            
+            fd_set readable, writable;
+            FD_ZERO(&readable);
+            FD_ZERO(&writable);
+            FD_SET(listener, &readable);
+            SocketHandle highest = listener;
+            for (const Viewer& viewer : viewers) {
+                FD_SET(viewer.socket, &readable);
+                if (viewer.outSent < viewer.out.size()) FD_SET(viewer.socket, &writable);
+                highest = std::max(highest, viewer.socket);
+            }
+            
+            // Short while a frame is on its way from the physics thread
+            double wait = anyWaiting ? 0.002 : untilDue;
+            timeval timeout = {0, (long)(wait * 1e6)};
+            if (select((int)highest + 1, &readable, &writable, nullptr, &timeout) > 0) {
+                if (FD_ISSET(listener, &readable) && (int)viewers.size() + 1 < FD_SETSIZE) acceptViewers();
+                for (Viewer& viewer : viewers) {
+                    if (FD_ISSET(viewer.socket, &readable)) receive(viewer);
+                    if (FD_ISSET(viewer.socket, &writable)) flush(viewer);
+                }
+            }
+            
+            for (size_t v = 0; v < viewers.size();) {
+                if (viewers[v].closing) {
+                    drop(viewers[v]);
+                    viewers.erase(viewers.begin() + v);
+                } else {
+                    v++;
+                }
+            }
+        }
+        
+        for (Viewer& viewer : viewers) drop(viewer);
+        viewers.clear();
+    }
+
+public:
+    StateStreamer() : listener(NO_SOCKET), port(0), frameInterval(0), pending(-1), processing(-1),
+                      stopping(false), wanted(false), sceneWidth(0), sceneHeight(0), sceneSerial(0),
+                      currentStep(0), frameSerial(0), viewersServed(0), framesSent(0), bytesSent(0) {}
+    
+    ~StateStreamer() {
+        close();
+    }
+    
+    StateStreamer(const StateStreamer&) = delete;
+    StateStreamer& operator=(const StateStreamer&) = delete;
+    
+    // Listen on TCP port (all interfaces) and send every viewer at most
+    // framesPerSecond frames
+    bool open(int listenPort, double framesPerSecond) {
+        close();
+        if (!startSockets()) return false;
+        listener = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+        if (listener == NO_SOCKET) return false;
+        
+        int on = 1;
+        setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, (const char*)&on, sizeof(on));
+        sockaddr_in address;
+        memset(&address, 0, sizeof(address));
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_ANY);
+        address.sin_port = htons((uint16_t)listenPort);
+        if (bind(listener, (const sockaddr*)&address, sizeof(address)) != 0 || listen(listener, 8) != 0 ||
+            !prepareSocket(listener)) {
+            closeSocket(listener);
+            listener = NO_SOCKET;
+            return false;
+        }
+        
+        port = listenPort;
+        frameInterval = framesPerSecond > 0 ? 1 / framesPerSecond : 0;
+        pending = processing = -1;
+        stopping = false;
+        wanted = false;
+        sceneR.clear();
+        sceneSerial = 0;
+        frameSerial = 0;
+        viewersServed = framesSent = 0;
+        bytesSent = 0;
+        thread = std::thread(&StateStreamer::run, this);
+        std::cout << "📡 Streaming on port " << port << " (ws://<this host>:" << port << "/, at most "
+                  << framesPerSecond << " frames/s per viewer)" << std::endl;
+        return true;
+    }
+    
+    bool isOpen() const {
+        return listener != NO_SOCKET;
+    }
+    
+    // Physics thread: whether a viewer is waiting for a frame. Cheap enough
+    // to ask after every step.
+    bool wantsFrame() const {
+        return wanted.load(std::memory_order_relaxed);
+    }
+    
+    // Physics thread: hand over the state after `step`. Never waits for the
+    // network; if the last frame has not been taken yet, this one is skipped.
+    void publish(const BallStore<T>& balls, long long step, int width, int height) {
+        int target;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (listener == NO_SOCKET || pending >= 0) return;
+            target = processing == 0 ? 1 : 0;
+        }
+        wanted.store(false, std::memory_order_relaxed);
+        
+        // As in TrajectoryRecorder::record, the free buffer needs no lock
+        Frame& frame = frames[target];
+        const size_t n = balls.size();
+        frame.step = step;
+        frame.width = width;
+        frame.height = height;
+        frame.x.resize(n);
+        frame.y.resize(n);
+        frame.r.resize(n);
+        frame.colors.resize(n);
+        for (size_t i = 0; i < n; i++) {
+            size_t slot = balls.info[i].id - 1;
+            frame.x[slot] = balls.x[i];
+            frame.y[slot] = balls.y[i];
+            frame.r[slot] = balls.r[i];
+            frame.colors[slot] = balls.info[i].color;
+        }
+        
+        std::lock_guard<std::mutex> lock(mutex);
+        pending = target;
+    }
+    
+    // Disconnect every viewer and stop listening
+    void close() {
+        if (listener == NO_SOCKET) return;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        thread.join();
+        closeSocket(listener);
+        listener = NO_SOCKET;
+        std::cout << "📡 Stream: " << viewersServed << " viewers, " << framesSent << " frames, "
+                  << bytesSent / 1e6 << " MB sent" << std::endl;
+    }
+};
+
+// Client side of the state stream. connect() does the handshake and waits
+// for the first scene; after that a thread decodes every frame into a
+// RenderState, handed to the window through a triple buffer exactly like a
+// local simulation's states, so the same FrameRenderer draws them.
+class StreamViewer {
+private:
+    SocketHandle socket;
+    std::thread thread;
+    std::atomic<bool> stopping;
+    std::atomic<bool> connected;
+    std::atomic<long long> intervalNanoseconds;     // Smoothed time between frames
+    TripleBuffer<RenderState<float>> states;
+    
+    // Scene, set by connect() and then by the thread (so the world size the
+    // getters return is the one at connect time)
+    int width, height;
+    double quantum;
+    std::vector<float> radii;
+    std::vector<SDL_Color> colors;
+    
+    // Thread only (connect() before it starts)
+    std::vector<uint8_t> inbox;
+    std::vector<int64_t> quantizedX, quantizedY;
+    std::vector<float> lastX, lastY;
+    bool haveScene;
+    std::chrono::steady_clock::time_point lastArrival;
+    long long frames;
+    uint64_t bytes;
+    
+    static const uint64_t MAX_MESSAGE = 1u << 30;
+    
+    bool readScene(const uint8_t* data, size_t size) {
+        StreamSceneHeader header;
+        if (size < sizeof(header)) return false;
+        memcpy(&header, data, sizeof(header));
+        if (memcmp(header.magic, STREAM_MAGIC, sizeof(STREAM_MAGIC)) != 0 || header.version != STREAM_VERSION) return false;
+        const size_t n = header.ballCount;
+        if (size != sizeof(header) + n * (sizeof(float) + 1)) return false;
+        
+        width = header.width;
+        height = header.height;
+        quantum = header.positionQuantum;
+        radii.resize(n);
+        memcpy(radii.data(), data + sizeof(header), n * sizeof(float));
+        const uint8_t* index = data + sizeof(header) + n * sizeof(float);
+        colors.resize(n);
+        for (size_t i = 0; i < n; i++) colors[i] = NEON_COLORS[index[i] % NEON_COLOR_COUNT];
+        quantizedX.assign(n, 0);
+        quantizedY.assign(n, 0);
+        lastX.clear();
+        lastY.clear();
+        haveScene = true;
+        return true;
+    }
+    
+    bool readFrame(const uint8_t* data, size_t size) {
+        if (!haveScene) return true;
+        const uint8_t* in = data;
+        const uint8_t* end = data + size;
+        const size_t n = radii.size();
+        int64_t step, dx, dy;
+        if (!getVarint(in, end, step)) return false;
+        for (size_t i = 0; i < n; i++) {
+            if (!getVarint(in, end, dx) || !getVarint(in, end, dy)) return false;
+            quantizedX[i] += dx;
+            quantizedY[i] += dy;
+        }
+        
+        RenderState<float>& state = states.writeSlot();
+        state.x.resize(n);
+        state.y.resize(n);
+        for (size_t i = 0; i < n; i++) {
+            state.x[i] = (float)(quantizedX[i] * quantum);
+            state.y[i] = (float)(quantizedY[i] * quantum);
+        }
+        // The frame before is where the balls are drawn from
+        const bool continues = lastX.size() == n;
+        state.previousX = continues ? lastX : state.x;
+        state.previousY = continues ? lastY : state.y;
+        state.r = radii;
+        state.colors = colors;
+        state.step = step;
+        state.time = std::chrono::steady_clock::now();
+        lastX = state.x;
+        lastY = state.y;
+        
+        if (frames > 0) {
+            long long since = std::chrono::duration_cast<std::chrono::nanoseconds>(state.time - lastArrival).count();
+            intervalNanoseconds = (intervalNanoseconds * 7 + since) / 8;
+        }
+        lastArrival = state.time;
+        frames++;
+        states.publish();
+        return true;
+    }
+    
+    // Handle every complete message in the inbox; false on a protocol error
+    // or a close from the server
+    bool drainInbox() {
+        size_t used = 0;
+        WebSocketMessage message;
+        bool ok = true;
+        while (ok && parseWebSocketMessage(inbox.data() + used, inbox.size() - used, message)) {
+            const uint8_t* body = inbox.data() + used + message.payloadOffset;
+            const size_t size = (size_t)message.payloadSize;
+            if (message.opcode == WEBSOCKET_CLOSE) {
+                ok = false;
+            } else if (message.opcode == WEBSOCKET_BINARY && size > 0) {
+                if (body[0] == STREAM_SCENE) ok = readScene(body + 1, size - 1);
+                else if (body[0] == STREAM_FRAME) ok = readFrame(body + 1, size - 1);
+                if (!ok) std::cout << "❌ Malformed stream message" << std::endl;
+            }
+            used += message.payloadOffset + size;
+        }
+        inbox.erase(inbox.begin(), inbox.begin() + used);
+        
+        // A header announcing an absurd size would only grow the inbox (14
+        // bytes hold the longest header, so its size has been read)
+        if (ok && inbox.size() >= 14) {
+            parseWebSocketMessage(inbox.data(), inbox.size(), message);
+            ok = message.payloadSize <= MAX_MESSAGE;
+        }
+        return ok;
+    }
+    
+    // Append what has arrived within seconds; false once the connection is gone
+    bool receive(double seconds) {
+        if (!waitForSocket(socket, seconds)) return true;
+        uint8_t buffer[65536];
+        while (true) {
+            long received = receiveSome(socket, buffer, sizeof(buffer));
+            if (received < 0) return false;
+            if (received == 0) return true;
+            inbox.insert(inbox.end(), buffer, buffer + received);
+            bytes += received;
+        }
+    }
+    
+    void run() {
+        while (!stopping && receive(0.05) && drainInbox()) {}
+        connected = false;
+    }
+
+public:
+    StreamViewer() : socket(NO_SOCKET), stopping(false), connected(false), intervalNanoseconds(1000000000 / 30),
+                     width(0), height(0), quantum(1), haveScene(false), frames(0), bytes(0) {}
+    
+    ~StreamViewer() {
+        close();
+    }
+    
+    StreamViewer(const StreamViewer&) = delete;
+    StreamViewer& operator=(const StreamViewer&) = delete;
+    
+    // Connect to "host:port" and wait up to timeout seconds for the scene
+    bool connect(const std::string& address, double timeout = 5) {
+        close();
+        size_t colon = address.rfind(':');
+        if (colon == std::string::npos || !startSockets()) {
+            std::cout << "❌ Expected HOST:PORT, got " << address << std::endl;
+            return false;
+        }
+        const std::string host = address.substr(0, colon);
+        const std::string port = address.substr(colon + 1);
+        
+        addrinfo hints;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_INET;
+        hints.ai_socktype = SOCK_STREAM;
+        addrinfo* found = nullptr;
+        if (getaddrinfo(host.c_str(), port.c_str(), &hints, &found) != 0 || !found) {
+            std::cout << "❌ Cannot resolve " << host << std::endl;
+            return false;
+        }
+        socket = ::socket(found->ai_family, found->ai_socktype, found->ai_protocol);
+        bool ok = socket != NO_SOCKET && ::connect(socket, found->ai_addr, (int)found->ai_addrlen) == 0 &&
+                  prepareSocket(socket);
+        freeaddrinfo(found);
+        if (!ok) {
+            std::cout << "❌ Cannot connect to " << address << std::endl;
+            close();
+            return false;
+        }
+        
+        // Handshake, then read until the first scene has arrived
+        std::random_device device;
+        uint8_t nonce[16];
+        for (uint8_t& b : nonce) b = (uint8_t)device();
+        const std::string key = base64(nonce, sizeof(nonce));
+        const std::string request = "GET / HTTP/1.1\r\nHost: " + address + "\r\nUpgrade: websocket\r\n"
+                                    "Connection: Upgrade\r\nSec-WebSocket-Key: " + key +
+                                    "\r\nSec-WebSocket-Version: 13\r\n\r\n";
+        size_t sent = 0;
+        const auto deadline = std::chrono::steady_clock::now() + std::chrono::duration<double>(timeout);
+        while (ok && sent < request.size() && std::chrono::steady_clock::now() < deadline) {
+            long n = sendSome(socket, (const uint8_t*)request.data() + sent, request.size() - sent);
+            if (n < 0) ok = false;
+            else if (n == 0) waitForSocket(socket, 0.05, true);
+            else sent += n;
+        }
+        
+        std::string head;
+        while (ok && std::chrono::steady_clock::now() < deadline) {
+            ok = receive(0.05);
+            if (head.empty()) {
+                std::string text(inbox.begin(), inbox.end());
+                size_t end = text.find("\r\n\r\n");
+                if (end == std::string::npos) continue;
+                head = text.substr(0, end);
+                inbox.erase(inbox.begin(), inbox.begin() + end + 4);
+                if (head.compare(0, 12, "HTTP/1.1 101") != 0 ||
+                    httpHeader(head, "sec-websocket-accept") != webSocketAccept(key)) {
+                    std::cout << "❌ " << address << " is not a neon physics stream" << std::endl;
+                    ok = false;
+                    break;
+                }
+            }
+            ok = ok && drainInbox();
+            if (haveScene) break;
+        }
+        if (!ok || !haveScene) {
+            if (ok) std::cout << "❌ No scene from " << address << " within " << timeout << " s" << std::endl;
+            close();
+            return false;
+        }
+        
+        connected = true;
+        stopping = false;
+        thread = std::thread(&StreamViewer::run, this);
+        std::cout << "📺 Watching " << address << ": " << radii.size() << " balls, " << width << " x " << height << std::endl;
+        return true;
+    }
+    
+    bool isConnected() const {
+        return connected;
+    }
+    
+    int getWidth() const { return width; }
+    int getHeight() const { return height; }
+    
+    // Window thread: take the newest frame, if any, and read it
+    bool acquire() {
+        return states.acquire();
+    }
+    
+    const RenderState<float>& current() const {
+        return states.readSlot();
+    }
+    
+    double frameInterval() const {
+        return intervalNanoseconds / 1e9;
+    }
+    
+    // Send the close and disconnect
+    void close() {
+        if (socket == NO_SOCKET) return;
+        stopping = true;
+        if (thread.joinable()) thread.join();
+        
+        std::vector<uint8_t> goodbye;
+        appendWebSocketMessage(goodbye, WEBSOCKET_CLOSE, nullptr, 0, true);
+        sendSome(socket, goodbye.data(), goodbye.size());
+        closeSocket(socket);
+        socket = NO_SOCKET;
+        if (frames > 0) std::cout << "📺 Received " << frames << " frames, " << bytes / 1e6 << " MB" << std::endl;
+    }
+};
+
+// Per-worker narrow phase counters, one cache line each
+struct alignas(64) WorkerCounters {
+    long long candidates;
+    long long hits;
+    long long collisions;
+};
+
+#ifdef PHYSICS_SIM_OPENCL
+// Device side of the OpenCL step: the same integrate / wall / grid / colour
+// schedule as PhysicsSimulation's parallel grid path, one work item per ball
+// or per cell. Built with REAL_IS_DOUBLE for double simulations and with
+// COORD_IS_DOUBLE when the device has fp64, so cells are computed in double
+// like UniformGrid does.
+static const char* const OPENCL_STEP_SOURCE = R"CLC(
+#pragma OPENCL FP_CONTRACT OFF
+#if defined(REAL_IS_DOUBLE) || defined(COORD_IS_DOUBLE)
+#pragma OPENCL EXTENSION cl_khr_fp64 : enable
+#endif
+#ifdef REAL_IS_DOUBLE
+typedef double real;
+#else
+typedef float real;
+#endif
+#ifdef COORD_IS_DOUBLE
+typedef double coord;
+#else
+typedef float coord;
+#endif
+
+#define SCAN_GROUP 256
+
+int coordinate(real v, coord size, int limit) {
+    return clamp((int)((coord)v / size), 0, limit - 1);
+}
+
+__kernel void integrate(__global real* x, __global real* y, __global real* vx, __global real* vy,
+                        __global const real* r, uint n, real dt, real width, real height) {
+    uint i = get_global_id(0);
+    if (i >= n) return;
+    x[i] = x[i] + vx[i] * dt;
+    y[i] = y[i] + vy[i] * dt;
+    
+    if (x[i] - r[i] <= 0) {
+        x[i] = r[i];
+        vx[i] = -vx[i];
+    } else if (x[i] + r[i] >= width) {
+        x[i] = width - r[i];
+        vx[i] = -vx[i];
+    }
+    if (y[i] - r[i] <= 0) {
+        y[i] = r[i];
+        vy[i] = -vy[i];
+    } else if (y[i] + r[i] >= height) {
+        y[i] = height - r[i];
+        vy[i] = -vy[i];
+    }
+}
+
+__kernel void count_cells(__global const real* x, __global const real* y, uint n, coord size,
+                          int cols, int rows, __global int* ballCell, __global uint* cellCount) {
+    uint i = get_global_id(0);
+    if (i >= n) return;
+    int cell = coordinate(y[i], size, rows) * cols + coordinate(x[i], size, cols);
+    ballCell[i] = cell;
+    atomic_inc(&cellCount[cell]);
+}
+
+// Exclusive scan of one SCAN_GROUP block (in place is fine); sums receives
+// the block totals for the next level
+__kernel void scan_blocks(__global const uint* in, __global uint* out, __global uint* sums, uint count) {
+    __local uint values[SCAN_GROUP];
+    uint i = get_global_id(0);
+    uint lane = get_local_id(0);
+    uint value = i < count ? in[i] : 0;
+    values[lane] = value;
+    barrier(CLK_LOCAL_MEM_FENCE);
+    for (uint offset = 1; offset < SCAN_GROUP; offset <<= 1) {
+        uint add = lane >= offset ? values[lane - offset] : 0;
+        barrier(CLK_LOCAL_MEM_FENCE);
+        values[lane] += add;
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+    if (i < count) out[i] = values[lane] - value;
+    if (lane == SCAN_GROUP - 1) sums[get_group_id(0)] = values[lane];
+}
+
+__kernel void add_offsets(__global uint* out, __global const uint* sums, uint count) {
+    uint i = get_global_id(0);
+    if (i < count) out[i] += sums[get_group_id(0)];
+}
+
+__kernel void scatter(__global const int* ballCell, __global const uint* cellStart, __global uint* cellFill,
+                      __global int* cellBalls, uint n) {
+    uint i = get_global_id(0);
+    if (i >= n) return;
+    int cell = ballCell[i];
+    cellBalls[cellStart[cell] + atomic_inc(&cellFill[cell])] = i;
+}
+
+// The scatter order is arbitrary; ascending indices within a cell give the
+// CPU grid's order back
+__kernel void sort_cells(__global const uint* cellStart, __global int* cellBalls, uint cells) {
+    uint cell = get_global_id(0);
+    if (cell >= cells) return;
+    for (uint k = cellStart[cell] + 1; k < cellStart[cell + 1]; k++) {
+        int ball = cellBalls[k];
+        uint slot = k;
+        while (slot > cellStart[cell] && cellBalls[slot - 1] > ball) {
+            cellBalls[slot] = cellBalls[slot - 1];
+            slot--;
+        }
+        cellBalls[slot] = ball;
+    }
+}
+
+bool colliding(__global const real* x, __global const real* y, __global const real* r, int i, int j) {
+    real dx = x[i] - x[j];
+    real dy = y[i] - y[j];
+    real reach = r[i] + r[j];
+    return dx * dx + dy * dy <= reach * reach;
+}
+
+// Touching pairs of every cell: i from the cell, j > i from the 3x3 cells
+// around it, visited in ascending j (a merge of the sorted cells) like
+// UniformGrid::gatherNeighbours. With write = 0 it counts, with 1 it stores.
+__kernel void find_contacts(__global const real* x, __global const real* y, __global const real* r,
+                            int cols, int rows, __global const uint* cellStart, __global const int* cellBalls,
+                            __global uint* contactCount, __global const uint* contactStart,
+                            __global int2* contacts, int write, __global uint* counters) {
+    int cell = get_global_id(0);
+    if (cell >= cols * rows) return;
+    int cx = cell % cols;
+    int cy = cell / cols;
+    
+    uint found = 0;
+    uint candidates = 0;
+    for (uint k = cellStart[cell]; k < cellStart[cell + 1]; k++) {
+        int i = cellBalls[k];
+        uint cursor[9];
+        uint end[9];
+        int lists = 0;
+        for (int y = max(0, cy - 1); y <= min(rows - 1, cy + 1); y++) {
+            for (int x = max(0, cx - 1); x <= min(cols - 1, cx + 1); x++) {
+                int neighbour = y * cols + x;
+                uint c = cellStart[neighbour];
+                while (c < cellStart[neighbour + 1] && cellBalls[c] <= i) c++;
+                cursor[lists] = c;
+                end[lists] = cellStart[neighbour + 1];
+                lists++;
+            }
+        }
+        
+        while (true) {
+            int best = -1;
+            for (int l = 0; l < lists; l++) {
+                if (cursor[l] < end[l] && (best < 0 || cellBalls[cursor[l]] < cellBalls[cursor[best]])) best = l;
+            }
+            if (best < 0) break;
+            int j = cellBalls[cursor[best]++];
+            candidates++;
+            if (colliding(x, y, r, i, j)) {
+                if (write) contacts[contactStart[cell] + found] = (int2)(i, j);
+                found++;
+            }
+        }
+    }
+    if (!write) {
+        contactCount[cell] = found;
+        atomic_add(&counters[1], candidates);
+    }
+}
+
+// One cell of the colour per work item, its contacts in stored order,
+// exactly BallStore::resolveCollision
+__kernel void resolve_colour(int colour, int cols, int rows, __global const uint* contactStart,
+                             __global const int2* contacts, __global real* x, __global real* y,
+                             __global real* vx, __global real* vy, __global const real* r,
+                             __global const real* invM, __global uint* counters) {
+    int colourCols = (cols - colour % 3 + 2) / 3;
+    int task = get_global_id(0);
+    int cx = colour % 3 + 3 * (task % colourCols);
+    int cy = colour / 3 + 3 * (task / colourCols);
+    if (cy >= rows) return;
+    int cell = cy * cols + cx;
+    
+    uint collisions = 0;
+    for (uint c = contactStart[cell]; c < contactStart[cell + 1]; c++) {
+        int i = contacts[c].x;
+        int j = contacts[c].y;
+        if (!colliding(x, y, r, i, j)) continue;
+        collisions++;
+        
+        real dx = x[i] - x[j];
+        real dy = y[i] - y[j];
+        real d = sqrt(dx * dx + dy * dy);
+        if (d == 0) {
+            dx = 1;
+            dy = 0;
+            d = 1;
+        }
+        real invD = (real)1 / d;
+        real nx = dx * invD;
+        real ny = dy * invD;
+        
+        real overlap = (r[i] + r[j]) - d;
+        real reducedMass = (real)1 / (invM[i] + invM[j]);
+        real push = overlap * reducedMass;
+        real pushI = push * invM[i];
+        real pushJ = push * invM[j];
+        x[i] = x[i] + nx * pushI;
+        y[i] = y[i] + ny * pushI;
+        x[j] = x[j] - nx * pushJ;
+        y[j] = y[j] - ny * pushJ;
+        
+        real velocityAlongNormal = (vx[i] - vx[j]) * nx + (vy[i] - vy[j]) * ny;
+        if (velocityAlongNormal > 0) continue;
+        real impulse = 2 * velocityAlongNormal * reducedMass;
+        real impulseI = impulse * invM[i];
+        real impulseJ = impulse * invM[j];
+        vx[i] = vx[i] - nx * impulseI;
+        vy[i] = vy[i] - ny * impulseI;
+        vx[j] = vx[j] + nx * impulseJ;
+        vy[j] = vy[j] + ny * impulseJ;
+    }
+    if (collisions) atomic_add(&counters[0], collisions);
+}
+)CLC";
+
+// Optional OpenCL compute backend: the ball arrays live on the device and the
+// whole step (integration, walls, grid binning, contact detection and the
+// nine resolution colours) runs there. The host only reads back two counters
+// per step; positions are mapped for the renderer when a frame is drawn and
+// the full state is downloaded on request. The CPU path stays the reference.
+template <typename T>
+class OpenCLBackend {
+private:
+    enum Kernel {
+        INTEGRATE, COUNT_CELLS, SCAN_BLOCKS, ADD_OFFSETS, SCATTER, SORT_CELLS, FIND_CONTACTS, RESOLVE_COLOUR,
+        KERNELS
+    };
+    static const size_t GROUP = 256;    // SCAN_GROUP in the kernels
+    
+    cl_device_id device;
+    cl_context context;
+    cl_command_queue queue;
+    cl_program program;
+    cl_kernel kernels[KERNELS];
+    bool coordDouble;           // Device has fp64: cell coordinates in double
+    std::string deviceName;
+    
+    size_t n;
+    int cols;
+    int rows;
+    double cellSize;
+    T width;
+    T height;
+    cl_mem x, y, vx, vy, r, invM;
+    cl_mem previousX, previousY;
+    cl_mem ballCell, cellStart, cellFill, cellBalls;
+    cl_mem contactStart, contacts, counters;
+    size_t contactCapacity;
+    std::vector<cl_mem> scanSums;       // Block totals per scan level...
+    std::vector<size_t> scanCapacity;   // ...and how many each holds
+    
+    static bool check(cl_int status, const char* what) {
+        if (status != CL_SUCCESS) std::cout << "❌ OpenCL " << what << " failed (" << status << ")" << std::endl;
+        return status == CL_SUCCESS;
+    }
+    
+    template <typename Arg>
+    void setArg(Kernel kernel, cl_uint index, const Arg& value) {
+        clSetKernelArg(kernels[kernel], index, sizeof(Arg), &value);
+    }
+    
+    void launch(Kernel kernel, size_t items, size_t group = GROUP) {
+        if (items == 0) return;
+        size_t global = (items + group - 1) / group * group;
+        clEnqueueNDRangeKernel(queue, kernels[kernel], 1, nullptr, &global, &group, 0, nullptr, nullptr);
+    }
+    
+    static void release(cl_mem& buffer) {
+        if (buffer) clReleaseMemObject(buffer);
+        buffer = nullptr;
+    }
+    
+    cl_mem buffer(size_t bytes, cl_mem_flags flags = CL_MEM_READ_WRITE) {
+        cl_int status;
+        cl_mem created = clCreateBuffer(context, flags, std::max<size_t>(bytes, 4), nullptr, &status);
+        return check(status, "buffer allocation") ? created : nullptr;
+    }
+    
+    void zero(cl_mem target, size_t bytes) {
+        cl_uint value = 0;
+        clEnqueueFillBuffer(queue, target, &value, sizeof(value), 0, bytes, 0, nullptr, nullptr);
+    }
+    
+    // Exclusive scan of count values in place, recursing over the block totals
+    void scan(cl_mem values, size_t count, size_t level = 0) {
+        size_t blocks = (count + GROUP - 1) / GROUP;
+        if (scanSums.size() <= level) {
+            scanSums.push_back(nullptr);
+            scanCapacity.push_back(0);
+        }
+        if (scanCapacity[level] < blocks) {
+            release(scanSums[level]);
+            scanSums[level] = buffer(blocks * sizeof(cl_uint));
+            scanCapacity[level] = blocks;
+        }
+        
+        cl_uint items = (cl_uint)count;
+        setArg(SCAN_BLOCKS, 0, values);
+        setArg(SCAN_BLOCKS, 1, values);
+        setArg(SCAN_BLOCKS, 2, scanSums[level]);
+        setArg(SCAN_BLOCKS, 3, items);
+        launch(SCAN_BLOCKS, count);
+        if (blocks == 1) return;
+        
+        scan(scanSums[level], blocks, level + 1);
+        setArg(ADD_OFFSETS, 0, values);
+        setArg(ADD_OFFSETS, 1, scanSums[level]);
+        setArg(ADD_OFFSETS, 2, items);
+        launch(ADD_OFFSETS, count);
+    }
+    
+    cl_uint readValue(cl_mem source, size_t index) {
+        cl_uint value = 0;
+        clEnqueueReadBuffer(queue, source, CL_TRUE, index * sizeof(cl_uint), sizeof(value), &value, 0, nullptr, nullptr);
+        return value;
+    }
+    
+    void releaseBalls() {
+        for (cl_mem* b : {&x, &y, &vx, &vy, &r, &invM, &previousX, &previousY, &ballCell, &cellStart,
+                          &cellFill, &cellBalls, &contactStart, &contacts, &counters}) {
+            release(*b);
+        }
+        for (cl_mem& sums : scanSums) release(sums);
+        scanCapacity.assign(scanSums.size(), 0);
+        n = 0;
+        contactCapacity = 0;
+    }
+    
+public:
+    OpenCLBackend()
+        : device(nullptr), context(nullptr), queue(nullptr), program(nullptr), coordDouble(false),
+          n(0), cols(0), rows(0), cellSize(1), width(0), height(0),
+          x(nullptr), y(nullptr), vx(nullptr), vy(nullptr), r(nullptr), invM(nullptr),
+          previousX(nullptr), previousY(nullptr), ballCell(nullptr), cellStart(nullptr), cellFill(nullptr),
+          cellBalls(nullptr), contactStart(nullptr), contacts(nullptr), counters(nullptr), contactCapacity(0) {
+        for (cl_kernel& kernel : kernels) kernel = nullptr;
+    }
+    
+    ~OpenCLBackend() {
+        releaseBalls();
+        for (cl_kernel kernel : kernels) {
+            if (kernel) clReleaseKernel(kernel);
+        }
+        if (program) clReleaseProgram(program);
+        if (queue) clReleaseCommandQueue(queue);
+        if (context) clReleaseContext(context);
+    }
+    
+    OpenCLBackend(const OpenCLBackend&) = delete;
+    OpenCLBackend& operator=(const OpenCLBackend&) = delete;
+    
+    // Pick the first GPU (any device if there is none) and build the
+    // kernels. Returns false, with the reason printed, if that fails.
+    bool open() {
+        cl_uint platformCount = 0;
+        if (clGetPlatformIDs(0, nullptr, &platformCount) != CL_SUCCESS || platformCount == 0) {
+            std::cout << "❌ No OpenCL platform found" << std::endl;
+            return false;
+        }
+        std::vector<cl_platform_id> platforms(platformCount);
+        clGetPlatformIDs(platformCount, platforms.data(), nullptr);
+        for (cl_device_type type : {(cl_device_type)CL_DEVICE_TYPE_GPU, (cl_device_type)CL_DEVICE_TYPE_ALL}) {
+            for (cl_platform_id platform : platforms) {
+                if (!device && clGetDeviceIDs(platform, type, 1, &device, nullptr) != CL_SUCCESS) device = nullptr;
+            }
+        }
+        if (!device) {
+            std::cout << "❌ No OpenCL device found" << std::endl;
+            return false;
+        }
+        
+        char text[1024] = {0};
+        clGetDeviceInfo(device, CL_DEVICE_NAME, sizeof(text) - 1, text, nullptr);
+        deviceName = text;
+        size_t extensionSize = 0;
+        clGetDeviceInfo(device, CL_DEVICE_EXTENSIONS, 0, nullptr, &extensionSize);
+        std::string extensions(extensionSize, '\0');
+        clGetDeviceInfo(device, CL_DEVICE_EXTENSIONS, extensionSize, &extensions[0], nullptr);
+        coordDouble = extensions.find("cl_khr_fp64") != std::string::npos;
+        if (sizeof(T) == sizeof(double) && !coordDouble) {
+            std::cout << "❌ " << deviceName << " has no double precision (try --precision float)" << std::endl;
+            return false;
+        }
+        
+        cl_int status;
+        context = clCreateContext(nullptr, 1, &device, nullptr, nullptr, &status);
+        if (!check(status, "context creation")) return false;
+        queue = clCreateCommandQueue(context, device, 0, &status);
+        if (!check(status, "queue creation")) return false;
+        
+        const char* source = OPENCL_STEP_SOURCE;
+        program = clCreateProgramWithSource(context, 1, &source, nullptr, &status);
+        if (!check(status, "program creation")) return false;
+        
+        // Correctly rounded float division and sqrt, as on the CPU
+        std::string options = "-cl-fp32-correctly-rounded-divide-sqrt";
+        if (sizeof(T) == sizeof(double)) options += " -DREAL_IS_DOUBLE";
+        if (coordDouble) options += " -DCOORD_IS_DOUBLE";
+        if (clBuildProgram(program, 1, &device, options.c_str(), nullptr, nullptr) != CL_SUCCESS) {
+            size_t logSize = 0;
+            clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, 0, nullptr, &logSize);
+            std::string log(logSize, '\0');
+            clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, logSize, &log[0], nullptr);
+            std::cout << "❌ OpenCL kernels failed to build:\n" << log << std::endl;
+            return false;
+        }
+        
+        const char* names[KERNELS] = {"integrate", "count_cells", "scan_blocks", "add_offsets", "scatter",
+                                      "sort_cells", "find_contacts", "resolve_colour"};
+        for (int k = 0; k < KERNELS; k++) {
+            kernels[k] = clCreateKernel(program, names[k], &status);
+            if (!check(status, names[k])) return false;
+        }
+        return true;
+    }
+    
+    const std::string& getDeviceName() const {
+        return deviceName;
+    }
+    
+    // Copy the balls to the device (sizing the buffers on first use or when
+    // the count or world changes)
+    bool upload(const BallStore<T>& balls, double size, int worldWidth, int worldHeight) {
+        int newCols = std::max(1, (int)ceil(worldWidth / size));
+        int newRows = UniformGrid::rowCount(size, worldHeight);
+        if (balls.size() != n || newCols != cols || newRows != rows) {
+            releaseBalls();
+            n = balls.size();
+            cols = newCols;
+            rows = newRows;
+            size_t cells = (size_t)cols * rows;
+            const size_t bytes = n * sizeof(T);
+            for (cl_mem* b : {&vx, &vy, &r, &invM}) *b = buffer(bytes);
+            
+            // Host-visible, so mapping them for the renderer needs no copy on shared-memory devices
+            for (cl_mem* b : {&x, &y, &previousX, &previousY}) *b = buffer(bytes, CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR);
+            ballCell = buffer(n * sizeof(cl_int));
+            cellBalls = buffer(n * sizeof(cl_int));
+            cellStart = buffer((cells + 1) * sizeof(cl_uint));
+            cellFill = buffer(cells * sizeof(cl_uint));
+            contactStart = buffer((cells + 1) * sizeof(cl_uint));
+            counters = buffer(2 * sizeof(cl_uint));
+            if (!x || !y || !vx || !vy || !r || !invM || !previousX || !previousY || !cellStart || !contactStart) {
+                releaseBalls();
+                return false;
+            }
+        }
+        cellSize = size;
+        width = T(worldWidth);
+        height = T(worldHeight);
+        
+        const size_t bytes = n * sizeof(T);
+        const std::pair<cl_mem, const std::vector<T>*> arrays[] = {
+            {x, &balls.x}, {y, &balls.y}, {vx, &balls.vx}, {vy, &balls.vy}, {r, &balls.r}, {invM, &balls.invM}};
+        for (const auto& array : arrays) {
+            clEnqueueWriteBuffer(queue, array.first, CL_FALSE, 0, bytes, array.second->data(), 0, nullptr, nullptr);
+        }
+        return check(clFinish(queue), "upload");
+    }
+    
+    // One full step on the device. keepPrevious copies the positions first,
+    // for interpolated rendering. Returns the collisions resolved.
+    int step(double deltaTime, bool keepPrevious, long long& candidates, long long& hits) {
+        const size_t bytes = n * sizeof(T);
+        const cl_uint count = (cl_uint)n;
+        const size_t cells = (size_t)cols * rows;
+        if (keepPrevious) {
+            clEnqueueCopyBuffer(queue, x, previousX, 0, 0, bytes, 0, nullptr, nullptr);
+            clEnqueueCopyBuffer(queue, y, previousY, 0, 0, bytes, 0, nullptr, nullptr);
+        }
+        
+        T dt = T(deltaTime);
+        setArg(INTEGRATE, 0, x);
+        setArg(INTEGRATE, 1, y);
+        setArg(INTEGRATE, 2, vx);
+        setArg(INTEGRATE, 3, vy);
+        setArg(INTEGRATE, 4, r);
+        setArg(INTEGRATE, 5, count);
+        setArg(INTEGRATE, 6, dt);
+        setArg(INTEGRATE, 7, width);
+        setArg(INTEGRATE, 8, height);
+        launch(INTEGRATE, n);
+        
+        // Counting sort into cells, like UniformGrid::build
+        zero(cellStart, (cells + 1) * sizeof(cl_uint));
+        zero(cellFill, cells * sizeof(cl_uint));
+        zero(counters, 2 * sizeof(cl_uint));
+        setArg(COUNT_CELLS, 0, x);
+        setArg(COUNT_CELLS, 1, y);
+        setArg(COUNT_CELLS, 2, count);
+        if (coordDouble) {
+            setArg(COUNT_CELLS, 3, cellSize);
+        } else {
+            setArg(COUNT_CELLS, 3, (float)cellSize);
+        }
+        setArg(COUNT_CELLS, 4, cols);
+        setArg(COUNT_CELLS, 5, rows);
+        setArg(COUNT_CELLS, 6, ballCell);
+        setArg(COUNT_CELLS, 7, cellStart);
+        launch(COUNT_CELLS, n);
+        scan(cellStart, cells + 1);
+        
+        setArg(SCATTER, 0, ballCell);
+        setArg(SCATTER, 1, cellStart);
+        setArg(SCATTER, 2, cellFill);
+        setArg(SCATTER, 3, cellBalls);
+        setArg(SCATTER, 4, count);
+        launch(SCATTER, n);
+        cl_uint cellCount = (cl_uint)cells;
+        setArg(SORT_CELLS, 0, cellStart);
+        setArg(SORT_CELLS, 1, cellBalls);
+        setArg(SORT_CELLS, 2, cellCount);
+        launch(SORT_CELLS, cells);
+        
+        // Contacts per cell: count, scan, then store
+        zero(contactStart, (cells + 1) * sizeof(cl_uint));
+        if (!contacts) {
+            contactCapacity = std::max<size_t>(n, 1024);
+            contacts = buffer(contactCapacity * sizeof(cl_int2));
+        }
+        int cellCols = cols;
+        int cellRows = rows;
+        setArg(FIND_CONTACTS, 0, x);
+        setArg(FIND_CONTACTS, 1, y);
+        setArg(FIND_CONTACTS, 2, r);
+        setArg(FIND_CONTACTS, 3, cellCols);
+        setArg(FIND_CONTACTS, 4, cellRows);
+        setArg(FIND_CONTACTS, 5, cellStart);
+        setArg(FIND_CONTACTS, 6, cellBalls);
+        setArg(FIND_CONTACTS, 7, contactStart);
+        setArg(FIND_CONTACTS, 8, contactStart);
+        setArg(FIND_CONTACTS, 9, contacts);
+        setArg(FIND_CONTACTS, 10, 0);
+        setArg(FIND_CONTACTS, 11, counters);
+        launch(FIND_CONTACTS, cells, 64);
+        scan(contactStart, cells + 1);
+        
+        cl_uint total = readValue(contactStart, cells);
+        if (total > contactCapacity) {
+            release(contacts);
+            contactCapacity = total + total / 2;
+            contacts = buffer(contactCapacity * sizeof(cl_int2));
+            setArg(FIND_CONTACTS, 9, contacts);
+        }
+        setArg(FIND_CONTACTS, 10, 1);
+        launch(FIND_CONTACTS, cells, 64);
+        
+        setArg(RESOLVE_COLOUR, 1, cellCols);
+        setArg(RESOLVE_COLOUR, 2, cellRows);
+        setArg(RESOLVE_COLOUR, 3, contactStart);
+        setArg(RESOLVE_COLOUR, 4, contacts);
+        setArg(RESOLVE_COLOUR, 5, x);
+        setArg(RESOLVE_COLOUR, 6, y);
+        setArg(RESOLVE_COLOUR, 7, vx);
+        setArg(RESOLVE_COLOUR, 8, vy);
+        setArg(RESOLVE_COLOUR, 9, r);
+        setArg(RESOLVE_COLOUR, 10, invM);
+        setArg(RESOLVE_COLOUR, 11, counters);
+        for (int colour = 0; colour < 9; colour++) {
+            int colourCols = (cols - colour % 3 + 2) / 3;
+            int colourRows = (rows - colour / 3 + 2) / 3;
+            setArg(RESOLVE_COLOUR, 0, colour);
+            launch(RESOLVE_COLOUR, (size_t)std::max(0, colourCols) * std::max(0, colourRows), 64);
+        }
+        
+        cl_uint results[2] = {0, 0};
+        clEnqueueReadBuffer(queue, counters, CL_TRUE, 0, sizeof(results), results, 0, nullptr, nullptr);
+        candidates = results[1];
+        hits = total;
+        return (int)results[0];
+    }
+    
+    // Current (and, if kept, previous) positions for the renderer, through a
+    // mapping of the host-visible buffers
+    void readPositions(std::vector<T>& outX, std::vector<T>& outY,
+                       std::vector<T>& outPreviousX, std::vector<T>& outPreviousY, bool withPrevious) {
+        const size_t bytes = n * sizeof(T);
+        const std::pair<cl_mem, std::vector<T>*> arrays[] = {
+            {x, &outX}, {y, &outY}, {withPrevious ? previousX : x, &outPreviousX},
+            {withPrevious ? previousY : y, &outPreviousY}};
+        for (const auto& array : arrays) {
+            array.second->resize(n);
+            cl_int status;
+            void* mapped = clEnqueueMapBuffer(queue, array.first, CL_TRUE, CL_MAP_READ, 0, bytes, 0, nullptr, nullptr, &status);
+            if (status != CL_SUCCESS) continue;
+            memcpy(array.second->data(), mapped, bytes);
+            clEnqueueUnmapMemObject(queue, array.first, mapped, 0, nullptr, nullptr);
+        }
+        clFinish(queue);
+    }
+    
+    // Copy the moving state (positions and velocities) back into balls
+    void download(BallStore<T>& balls) {
+        const size_t bytes = n * sizeof(T);
+        const std::pair<cl_mem, std::vector<T>*> arrays[] = {{x, &balls.x}, {y, &balls.y}, {vx, &balls.vx}, {vy, &balls.vy}};
+        for (const auto& array : arrays) {
+            clEnqueueReadBuffer(queue, array.first, CL_FALSE, 0, bytes, array.second->data(), 0, nullptr, nullptr);
+        }
+        clFinish(queue);
+    }
+};
+#endif
+
+// Compile-time settings of the collision loops. Every combination of broad
+// phase loop and policy is its own instantiation, picked once whenever a
+// setting changes rather than tested per pair, so a feature that is off costs
+// nothing inside the loop.
+template <bool SleepingOn, bool UniformMassOn>
+struct StepPolicy {
+    static const bool sleeping = SleepingOn;       // Skip sleeping pairs, wake on contact
+    static const bool uniformMass = UniformMassOn; // Every ball weighs the same (UniformMass)
+};
+
+template <typename T>
+class PhysicsSimulation {
+private:
+    BallStore<T> balls;
+    int windowWidth;
+    int windowHeight;
+    long long collisionCount;
+    long long stepCount;
+    int numBalls;
+    double minRadius;
+    double maxRadius;
+    BroadPhase broadPhase;
+    unsigned int seed;
+    unsigned int scene;     // Scenes generated so far; reset() moves on to the next
+    StepKernels<T> kernels;
+    UniformGrid grid;
+    SweepAndPrune sweep;
+    HierarchicalGrid levels;
+    
+    // Event-driven continuous collision mode (replaces integrate + broad phase)
+    bool continuous;
+    EventDrivenSolver<T> ccd;
+    
+    // Positions at the start of the last step, for interpolated rendering
+    bool interpolate;
+    std::vector<T> previousX, previousY;
+    std::vector<T> renderX, renderY;
+    std::vector<int> neighbours;
+    
+    // Parallel grid state: every worker appends the contacts of the rows it
+    // detects to its own arena, rowWorker says which arena holds a row, and
+    // the cell ranges index into that arena; plus per-worker scratch space
+    std::unique_ptr<ThreadPool> pool;
+    std::vector<FrameArena<std::pair<int, int>>> workerContacts;
+    std::vector<int> rowWorker;
+    std::vector<int> cellContactBegin;
+    std::vector<int> cellContactEnd;
+    std::vector<std::vector<int>> workerNeighbours;
+    std::vector<WorkerCounters> workerCounters;
+    
+    // Conservation totals, kept up to date from the velocity changes of each
+    // step and re-measured from scratch every MOTION_RECONCILE_INTERVAL steps
+    // to wash out rounding drift
+    static const int MOTION_RECONCILE_INTERVAL = 1024;
+    MotionStats motion;
+    MotionStats stepMotion;
+    std::vector<MotionStats> rowMotion;
+    std::vector<MotionStats> chunkMotion;
+    long long motionReconciledStep;
+    double motionCorrection;    // Energy error found by the last reconciliation
+    
+    // Optional sleeping (off while sleepSpeed is 0): a ball slower than
+    // sleepSpeed for sleepTime seconds is stopped, and blocks of balls that are
+    // all asleep skip integration; pairs of two sleeping balls skip the narrow
+    // phase. Any contact wakes both balls.
+    static const size_t SLEEP_BLOCK = 256;
+    double sleepSpeed;
+    double sleepTime;
+    std::vector<uint8_t> asleep;
+    std::vector<float> restTime;    // Seconds each awake ball has been below sleepSpeed
+    std::vector<int> blockAwake;    // Awake balls per SLEEP_BLOCK indices, as of the last step
+    int sleepingCount;
+    
+    // Optional re-sort of the storage into Morton order every reorderInterval
+    // steps (off while it is 0), so neighbours in the world stay neighbours in
+    // memory. Balls keep their ids; index-keyed caches are rebuilt.
+    int reorderInterval;
+    MortonOrder morton;
+    BallStore<T> reordered;
+    std::vector<uint8_t> reorderedAsleep;
+    std::vector<float> reorderedRestTime;
+    
+    // Every ball has the same mass, as commonMass describes (detectUniformMass).
+    // fixedMass above 0 makes the generated scenes uniform.
+    double fixedMass;
+    bool allSameMass;
+    UniformMass<T> commonMass;
+    
+    // Collision loop for the current broad phase and policy (selectCollide)
+    typedef int (PhysicsSimulation::*CollideFunction)();
+    CollideFunction collide;
+    
+    // Narrow phase work done by the current step
+    long long frameCandidates;
+    long long frameHits;
+    StepTelemetry telemetry;
+    
+    // Optional trajectory output, fed after every step
+    TrajectoryRecorder<T>* recorder;
+    
+    // Optional state stream, fed after the steps it asks for
+    StateStreamer<T>* streamer;
+    
+    // Optional device step (setGpuEnabled). Whichever side stepped last holds
+    // the current balls; the other copy is refreshed only when it is needed.
+#ifdef PHYSICS_SIM_OPENCL
+    std::unique_ptr<OpenCLBackend<T>> gpu;
+#endif
+    bool deviceCurrent;
+    bool hostCurrent;
+    
+    bool verbose;       // Console lines on construction and on every new scene
+    
+    void initializeBalls() {
+        auto start = std::chrono::steady_clock::now();
+        collisionCount = 0;
+        stepCount = 0;
+        telemetry.clear();
+        ccd.invalidate();
+        sweep.invalidate();
+        
+        // Every slot is overwritten, so the arrays are only resized, never cleared
+        const size_t n = numBalls;
+        balls.resize(n);
+        SceneGenerator generator(seed, scene++, numBalls, minRadius, maxRadius, windowWidth, windowHeight, fixedMass);
+        
+        const size_t CHUNK = 16384;
+        if (!pool || n <= CHUNK) {
+            generator.fill(balls, 0, n);
+        } else {
+            pool->run((int)((n + CHUNK - 1) / CHUNK), [&](int task, int) {
+                size_t begin = task * CHUNK;
+                generator.fill(balls, begin, std::min(n, begin + CHUNK));
+            });
+        }
+        
+        reconcileMotion();
+        motionCorrection = 0;
+        wakeAll();
+        detectUniformMass();
+        deviceCurrent = false;
+        hostCurrent = true;
+        
+        double milliseconds = std::chrono::duration<double, std::milli>(
+            std::chrono::steady_clock::now() - start).count();
+        if (verbose) std::cout << "Created " << balls.size() << " balls in " << milliseconds << " ms!" << std::endl;
+    }
+    
+    // Full O(n) pass, in ball order, over the quantities tracked in motion
+    MotionStats measureMotion() const {
+        MotionStats measured;
+        for (size_t i = 0; i < balls.size(); i++) {
+            measured.addBall(balls.m[i], balls.vx[i], balls.vy[i]);
+        }
+        return measured;
+    }
+    
+    void reconcileMotion() {
+        MotionStats measured = measureMotion();
+        motionCorrection = measured.energy - motion.energy;
+        motion = measured;
+        motionReconciledStep = stepCount;
+    }
+    
+    // The OpenCL backend runs the parallel grid step only, so CCD and
+    // sleeping stay on the CPU
+    bool stepsOnDevice() const {
+#ifdef PHYSICS_SIM_OPENCL
+        return gpu && !continuous && sleepSpeed <= 0;
+#else
+        return false;
+#endif
+    }
+    
+    // Copy the host balls to the device if it is behind; drops the backend
+    // if that fails
+    bool pushToDevice() {
+#ifdef PHYSICS_SIM_OPENCL
+        if (gpu && !deviceCurrent) {
+            if (!gpu->upload(balls, gridCellSize(), windowWidth, windowHeight)) {
+                std::cout << "❌ Cannot upload the balls, stepping on the CPU" << std::endl;
+                gpu.reset();
+                return false;
+            }
+            deviceCurrent = true;
+        }
+        return gpu != nullptr;
+#else
+        return false;
+#endif
+    }
+    
+    // Bring the host arrays, and with them the tracked totals (not kept on
+    // the device), up to date after device steps
+    void pullFromDevice() {
+#ifdef PHYSICS_SIM_OPENCL
+        if (gpu && !hostCurrent) {
+            gpu->download(balls);
+            motion = measureMotion();
+            motionReconciledStep = stepCount;
+        }
+#endif
+        hostCurrent = true;
+    }
+    
+    int stepDevice(double deltaTime) {
+#ifdef PHYSICS_SIM_OPENCL
+        hostCurrent = false;
+        return gpu->step(deltaTime, interpolate, frameCandidates, frameHits);
+#else
+        (void)deltaTime;
+        return 0;
+#endif
+    }
+    
+    // Positions for the renderer straight from the device, when the host
+    // copy is behind
+    bool readDevicePositions(RenderState<T>& state) const {
+#ifdef PHYSICS_SIM_OPENCL
+        if (gpu && !hostCurrent) {
+            gpu->readPositions(state.x, state.y, state.previousX, state.previousY, interpolate);
+            return true;
+        }
+#endif
+        (void)state;
+        return false;
+    }
+    
+    const uint8_t* sleepFlags() const {
+        return sleepSpeed > 0 ? asleep.data() : nullptr;
+    }
+    
+    void wakeAll() {
+        const size_t n = sleepSpeed > 0 ? balls.size() : 0;
+        asleep.assign(n, 0);
+        restTime.assign(n, 0);
+        blockAwake.resize((n + SLEEP_BLOCK - 1) / SLEEP_BLOCK);
+        for (size_t b = 0; b < blockAwake.size(); b++) {
+            blockAwake[b] = (int)(std::min(n, (b + 1) * SLEEP_BLOCK) - b * SLEEP_BLOCK);
+        }
+        sleepingCount = 0;
+    }
+    
+    template <typename Policy>
+    bool bothAsleep(size_t i, size_t j) const {
+        return Policy::sleeping && asleep[i] && asleep[j];
+    }
+    
+    // Resolve one contact and wake both balls. Only the two balls are
+    // written, so this is safe under the parallel grid's colouring.
+    template <typename Policy>
+    void resolveContact(size_t i, size_t j, MotionStats& tracked) {
+        if (Policy::uniformMass) {
+            balls.resolveCollision(i, j, commonMass, &tracked);
+        } else {
+            balls.resolveCollision(i, j, PerBallMass<T>{balls.m.data(), balls.invM.data()}, &tracked);
+        }
+        if (Policy::sleeping) {
+            asleep[i] = asleep[j] = 0;
+            restTime[i] = restTime[j] = 0;
+        }
+    }
+    
+    // Whether every ball has the same mass, so the collision loops can use
+    // the UniformMass constants instead of the mass arrays
+    void detectUniformMass() {
+        allSameMass = balls.size() > 0;
+        for (size_t i = 1; i < balls.size() && allSameMass; i++) {
+            allSameMass = balls.m[i] == balls.m[0] && balls.invM[i] == balls.invM[0];
+        }
+        if (allSameMass) commonMass = UniformMass<T>(balls.m[0], balls.invM[0]);
+        selectCollide();
+    }
+    
+    template <typename Policy>
+    CollideFunction collideFunction() const {
+        switch (broadPhase) {
+            case BroadPhase::ParallelGrid: return &PhysicsSimulation::collideParallelGrid<Policy>;
+            case BroadPhase::UniformGrid:  return &PhysicsSimulation::collideUniformGrid<Policy>;
+            case BroadPhase::SweepAndPrune: return &PhysicsSimulation::collideSweepAndPrune<Policy>;
+            case BroadPhase::HierarchicalGrid: return &PhysicsSimulation::collideHierarchicalGrid<Policy>;
+            default:                       return &PhysicsSimulation::collideBruteForce<Policy>;
+        }
+    }
+    
+    // Point collide at the loop for the broad phase, sleeping and masses in
+    // use; called whenever one of them changes
+    void selectCollide() {
+        if (sleepSpeed > 0) {
+            collide = allSameMass ? collideFunction<StepPolicy<true, true>>() : collideFunction<StepPolicy<true, false>>();
+        } else {
+            collide = allSameMass ? collideFunction<StepPolicy<false, true>>() : collideFunction<StepPolicy<false, false>>();
+        }
+    }
+    
+    // End of a step: stop the balls that have been slow for long enough and
+    // recount the awake balls of every block
+    void updateSleeping(double deltaTime) {
+        const size_t n = balls.size();
+        const double limit = sleepSpeed * sleepSpeed;
+        int sleepers = 0;
+        for (size_t b = 0; b < blockAwake.size(); b++) {
+            int awake = 0;
+            for (size_t i = b * SLEEP_BLOCK; i < std::min(n, (b + 1) * SLEEP_BLOCK); i++) {
+                if (asleep[i]) {
+                    sleepers++;
+                    continue;
+                }
+                double vx = balls.vx[i];
+                double vy = balls.vy[i];
+                if (vx * vx + vy * vy >= limit) {
+                    restTime[i] = 0;
+                    awake++;
+                    continue;
+                }
+                restTime[i] += (float)deltaTime;
+                if (restTime[i] < sleepTime) {
+                    awake++;
+                    continue;
+                }
+                
+                // Stopping the ball is the one change sleeping makes to the motion
+                stepMotion.removeBall(balls.m[i], vx, vy);
+                stepMotion.addBall(balls.m[i], 0, 0);
+                balls.vx[i] = 0;
+                balls.vy[i] = 0;
+                asleep[i] = 1;
+                sleepers++;
+            }
+            blockAwake[b] = awake;
+        }
+        sleepingCount = sleepers;
+    }
+    
+    // Permute every per-ball array into Morton order. The pair order of the
+    // following steps changes with the indices, so runs with and without
+    // reordering differ, but the order and the results do not depend on the
+    // thread count.
+    void reorderBalls() {
+        PHYSICS_SIM_PROFILE_SCOPE(Reorder);
+        const std::vector<int>& order = morton.sort(balls, 2 * maxRadius, windowWidth, windowHeight, pool.get());
+        const size_t n = balls.size();
+        const size_t CHUNK = 16384;
+        reordered.resize(n);
+        auto gatherChunk = [&](int task, int) {
+            size_t begin = task * CHUNK;
+            reordered.gather(balls, order, begin, std::min(n, begin + CHUNK));
+        };
+        const int chunks = (int)((n + CHUNK - 1) / CHUNK);
+        if (!pool || n <= CHUNK) {
+            for (int task = 0; task < chunks; task++) gatherChunk(task, 0);
+        } else {
+            pool->run(chunks, gatherChunk);
+        }
+        std::swap(balls, reordered);
+        
+        if (sleepSpeed > 0) {
+            reorderedAsleep.resize(n);
+            reorderedRestTime.resize(n);
+            for (size_t k = 0; k < n; k++) {
+                reorderedAsleep[k] = asleep[order[k]];
+                reorderedRestTime[k] = restTime[order[k]];
+            }
+            asleep.swap(reorderedAsleep);
+            restTime.swap(reorderedRestTime);
+            for (size_t b = 0; b < blockAwake.size(); b++) {
+                int awake = 0;
+                for (size_t i = b * SLEEP_BLOCK; i < std::min(n, (b + 1) * SLEEP_BLOCK); i++) awake += !asleep[i];
+                blockAwake[b] = awake;
+            }
+        }
+        
+        // Both keep state by index
+        sweep.invalidate();
+        ccd.invalidate();
+    }
+    
+    // Reference narrow phase: test every pair
+    template <typename Policy>
+    int collideBruteForce() {
+        PHYSICS_SIM_PROFILE_SCOPE(NarrowPhase);
+        int frameCollisions = 0;
+        for (size_t i = 0; i < balls.size(); i++) {
+            for (size_t j = i + 1; j < balls.size(); j++) {
+                if (bothAsleep<Policy>(i, j)) continue;
+                if (balls.isColliding(i, j)) {
+                    PHYSICS_SIM_PROFILE_HOT(Resolve);
+                    resolveContact<Policy>(i, j, stepMotion);
+                    frameCollisions++;
+                }
+            }
+        }
+        frameCandidates = (long long)balls.size() * ((long long)balls.size() - 1) / 2;
+        frameHits = frameCollisions;
+        return frameCollisions;
+    }
+    
+    // Grid cells for the largest contact, widened in sparse worlds
+    double gridCellSize() const {
+        return UniformGrid::cellSizeFor(2 * maxRadius, windowWidth, windowHeight, balls.size());
+    }
+    
+    // Grid narrow phase: only test pairs from neighbouring cells, in the same
+    // (i, j) order as collideBruteForce
+    template <typename Policy>
+    int collideUniformGrid() {
+        {
+            PHYSICS_SIM_PROFILE_SCOPE(BroadPhase);
+            grid.build(balls, gridCellSize(), windowWidth, windowHeight, sleepFlags());
+        }
+        
+        PHYSICS_SIM_PROFILE_SCOPE(NarrowPhase);
+        int frameCollisions = 0;
+        long long candidates = 0;
+        for (size_t i = 0; i < balls.size(); i++) {
+            if (Policy::sleeping && asleep[i] && !grid.anyAwakeAround((int)i)) continue;
+            grid.gatherNeighbours((int)i, neighbours);
+            candidates += neighbours.size();
+            for (int j : neighbours) {
+                if (bothAsleep<Policy>(i, j)) continue;
+                if (balls.isColliding(i, j)) {
+                    PHYSICS_SIM_PROFILE_HOT(Resolve);
+                    resolveContact<Policy>(i, j, stepMotion);
+                    frameCollisions++;
+                }
+            }
+        }
+        frameCandidates = candidates;
+        frameHits = frameCollisions;
+        return frameCollisions;
+    }
+    
+    // Sweep-and-prune narrow phase, also in brute-force (i, j) order
+    template <typename Policy>
+    int collideSweepAndPrune() {
+        {
+            PHYSICS_SIM_PROFILE_SCOPE(BroadPhase);
+            sweep.update(balls);
+        }
+        
+        PHYSICS_SIM_PROFILE_SCOPE(NarrowPhase);
+        int frameCollisions = 0;
+        for (int i = 0; i < (int)balls.size(); i++) {
+            for (int k = sweep.pairsBegin(i); k < sweep.pairsEnd(i); k++) {
+                int j = sweep.pairAt(k);
+                if (bothAsleep<Policy>(i, j)) continue;
+                if (balls.isColliding(i, j)) {
+                    PHYSICS_SIM_PROFILE_HOT(Resolve);
+                    resolveContact<Policy>(i, j, stepMotion);
+                    frameCollisions++;
+                }
+            }
+        }
+        frameCandidates = sweep.candidateCount();
+        frameHits = frameCollisions;
+        return frameCollisions;
+    }
+    
+    // Hierarchical grid narrow phase, the same walk as sweep and prune
+    template <typename Policy>
+    int collideHierarchicalGrid() {
+        {
+            PHYSICS_SIM_PROFILE_SCOPE(BroadPhase);
+            levels.update(balls, windowWidth, windowHeight);
+        }
+        
+        PHYSICS_SIM_PROFILE_SCOPE(NarrowPhase);
+        int frameCollisions = 0;
+        for (int i = 0; i < (int)balls.size(); i++) {
+            for (int k = levels.pairsBegin(i); k < levels.pairsEnd(i); k++) {
+                int j = levels.pairAt(k);
+                if (bothAsleep<Policy>(i, j)) continue;
+                if (balls.isColliding(i, j)) {
+                    PHYSICS_SIM_PROFILE_HOT(Resolve);
+                    resolveContact<Policy>(i, j, stepMotion);
+                    frameCollisions++;
+                }
+            }
+        }
+        frameCandidates = levels.candidateCount();
+        frameHits = frameCollisions;
+        return frameCollisions;
+    }
+    
+    // Parallel grid narrow phase.
+    //
+    // Detection: every grid row is a task that tests its balls' neighbour pairs
+    // against the positions at the start of the phase (read-only) and stores the
+    // touching ones in that row's buffer, grouped by the cell of the lower index.
+    //
+    // Resolution: cells are split into 9 colours by (x % 3, y % 3). Two cells of
+    // the same colour are at least 3 cells apart, so their 3x3 neighbourhoods -
+    // and therefore the balls their contacts touch - never overlap. Colours run
+    // one after another, the cells of a colour run concurrently, and each cell
+    // resolves its contacts in stored order. The order of updates to any one ball
+    // is fixed by the schedule alone, so the result is bit-identical for every
+    // thread count, including 1.
+    template <typename Policy>
+    int collideParallelGrid() {
+        {
+            PHYSICS_SIM_PROFILE_SCOPE(BroadPhase);
+            grid.build(balls, gridCellSize(), windowWidth, windowHeight, sleepFlags());
+        }
+        
+        const int cols = grid.getCols();
+        const int rows = grid.getRows();
+        const int workers = pool ? pool->size() : 1;
+        
+        rowWorker.resize(rows);
+        rowMotion.assign(rows, MotionStats());
+        cellContactBegin.resize((size_t)cols * rows);
+        cellContactEnd.resize((size_t)cols * rows);
+        workerContacts.resize(workers);
+        size_t lastContacts = 0;
+        for (const FrameArena<std::pair<int, int>>& contacts : workerContacts) lastContacts += contacts.size();
+        for (FrameArena<std::pair<int, int>>& contacts : workerContacts) contacts.reset(lastContacts);
+        workerNeighbours.resize(workers);
+        workerCounters.assign(workers, WorkerCounters{0, 0, 0});
+        
+        auto detectRow = [&](int cy, int worker) {
+            PHYSICS_SIM_PROFILE_SCOPE(NarrowPhase);
+            FrameArena<std::pair<int, int>>& contacts = workerContacts[worker];
+            std::vector<int>& scratch = workerNeighbours[worker];
+            rowWorker[cy] = worker;
+            
+            for (int cx = 0; cx < cols; cx++) {
+                int cell = cy * cols + cx;
+                cellContactBegin[cell] = (int)contacts.size();
+                for (int k = grid.cellBegin(cell); k < grid.cellEnd(cell); k++) {
+                    int i = grid.ballAt(k);
+                    if (Policy::sleeping && asleep[i] && !grid.anyAwakeAround(i)) continue;
+                    grid.gatherNeighbours(i, scratch);
+                    workerCounters[worker].candidates += scratch.size();
+                    for (int j : scratch) {
+                        if (!bothAsleep<Policy>(i, j) && balls.isColliding(i, j)) contacts.push({i, j});
+                    }
+                }
+                cellContactEnd[cell] = (int)contacts.size();
+                workerCounters[worker].hits += cellContactEnd[cell] - cellContactBegin[cell];
+            }
+        };
+        
+        auto resolveColour = [&](int colour, int cy, int worker) {
+            PHYSICS_SIM_PROFILE_SCOPE(Resolve);
+            const FrameArena<std::pair<int, int>>& contacts = workerContacts[rowWorker[cy]];
+            for (int cx = colour % 3; cx < cols; cx += 3) {
+                int cell = cy * cols + cx;
+                for (int c = cellContactBegin[cell]; c < cellContactEnd[cell]; c++) {
+                    // Earlier colours may already have pushed this pair apart
+                    int i = contacts[c].first;
+                    int j = contacts[c].second;
+                    if (balls.isColliding(i, j)) {
+                        resolveContact<Policy>(i, j, rowMotion[cy]);
+                        workerCounters[worker].collisions++;
+                    }
+                }
+            }
+        };
+        
+        if (pool) {
+            pool->run(rows, detectRow);
+            for (int colour = 0; colour < 9; colour++) {
+                int firstRow = colour / 3;
+                int colourRows = (rows - firstRow + 2) / 3;
+                pool->run(colourRows, [&](int task, int worker) {
+                    resolveColour(colour, firstRow + task * 3, worker);
+                });
+            }
+        } else {
+            for (int cy = 0; cy < rows; cy++) detectRow(cy, 0);
+            for (int colour = 0; colour < 9; colour++) {
+                for (int cy = colour / 3; cy < rows; cy += 3) resolveColour(colour, cy, 0);
+            }
+        }
+        
+        // Rows are summed in order, so the totals do not depend on the schedule
+        for (const MotionStats& row : rowMotion) stepMotion.add(row);
+        
+        int frameCollisions = 0;
+        frameCandidates = 0;
+        frameHits = 0;
+        for (const WorkerCounters& counters : workerCounters) {
+            frameCollisions += (int)counters.collisions;
+            frameCandidates += counters.candidates;
+            frameHits += counters.hits;
+        }
+        return frameCollisions;
+    }
+    
+    void integrateRange(double deltaTime, size_t begin, size_t end, MotionStats& walls) {
+        {
+            PHYSICS_SIM_PROFILE_SCOPE(Integrate);
+            balls.integrate(kernels, T(deltaTime), begin, end);
+        }
+        PHYSICS_SIM_PROFILE_SCOPE(WallBounce);
+        balls.bounceOffWalls(kernels, windowWidth, windowHeight, begin, end, walls);
+    }
+    
+    // Integration and wall bounce are independent per ball, so with a pool the
+    // arrays are simply cut into chunks. Wall momentum is summed per chunk and
+    // the chunks in order, with or without the pool.
+    void integrateAndBounce(double deltaTime) {
+        const size_t CHUNK = 16384;    // A multiple of SLEEP_BLOCK
+        const size_t n = balls.size();
+        const int chunks = (int)((n + CHUNK - 1) / CHUNK);
+        chunkMotion.assign(chunks, MotionStats());
+        
+        auto runChunk = [&](int task, int) {
+            size_t begin = task * CHUNK;
+            size_t end = std::min(n, begin + CHUNK);
+            if (sleepSpeed <= 0) {
+                integrateRange(deltaTime, begin, end, chunkMotion[task]);
+                return;
+            }
+            
+            // Sleeping balls are at rest, so blocks with no awake ball are skipped
+            for (size_t block = begin; block < end; block += SLEEP_BLOCK) {
+                if (blockAwake[block / SLEEP_BLOCK] == 0) continue;
+                integrateRange(deltaTime, block, std::min(end, block + SLEEP_BLOCK), chunkMotion[task]);
+            }
+        };
+        
+        if (!pool || n <= CHUNK) {
+            for (int task = 0; task < chunks; task++) runChunk(task, 0);
+        } else {
+            pool->run(chunks, runChunk);
+        }
+        for (const MotionStats& chunk : chunkMotion) stepMotion.add(chunk);
+    }
+    
+public:
+    // A seed of 0 picks a random one; with a fixed seed the initial scene and
+    // every scene produced by reset() are reproducible. verbose = false keeps
+    // the banner quiet, for runners that create many simulations at once.
+    PhysicsSimulation(int width, int height, int numberOfBalls, double minR, double maxR,
+                      BroadPhase mode = BroadPhase::UniformGrid, unsigned int seedValue = 0, bool verboseOutput = true) 
+        : windowWidth(width), windowHeight(height), collisionCount(0), stepCount(0),
+          numBalls(numberOfBalls), minRadius(minR), maxRadius(maxR), broadPhase(mode),
+          seed(seedValue != 0 ? seedValue : std::random_device()()), scene(0),
+          kernels(StepKernels<T>::detect()), continuous(false), interpolate(false),
+          motionReconciledStep(0), motionCorrection(0), sleepSpeed(0), sleepTime(0.5), sleepingCount(0),
+          reorderInterval(0), fixedMass(0), allSameMass(false), collide(nullptr), frameCandidates(0), frameHits(0),
+          recorder(nullptr), streamer(nullptr), deviceCurrent(false), hostCurrent(true), verbose(verboseOutput) {
+        initializeBalls();
+        if (!verbose) return;
+        
+        std::cout << "🔥 CUSTOMIZABLE NEON BALL PHYSICS SIMULATION INITIALIZED! 🔥" << std::endl;
+        std::cout << "Total balls: " << balls.size() << std::endl;
+        std::cout << "Ball radius range: " << minRadius << " - " << maxRadius << std::endl;
+        std::cout << "Step kernels: " << kernels.name << std::endl;
+        std::cout << "Seed: " << seed << std::endl;
+        std::cout << "Possible collision pairs: " << (balls.size() * (balls.size() - 1)) / 2 << std::endl;
+        std::cout << "LET THE NEON CHAOS BEGIN! 🌈💥" << std::endl;
+    }
+    
+    void update(double deltaTime) {
+        PHYSICS_SIM_PROFILE_SCOPE(Step);
+        auto stepStart = std::chrono::steady_clock::now();
+        
+        // The device keeps its own previous positions
+        const bool onDevice = stepsOnDevice() && pushToDevice();
+        if (!onDevice) {
+            pullFromDevice();
+            deviceCurrent = false;
+        }
+        
+        // Before the previous positions are taken, so they are in the new order too
+        if (reorderInterval > 0 && !onDevice && stepCount > 0 && stepCount % reorderInterval == 0) reorderBalls();
+        if (interpolate && !onDevice) {
+            previousX = balls.x;
+            previousY = balls.y;
+        }
+        
+        stepMotion.clear();
+        
+        int frameCollisions;
+        if (onDevice) {
+            // Everything stays on the device (see OpenCLBackend)
+            frameCollisions = stepDevice(deltaTime);
+        } else if (continuous) {
+            // Exact event-to-event motion, walls and collisions in one pass
+            frameCollisions = ccd.advance(balls, deltaTime, maxRadius, windowWidth, windowHeight, stepMotion);
+            if (frameCollisions < 0) {
+                std::cout << "❌ A ball is wider than the world, which continuous collisions cannot handle:"
+                          << " back to fixed steps" << std::endl;
+                continuous = false;
+                frameCollisions = 0;
+            }
+            frameCandidates = ccd.getPredictions();
+            frameHits = frameCollisions;
+        } else {
+            // Update all ball positions with constant velocity
+            integrateAndBounce(deltaTime);
+            
+            // Handle ball-to-ball collisions; a world that is entirely asleep has none
+            if (sleepSpeed > 0 && sleepingCount == (int)balls.size()) {
+                frameCollisions = 0;
+                frameCandidates = 0;
+                frameHits = 0;
+            } else {
+                frameCollisions = (this->*collide)();
+            }
+        }
+        if (sleepSpeed > 0 && !continuous) updateSleeping(deltaTime);
+        collisionCount += frameCollisions;
+        stepCount++;
+        
+        motion.add(stepMotion);
+        if (!onDevice && stepCount - motionReconciledStep >= MOTION_RECONCILE_INTERVAL) reconcileMotion();
+        
+        // No I/O here: a TelemetryReporter samples these from its own thread
+        long long stepNanoseconds = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - stepStart).count();
+        telemetry.publish(frameCollisions, frameCandidates, frameHits, stepNanoseconds);
+        
+        // A copy into a spare buffer; encoding and disk writes run on the recorder's thread
+        if (recorder) {
+            pullFromDevice();
+            recorder->record(balls, stepCount);
+        }
+        
+        // Only when a viewer is waiting, so at most the stream's frame rate
+        if (streamer && streamer->wantsFrame()) {
+            pullFromDevice();
+            streamer->publish(balls, stepCount, windowWidth, windowHeight);
+        }
+    }
+    
+    // Record every following step (nullptr stops); the recorder must outlive it
+    void setRecorder(TrajectoryRecorder<T>* trajectory) {
+        recorder = trajectory;
+    }
+    
+    // Serve the following steps to remote viewers (nullptr stops); the
+    // streamer must outlive it
+    void setStreamer(StateStreamer<T>* stream) {
+        streamer = stream;
+    }
+    
+    // With the OpenCL backend, as of the last device sync (syncFromDevice)
+    const BallStore<T>& getBalls() const {
+        return balls;
+    }
+    
+    int getWorldWidth() const { return windowWidth; }
+    int getWorldHeight() const { return windowHeight; }
+    
+    // Copy what the renderer needs into state: positions after the last step,
+    // positions before it (for interpolation), radii and colours
+    void captureRenderState(RenderState<T>& state) const {
+        const size_t n = balls.size();
+        if (!readDevicePositions(state)) {
+            state.x = balls.x;
+            state.y = balls.y;
+            bool hasPrevious = interpolate && previousX.size() == n;
+            state.previousX = hasPrevious ? previousX : balls.x;
+            state.previousY = hasPrevious ? previousY : balls.y;
+        }
+        state.r = balls.r;
+        state.colors.resize(n);
+        for (size_t i = 0; i < n; i++) state.colors[i] = balls.info[i].color;
+        state.step = stepCount;
+        state.time = std::chrono::steady_clock::now();
+    }
+    
+    // Keep the pre-step positions so rendering can interpolate (costs one copy
+    // of the position arrays per step)
+    void setInterpolation(bool enabled) {
+        interpolate = enabled;
+        previousX.clear();
+        previousY.clear();
+    }
+    
+    void reset() {
+        std::cout << "🔄 RESETTING NEON BALL CHAOS!" << std::endl;
+        initializeBalls();
+        previousX.clear();
+        previousY.clear();
+        std::cout << "Fresh neon chaos initiated! 🎯✨" << std::endl;
+    }
+    
+    // Tracked, so O(1); summed in double for every precision, so drift can be
+    // compared fairly
+    double getTotalEnergy() const {
+        return motion.energy;
+    }
+    
+    double getMomentumX() const { return motion.momentumX; }
+    double getMomentumY() const { return motion.momentumY; }
+    
+    // Tracked totals: energy, momentum and the speed distribution of printStats
+    const MotionStats& getMotion() const {
+        return motion;
+    }
+    
+    // Re-measure the tracked totals now. Returns the energy error the running
+    // totals had picked up since the last reconciliation.
+    double reconcileStats() {
+        pullFromDevice();
+        reconcileMotion();
+        return motionCorrection;
+    }
+    
+    // Cost per candidate pair of the narrow phase test on the current scene,
+    // the old sqrt comparison against the squared-distance test
+    void benchmarkNarrowPhase(int rounds) {
+        pullFromDevice();
+        grid.build(balls, gridCellSize(), windowWidth, windowHeight);
+        std::vector<int> listStart(balls.size() + 1, 0);
+        std::vector<int> list;
+        for (size_t i = 0; i < balls.size(); i++) {
+            grid.gatherNeighbours((int)i, neighbours);
+            list.insert(list.end(), neighbours.begin(), neighbours.end());
+            listStart[i + 1] = (int)list.size();
+        }
+        
+        auto measure = [&](const char* label, const std::function<long long()>& pass) {
+            long long hits = 0;
+            auto start = std::chrono::steady_clock::now();
+            for (int round = 0; round < rounds; round++) hits += pass();
+            double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            double pairs = (double)list.size() * rounds;
+            std::cout << "   " << label << ": " << (pairs > 0 ? seconds * 1e9 / pairs : 0) << " ns per pair ("
+                      << hits / std::max(1, rounds) << " contacts)" << std::endl;
+        };
+        
+        std::cout << "\n🎯 NARROW PHASE (" << list.size() << " candidate pairs, "
+                  << rounds << " rounds):" << std::endl;
+        measure("sqrt test", [&] {
+            long long hits = 0;
+            for (size_t i = 0; i < balls.size(); i++) {
+                for (int k = listStart[i]; k < listStart[i + 1]; k++) {
+                    int j = list[k];
+                    T dx = balls.x[i] - balls.x[j];
+                    T dy = balls.y[i] - balls.y[j];
+                    if (std::sqrt(dx * dx + dy * dy) <= balls.r[i] + balls.r[j]) hits++;
+                }
+            }
+            return hits;
+        });
+        measure("squared test", [&] {
+            long long hits = 0;
+            for (size_t i = 0; i < balls.size(); i++) {
+                for (int k = listStart[i]; k < listStart[i + 1]; k++) {
+                    if (balls.isColliding(i, list[k])) hits++;
+                }
+            }
+            return hits;
+        });
+    }
+    
+    void printStats() const {
+        std::cout << "\n📊 NEON BALL SIMULATION STATS:" << std::endl;
+        std::cout << "Number of balls: " << balls.size() << std::endl;
+        std::cout << "Ball size range: " << minRadius << " - " << maxRadius << std::endl;
+        std::cout << "Total collisions: " << collisionCount << std::endl;
+        std::cout << "Total energy: " << getTotalEnergy() << std::endl;
+        std::cout << "Total momentum: (" << motion.momentumX << ", " << motion.momentumY << ")" << std::endl;
+        std::cout << "Speed distribution - Slow(<100): " << motion.slow 
+                  << ", Medium(100-150): " << motion.medium 
+                  << ", Fast(>150): " << motion.fast << std::endl;
+        std::cout << "Totals last reconciled at step " << motionReconciledStep
+                  << " (energy correction " << motionCorrection << ")" << std::endl;
+        if (sleepSpeed > 0) {
+            std::cout << "Sleeping balls: " << sleepingCount << " (below " << sleepSpeed
+                      << " px/s for " << sleepTime << " s)" << std::endl;
+        }
+    }
+    
+    long long getCollisionCount() const {
+        return collisionCount;
+    }
+    
+    long long getStepCount() const {
+        return stepCount;
+    }
+    
+    // Serialize the full state into a snapshot image (see SnapshotHeader)
+    std::vector<char> writeSnapshot() const {
+        const size_t n = balls.size();
+        SnapshotHeader header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+        header.version = SNAPSHOT_VERSION;
+        header.scalarSize = sizeof(T);
+        header.ballCount = n;
+        header.seed = seed;
+        header.scene = scene;
+        header.width = windowWidth;
+        header.height = windowHeight;
+        header.minRadius = minRadius;
+        header.maxRadius = maxRadius;
+        header.stepCount = stepCount;
+        header.collisionCount = collisionCount;
+        
+        const std::vector<T>* arrays[] = {&balls.x, &balls.y, &balls.vx, &balls.vy,
+                                          &balls.r, &balls.m, &balls.invM};
+        uint64_t offset = sizeof(SnapshotHeader);
+        for (int a = 0; a < SnapshotHeader::ARRAYS; a++) {
+            offset = (offset + 63) & ~(uint64_t)63;
+            header.offsets[a] = offset;
+            offset += n * (a < SnapshotHeader::ARRAYS - 1 ? sizeof(T) : sizeof(BallInfo));
+        }
+        
+        std::vector<char> bytes(offset, 0);
+        memcpy(bytes.data(), &header, sizeof(header));
+        for (int a = 0; a < SnapshotHeader::ARRAYS - 1; a++) {
+            memcpy(bytes.data() + header.offsets[a], arrays[a]->data(), n * sizeof(T));
+        }
+        memcpy(bytes.data() + header.offsets[SnapshotHeader::ARRAYS - 1], balls.info.data(), n * sizeof(BallInfo));
+        return bytes;
+    }
+    
+    // Replace the state with a snapshot image, typically a mapped file. The
+    // arrays are copied straight out of the image; a snapshot of the other
+    // precision is converted. Returns false (state unchanged) if it is invalid.
+    bool readSnapshot(const char* data, size_t size) {
+        const SnapshotHeader* header = checkSnapshot(data, size);
+        if (!header) return false;
+        
+        const size_t n = header->ballCount;
+        std::vector<T>* arrays[] = {&balls.x, &balls.y, &balls.vx, &balls.vy,
+                                    &balls.r, &balls.m, &balls.invM};
+        for (int a = 0; a < SnapshotHeader::ARRAYS - 1; a++) {
+            readSnapshotArray(*arrays[a], data + header->offsets[a], n, header->scalarSize);
+        }
+        balls.info.resize(n);
+        memcpy(balls.info.data(), data + header->offsets[SnapshotHeader::ARRAYS - 1], n * sizeof(BallInfo));
+        
+        numBalls = (int)n;
+        seed = header->seed;
+        scene = header->scene;
+        windowWidth = header->width;
+        windowHeight = header->height;
+        minRadius = header->minRadius;
+        maxRadius = header->maxRadius;
+        stepCount = header->stepCount;
+        collisionCount = header->collisionCount;
+        
+        // Everything derived from the old balls has to be rebuilt
+        telemetry.clear();
+        ccd.invalidate();
+        sweep.invalidate();
+        previousX.clear();
+        previousY.clear();
+        reconcileMotion();
+        motionCorrection = 0;
+        wakeAll();
+        detectUniformMass();
+        deviceCurrent = false;
+        hostCurrent = true;
+        return true;
+    }
+    
+    unsigned int getSeed() const {
+        return seed;
+    }
+    
+    int getBallCount() const {
+        return (int)balls.size();
+    }
+    
+    // Safe to call from any thread
+    TelemetrySample getTelemetry() const {
+        return telemetry.sample();
+    }
+    
+    BroadPhase getBroadPhase() const {
+        return broadPhase;
+    }
+    
+    void setBroadPhase(BroadPhase mode) {
+        broadPhase = mode;
+        selectCollide();
+    }
+    
+    // Event-driven continuous collision detection: exact times of impact, no
+    // tunnelling and no overlap push-out, so much larger timesteps are usable
+    void setContinuousCollisions(bool enabled) {
+        continuous = enabled;
+        ccd.invalidate();
+        wakeAll();
+    }
+    
+    bool getContinuousCollisions() const {
+        return continuous;
+    }
+    
+    // Opt-in sleeping for damped or dense scenes where most balls come to
+    // rest: a ball slower than speed (px/s) for seconds is stopped and skipped
+    // until a contact wakes it. Speed 0 (the default) turns it off; it is not
+    // used with continuous collisions. Every ball starts awake.
+    void setSleeping(double speed, double seconds) {
+        sleepSpeed = std::max(0.0, speed);
+        sleepTime = std::max(0.0, seconds);
+        wakeAll();
+        selectCollide();
+    }
+    
+    double getSleepSpeed() const {
+        return sleepSpeed;
+    }
+    
+    int getSleepingCount() const {
+        return sleepingCount;
+    }
+    
+    // Re-sort the ball storage into Morton order every `steps` steps (0, the
+    // default, never does). Long runs scatter neighbouring balls across the
+    // arrays; this keeps the broad and narrow phase walking memory in order.
+    // Ball ids are stable, and recordings are written in id order. Not done
+    // while the step runs on the OpenCL device.
+    void setReorderInterval(int steps) {
+        reorderInterval = std::max(0, steps);
+    }
+    
+    int getReorderInterval() const {
+        return reorderInterval;
+    }
+    
+    // Give every ball the same mass, now and in every scene reset() makes;
+    // the collision loops then use the uniform-mass constants. 0 (the default)
+    // goes back to masses drawn from [0.5, 1.5) from the next scene on.
+    void setUniformMass(double mass) {
+        fixedMass = std::max(0.0, mass);
+        if (fixedMass <= 0) return;
+        
+        pullFromDevice();
+        for (size_t i = 0; i < balls.size(); i++) {
+            balls.m[i] = T(fixedMass);
+            balls.invM[i] = T(1) / T(fixedMass);
+        }
+        reconcileMotion();
+        motionCorrection = 0;
+        ccd.invalidate();
+        detectUniformMass();
+        deviceCurrent = false;
+    }
+    
+    // Whether the balls all weigh the same, generated that way or not
+    bool getUniformMass() const {
+        return allSameMass;
+    }
+    
+    // Run the step on an OpenCL device: the balls stay resident there and the
+    // renderer maps their positions, so host copies are only made on request.
+    // Returns false if the backend is not built in or no usable device was
+    // found. CCD and sleeping still step on the CPU. getBalls, printStats,
+    // getTotalEnergy and writeSnapshot see the state as of the last
+    // syncFromDevice(); reconcileStats syncs by itself.
+    bool setGpuEnabled(bool enabled) {
+#ifdef PHYSICS_SIM_OPENCL
+        if (!enabled || gpu) {
+            if (!enabled) {
+                pullFromDevice();
+                gpu.reset();
+            }
+            return true;
+        }
+        gpu.reset(new OpenCLBackend<T>());
+        deviceCurrent = false;
+        if (!gpu->open() || !pushToDevice()) {
+            gpu.reset();
+            return false;
+        }
+        std::cout << "🖥️  OpenCL device: " << gpu->getDeviceName() << std::endl;
+        return true;
+#else
+        if (enabled) std::cout << "❌ Built without the OpenCL backend (PHYSICS_SIM_OPENCL)" << std::endl;
+        return !enabled;
+#endif
+    }
+    
+    bool getGpuEnabled() const {
+#ifdef PHYSICS_SIM_OPENCL
+        return gpu != nullptr;
+#else
+        return false;
+#endif
+    }
+    
+    std::string getGpuDevice() const {
+#ifdef PHYSICS_SIM_OPENCL
+        if (gpu) return gpu->getDeviceName();
+#endif
+        return std::string();
+    }
+    
+    // Refresh the host copy of the balls and the tracked totals after
+    // device steps (a no-op otherwise)
+    void syncFromDevice() {
+        pullFromDevice();
+    }
+    
+    // Number of threads used by the parallel passes (1 = run on the calling thread)
+    void setThreadCount(int threads) {
+        if (threads <= 1) {
+            pool.reset();
+        } else if (!pool || pool->size() != threads) {
+            pool.reset(new ThreadPool(threads));
+        }
+    }
+    
+    int getThreadCount() const {
+        return pool ? pool->size() : 1;
+    }
+    
+    const char* getKernelName() const {
+        return kernels.name;
+    }
+    
+    // Switch between the vectorized step kernels and the scalar fallback
+    void setSimdEnabled(bool enabled) {
+        kernels = StepKernels<T>::detect(enabled);
+    }
+};
+
+// Domain decomposition: the world cut into horizontal slabs of grid rows, one
+// per rank, for populations too large for one process.
+//
+// Ranks share no memory. Everything a rank needs from the others arrives as
+// messages (small BallStores) that a DomainMailbox delivers between phases:
+// the balls that crossed into its slab, copies ("ghosts") of the neighbours'
+// boundary rows, and during the collision phase the ghost updates in both
+// directions. Here every rank runs in this process, one thread each; a cluster
+// build would deliver the same messages over MPI or sockets, one rank per
+// process, with the driver's few global sums done as reductions.
+//
+// Each rank keeps its balls in id order and replays the parallel grid's
+// schedule on its own cells, syncing the halo after every colour, so a run is
+// bit-identical to a single PhysicsSimulation with BroadPhase::ParallelGrid
+// (without sleeping or CCD) for every rank and thread count.
+template <typename T>
+class DomainMailbox {
+private:
+    int ranks;
+    std::vector<BallStore<T>> outbox;   // [from * ranks + to]
+    std::vector<BallStore<T>> inbox;    // [to * ranks + from]
+    
+public:
+    explicit DomainMailbox(int rankCount)
+        : ranks(rankCount), outbox(rankCount * rankCount), inbox(rankCount * rankCount) {}
+    
+    BallStore<T>& to(int from, int to) {
+        return outbox[from * ranks + to];
+    }
+    
+    const BallStore<T>& from(int to, int from) const {
+        return inbox[to * ranks + from];
+    }
+    
+    // Deliver every posted message and leave the outboxes empty, with room
+    // for the next message on the same channel. A channel carries migrants
+    // and ghost rows in turn, so both of its buffers keep the larger size.
+    void exchange() {
+        for (int from = 0; from < ranks; from++) {
+            for (int to = 0; to < ranks; to++) {
+                BallStore<T>& sent = outbox[from * ranks + to];
+                BallStore<T>& delivered = inbox[to * ranks + from];
+                std::swap(delivered, sent);
+                sent.clear();
+                sent.reserveWithHeadroom(delivered.size());
+                if (sent.capacity() < delivered.capacity()) sent.reserve(delivered.capacity());
+            }
+        }
+    }
+};
+
+// One slab of a DomainDecomposition: the balls of world rows [rowBegin,
+// rowEnd), and during a step also the ghosts of the row above and below
+template <typename T>
+class DomainRank {
+private:
+    enum Origin : uint8_t { OWNED, FROM_ABOVE, FROM_BELOW };
+    
+    int rank;
+    int rankCount;
+    int rowBegin;
+    int rowEnd;
+    double cellSize;
+    int worldWidth;
+    int worldHeight;
+    int worldRows;
+    
+    BallStore<T> balls;                 // Ascending id; owned balls only between steps
+    BallStore<T> scratch;
+    BallStore<T> incoming;
+    std::vector<uint8_t> origin;        // Per local ball while ghosts are present
+    int ghostCount;
+    std::vector<int> haloSent[2];       // Owned balls copied to rank - 1 / rank + 1, in message order
+    std::vector<int> ghostIndex[2];     // Ghosts from rank - 1 / rank + 1, in message order
+    std::vector<uint8_t> touched;
+    std::vector<int> touchedGhosts;
+    
+    UniformGrid grid;
+    FrameArena<std::pair<int, int>> contacts;   // Touching pairs, cells in row order
+    std::vector<int> cellContactBegin;
+    std::vector<int> cellContactEnd;
+    std::vector<int> neighbours;
+    std::vector<int> arrivalOrder;
+    
+    int rowOf(size_t i) const {
+        return UniformGrid::coordinate(balls.y[i], cellSize, worldRows);
+    }
+    
+    static int ownerOf(const std::vector<int>& rowStart, int row) {
+        return (int)(std::upper_bound(rowStart.begin(), rowStart.end(), row) - rowStart.begin()) - 1;
+    }
+    
+    // Local index of the ball with this id (balls are in id order)
+    int find(int id) const {
+        auto it = std::lower_bound(balls.info.begin(), balls.info.end(), id,
+                                   [](const BallInfo& info, int value) { return info.id < value; });
+        return (int)(it - balls.info.begin());
+    }
+    
+    static void copyState(BallStore<T>& to, size_t i, const BallStore<T>& from, size_t k) {
+        to.x[i] = from.x[k];
+        to.y[i] = from.y[k];
+        to.vx[i] = from.vx[k];
+        to.vy[i] = from.vy[k];
+    }
+    
+public:
+    DomainRank(int index, int ranks, double size, int width, int height)
+        : rank(index), rankCount(ranks), rowBegin(0), rowEnd(0), cellSize(size),
+          worldWidth(width), worldHeight(height), worldRows(UniformGrid::rowCount(size, height)),
+          ghostCount(0) {}
+    
+    const BallStore<T>& getBalls() const {
+        return balls;
+    }
+    
+    // Owned balls (ghosts excluded)
+    size_t size() const {
+        return balls.size() - ghostCount;
+    }
+    
+    bool owns(size_t i) const {
+        return ghostCount == 0 || origin[i] == OWNED;
+    }
+    
+    // Initial population, in id order
+    void assign(const BallStore<T>& all, const std::vector<int>& rowStart) {
+        rowBegin = rowStart[rank];
+        rowEnd = rowStart[rank + 1];
+        balls.clear();
+        for (size_t i = 0; i < all.size(); i++) {
+            int row = UniformGrid::coordinate(all.y[i], cellSize, worldRows);
+            if (row >= rowBegin && row < rowEnd) balls.append(all, i);
+        }
+        ghostCount = 0;
+        
+        // The buffers refilled every step start with room for twice the
+        // slab, so drift between rebalances does not reallocate them
+        scratch.reserveWithHeadroom(balls.size());
+        balls.reserveWithHeadroom(balls.size());
+        origin.reserve(2 * balls.size());
+        touched.reserve(2 * balls.size());
+    }
+    
+    // Owned balls per world row, added into population
+    void countRows(std::vector<long long>& population) const {
+        for (size_t i = 0; i < balls.size(); i++) {
+            if (owns(i)) population[rowOf(i)]++;
+        }
+    }
+    
+    // Phase 1: move, then post every ball that left the slab (possibly after
+    // a rebalance moved the slab) to its new owner and drop last step's ghosts
+    void integrate(const StepKernels<T>& kernels, double deltaTime, const std::vector<int>& rowStart,
+                   DomainMailbox<T>& mailbox) {
+        rowBegin = rowStart[rank];
+        rowEnd = rowStart[rank + 1];
+        
+        // Ghosts are moved too, which is cheaper than skipping them; they are dropped below.
+        // Wall momentum is not tracked here: totals are measured from the balls.
+        MotionStats walls;
+        {
+            PHYSICS_SIM_PROFILE_SCOPE(Integrate);
+            balls.integrate(kernels, T(deltaTime), 0, balls.size());
+        }
+        {
+            PHYSICS_SIM_PROFILE_SCOPE(WallBounce);
+            balls.bounceOffWalls(kernels, worldWidth, worldHeight, 0, balls.size(), walls);
+        }
+        
+        scratch.clear();
+        scratch.reserveWithHeadroom(balls.size());
+        for (size_t i = 0; i < balls.size(); i++) {
+            if (!owns(i)) continue;
+            int row = rowOf(i);
+            if (row >= rowBegin && row < rowEnd) {
+                scratch.append(balls, i);
+            } else {
+                mailbox.to(rank, ownerOf(rowStart, row)).append(balls, i);
+            }
+        }
+        std::swap(balls, scratch);
+        ghostCount = 0;
+    }
+    
+    // Phase 2: merge in the arrivals, then post the first and last row to the
+    // neighbours as their ghosts
+    void receiveMigrants(DomainMailbox<T>& mailbox) {
+        incoming.clear();
+        size_t arriving = 0;
+        for (int from = 0; from < rankCount; from++) arriving += mailbox.from(rank, from).size();
+        incoming.reserveWithHeadroom(arriving);
+        for (int from = 0; from < rankCount; from++) {
+            const BallStore<T>& arrivals = mailbox.from(rank, from);
+            for (size_t k = 0; k < arrivals.size(); k++) incoming.append(arrivals, k);
+        }
+        
+        if (incoming.size() > 0) {
+            std::vector<int>& order = arrivalOrder;
+            order.resize(incoming.size());
+            for (size_t k = 0; k < order.size(); k++) order[k] = (int)k;
+            std::sort(order.begin(), order.end(), [&](int a, int b) {
+                return incoming.info[a].id < incoming.info[b].id;
+            });
+            
+            scratch.clear();
+            scratch.reserveWithHeadroom(balls.size() + incoming.size());
+            size_t i = 0;
+            for (int k : order) {
+                while (i < balls.size() && balls.info[i].id < incoming.info[k].id) scratch.append(balls, i++);
+                scratch.append(incoming, k);
+            }
+            while (i < balls.size()) scratch.append(balls, i++);
+            std::swap(balls, scratch);
+        }
+        
+        for (size_t i = 0; i < balls.size(); i++) {
+            int row = rowOf(i);
+            if (row == rowBegin && rank > 0) mailbox.to(rank, rank - 1).append(balls, i);
+            if (row == rowEnd - 1 && rank + 1 < rankCount) mailbox.to(rank, rank + 1).append(balls, i);
+        }
+    }
+    
+    // Phase 3: merge the ghosts in (id order again), build the grid over the
+    // slab plus its halo rows and store the touching pairs of the owned cells
+    // exactly as collideParallelGrid's detection does. Returns the candidates.
+    long long detect(const DomainMailbox<T>& mailbox) {
+        static const BallStore<T> none;
+        const BallStore<T>& above = rank > 0 ? mailbox.from(rank, rank - 1) : none;
+        const BallStore<T>& below = rank + 1 < rankCount ? mailbox.from(rank, rank + 1) : none;
+        
+        const size_t owned = balls.size();
+        scratch.clear();
+        scratch.reserveWithHeadroom(owned + above.size() + below.size());
+        origin.clear();
+        size_t i = 0, a = 0, b = 0;
+        for (int side = 0; side < 2; side++) {
+            ghostIndex[side].clear();
+            haloSent[side].clear();
+        }
+        while (i < owned || a < above.size() || b < below.size()) {
+            int idI = i < owned ? balls.info[i].id : INT32_MAX;
+            int idA = a < above.size() ? above.info[a].id : INT32_MAX;
+            int idB = b < below.size() ? below.info[b].id : INT32_MAX;
+            if (idI <= idA && idI <= idB) {
+                scratch.append(balls, i++);
+                origin.push_back(OWNED);
+            } else if (idA <= idB) {
+                ghostIndex[0].push_back((int)scratch.size());
+                scratch.append(above, a++);
+                origin.push_back(FROM_ABOVE);
+            } else {
+                ghostIndex[1].push_back((int)scratch.size());
+                scratch.append(below, b++);
+                origin.push_back(FROM_BELOW);
+            }
+        }
+        std::swap(balls, scratch);
+        ghostCount = (int)(above.size() + below.size());
+        
+        // The same walk as receiveMigrants, so the order matches the messages
+        for (size_t k = 0; k < balls.size(); k++) {
+            if (origin[k] != OWNED) continue;
+            int row = rowOf(k);
+            if (row == rowBegin && rank > 0) haloSent[0].push_back((int)k);
+            if (row == rowEnd - 1 && rank + 1 < rankCount) haloSent[1].push_back((int)k);
+        }
+        
+        int first = std::max(0, rowBegin - 1);
+        int last = std::min(worldRows, rowEnd + 1);
+        {
+            PHYSICS_SIM_PROFILE_SCOPE(BroadPhase);
+            grid.buildRows(balls, cellSize, worldWidth, worldHeight, first, last - first);
+        }
+        
+        PHYSICS_SIM_PROFILE_SCOPE(NarrowPhase);
+        const int cols = grid.getCols();
+        contacts.reset();
+        cellContactBegin.resize(cols * grid.getRows());
+        cellContactEnd.resize(cols * grid.getRows());
+        touched.assign(balls.size(), 0);
+        
+        long long candidates = 0;
+        for (int row = rowBegin; row < rowEnd; row++) {
+            for (int cx = 0; cx < cols; cx++) {
+                int cell = (row - first) * cols + cx;
+                cellContactBegin[cell] = (int)contacts.size();
+                for (int k = grid.cellBegin(cell); k < grid.cellEnd(cell); k++) {
+                    int p = grid.ballAt(k);
+                    grid.gatherNeighbours(p, neighbours);
+                    candidates += neighbours.size();
+                    for (int q : neighbours) {
+                        if (balls.isColliding(p, q)) contacts.push({p, q});
+                    }
+                }
+                cellContactEnd[cell] = (int)contacts.size();
+            }
+        }
+        return candidates;
+    }
+    
+    // Phase 4, once per colour: resolve the owned cells of the colour (see
+    // collideParallelGrid) and post every ghost that changed back to its
+    // owner. Returns the collisions.
+    int resolveColour(int colour, DomainMailbox<T>& mailbox) {
+        PHYSICS_SIM_PROFILE_SCOPE(Resolve);
+        const int cols = grid.getCols();
+        const int first = grid.getFirstRow();
+        int collisions = 0;
+        touchedGhosts.clear();
+        
+        for (int row = rowBegin; row < rowEnd; row++) {
+            if (row % 3 != colour / 3) continue;
+            for (int cx = colour % 3; cx < cols; cx += 3) {
+                int cell = (row - first) * cols + cx;
+                for (int c = cellContactBegin[cell]; c < cellContactEnd[cell]; c++) {
+                    int p = contacts[c].first;
+                    int q = contacts[c].second;
+                    if (!balls.isColliding(p, q)) continue;
+                    balls.resolveCollision(p, q);
+                    collisions++;
+                    for (int ball : {p, q}) {
+                        if (origin[ball] != OWNED && !touched[ball]) {
+                            touched[ball] = 1;
+                            touchedGhosts.push_back(ball);
+                        }
+                    }
+                }
+            }
+        }
+        
+        for (int ball : touchedGhosts) {
+            touched[ball] = 0;
+            mailbox.to(rank, origin[ball] == FROM_ABOVE ? rank - 1 : rank + 1).append(balls, ball);
+        }
+        return collisions;
+    }
+    
+    // Phase 5: apply the neighbours' changes to owned balls, then send the
+    // current halo rows back out so every ghost is up to date
+    void applyWriteBacks(DomainMailbox<T>& mailbox) {
+        for (int from : {rank - 1, rank + 1}) {
+            if (from < 0 || from >= rankCount) continue;
+            const BallStore<T>& changes = mailbox.from(rank, from);
+            for (size_t k = 0; k < changes.size(); k++) {
+                copyState(balls, find(changes.info[k].id), changes, k);
+            }
+        }
+        
+        for (int side = 0; side < 2; side++) {
+            int to = side == 0 ? rank - 1 : rank + 1;
+            if (to < 0 || to >= rankCount) continue;
+            BallStore<T>& refresh = mailbox.to(rank, to);
+            for (int k : haloSent[side]) refresh.append(balls, k);
+        }
+    }
+    
+    // Phase 6: overwrite the ghosts with their owners' state
+    void applyRefresh(const DomainMailbox<T>& mailbox) {
+        for (int side = 0; side < 2; side++) {
+            int from = side == 0 ? rank - 1 : rank + 1;
+            if (from < 0 || from >= rankCount) continue;
+            const BallStore<T>& refresh = mailbox.from(rank, from);
+            for (size_t k = 0; k < refresh.size(); k++) copyState(balls, ghostIndex[side][k], refresh, k);
+        }
+    }
+};
+
+// Driver of a decomposed run: the ranks, their slab boundaries and the
+// mailbox, stepped phase by phase with every rank running each phase
+// concurrently. Slabs are rebalanced by population every
+// REBALANCE_INTERVAL steps.
+template <typename T>
+class DomainDecomposition {
+private:
+    static const int REBALANCE_INTERVAL = 32;
+    
+    int worldWidth;
+    int worldHeight;
+    double cellSize;
+    int worldRows;
+    int numBalls;
+    unsigned int seed;
+    long long collisionCount;
+    long long stepCount;
+    long long frameCandidates;
+    StepKernels<T> kernels;
+    std::vector<DomainRank<T>> ranks;
+    std::vector<int> rowStart;          // Rank r owns rows [rowStart[r], rowStart[r + 1])
+    DomainMailbox<T> mailbox;
+    std::unique_ptr<ThreadPool> pool;
+    std::vector<long long> rankCollisions;
+    std::vector<long long> rankCandidates;
+    std::vector<long long> rowPopulation;
+    
+    template <typename Fn>
+    void forEachRank(const Fn& fn) {
+        if (pool) {
+            pool->run((int)ranks.size(), [&](int task, int) { fn(task); });
+        } else {
+            for (int r = 0; r < (int)ranks.size(); r++) fn(r);
+        }
+    }
+    
+    // Cut rows so every slab holds about the same number of balls, at least
+    // one row each
+    void partition(const std::vector<long long>& population) {
+        const int count = (int)ranks.size();
+        long long total = 0;
+        for (long long p : population) total += p;
+        
+        rowStart.assign(count + 1, worldRows);
+        rowStart[0] = 0;
+        long long running = 0;
+        int row = 0;
+        for (int r = 1; r < count; r++) {
+            long long target = total * r / count;
+            while (row < worldRows - (count - r) && (running < target || row < rowStart[r - 1] + 1)) {
+                running += population[row++];
+            }
+            rowStart[r] = row;
+        }
+    }
+    
+    void rebalance() {
+        rowPopulation.assign(worldRows, 0);
+        forEachRank([&](int r) { ranks[r].countRows(rowPopulation); });
+        partition(rowPopulation);
+    }
+    
+public:
+    // The scene is the one PhysicsSimulation would generate for the same
+    // arguments (mass as in setUniformMass). ranks is capped at the number of
+    // grid rows.
+    DomainDecomposition(int width, int height, int numberOfBalls, double minRadius, double maxRadius,
+                        int rankCount, unsigned int seedValue = 0, int threads = 1, double mass = 0)
+        : worldWidth(width), worldHeight(height),
+          cellSize(UniformGrid::cellSizeFor(2 * maxRadius, width, height, std::max(0, numberOfBalls))),
+          worldRows(UniformGrid::rowCount(cellSize, height)), numBalls(numberOfBalls),
+          seed(seedValue != 0 ? seedValue : std::random_device()()), collisionCount(0), stepCount(0),
+          frameCandidates(0), kernels(StepKernels<T>::detect()),
+          mailbox(std::max(1, std::min(rankCount, worldRows))) {
+        const int count = std::max(1, std::min(rankCount, worldRows));
+        for (int r = 0; r < count; r++) ranks.emplace_back(r, count, cellSize, width, height);
+        if (threads > 1) pool.reset(new ThreadPool(std::min(threads, count)));
+        
+        BallStore<T> all;
+        all.resize(numBalls);
+        SceneGenerator(seed, 0, numBalls, minRadius, maxRadius, width, height, mass).fill(all, 0, numBalls);
+        
+        std::vector<long long> population(worldRows, 0);
+        for (size_t i = 0; i < all.size(); i++) {
+            population[UniformGrid::coordinate(all.y[i], cellSize, worldRows)]++;
+        }
+        partition(population);
+        forEachRank([&](int r) { ranks[r].assign(all, rowStart); });
+        
+        std::cout << "🧩 DOMAIN DECOMPOSITION: " << numBalls << " balls in " << count << " slabs of "
+                  << worldRows << " grid rows" << std::endl;
+        std::cout << "Step kernels: " << kernels.name << std::endl;
+        std::cout << "Seed: " << seed << std::endl;
+    }
+    
+    void update(double deltaTime) {
+        PHYSICS_SIM_PROFILE_SCOPE(Step);
+        if (stepCount > 0 && stepCount % REBALANCE_INTERVAL == 0) rebalance();
+        
+        forEachRank([&](int r) { ranks[r].integrate(kernels, deltaTime, rowStart, mailbox); });
+        mailbox.exchange();
+        forEachRank([&](int r) { ranks[r].receiveMigrants(mailbox); });
+        mailbox.exchange();
+        
+        rankCandidates.assign(ranks.size(), 0);
+        rankCollisions.assign(ranks.size(), 0);
+        forEachRank([&](int r) { rankCandidates[r] = ranks[r].detect(mailbox); });
+        for (int colour = 0; colour < 9; colour++) {
+            forEachRank([&](int r) { rankCollisions[r] += ranks[r].resolveColour(colour, mailbox); });
+            mailbox.exchange();
+            forEachRank([&](int r) { ranks[r].applyWriteBacks(mailbox); });
+            mailbox.exchange();
+            forEachRank([&](int r) { ranks[r].applyRefresh(mailbox); });
+        }
+        
+        frameCandidates = 0;
+        for (size_t r = 0; r < ranks.size(); r++) {
+            collisionCount += rankCollisions[r];
+            frameCandidates += rankCandidates[r];
+        }
+        stepCount++;
+    }
+    
+    // Every ball back in one store, in id order (the single-node index order)
+    void gather(BallStore<T>& out) const {
+        out.resize(numBalls);
+        for (const DomainRank<T>& rank : ranks) {
+            const BallStore<T>& local = rank.getBalls();
+            for (size_t i = 0; i < local.size(); i++) {
+                if (!rank.owns(i)) continue;
+                size_t slot = local.info[i].id - 1;
+                out.x[slot] = local.x[i];
+                out.y[slot] = local.y[i];
+                out.vx[slot] = local.vx[i];
+                out.vy[slot] = local.vy[i];
+                out.r[slot] = local.r[i];
+                out.m[slot] = local.m[i];
+                out.invM[slot] = local.invM[i];
+                out.info[slot] = local.info[i];
+            }
+        }
+    }
+    
+    // Totals measured in ball order, so they compare exactly with
+    // PhysicsSimulation::reconcileStats
+    MotionStats measureMotion() const {
+        BallStore<T> all;
+        gather(all);
+        MotionStats measured;
+        for (size_t i = 0; i < all.size(); i++) measured.addBall(all.m[i], all.vx[i], all.vy[i]);
+        return measured;
+    }
+    
+    std::vector<size_t> getPopulations() const {
+        std::vector<size_t> populations;
+        for (const DomainRank<T>& rank : ranks) populations.push_back(rank.size());
+        return populations;
+    }
+    
+    int getRankCount() const { return (int)ranks.size(); }
+    int getBallCount() const { return numBalls; }
+    int getThreadCount() const { return pool ? pool->size() : 1; }
+    long long getCollisionCount() const { return collisionCount; }
+    long long getStepCount() const { return stepCount; }
+    long long getCandidates() const { return frameCandidates; }
+    unsigned int getSeed() const { return seed; }
+    const char* getKernelName() const { return kernels.name; }
+};
+
+// Background thread that prints a telemetry line at a fixed interval. The
+// physics thread only publishes counters, so logging never stalls a step.
+template <typename Simulation>
+class TelemetryReporter {
+private:
+    const Simulation& simulation;
+    double interval;
+    std::thread thread;
+    std::mutex mutex;
+    std::condition_variable stopSignal;
+    bool stopping;
+    
+    void run() {
+        TelemetrySample last = simulation.getTelemetry();
+        auto lastTime = std::chrono::steady_clock::now();
+        
+        std::unique_lock<std::mutex> lock(mutex);
+        while (!stopSignal.wait_for(lock, std::chrono::duration<double>(interval), [&] { return stopping; })) {
+            TelemetrySample now = simulation.getTelemetry();
+            auto nowTime = std::chrono::steady_clock::now();
+            double seconds = std::chrono::duration<double>(nowTime - lastTime).count();
+            
+            // A reset() in between restarts the counters
+            long long steps = now.steps >= last.steps ? now.steps - last.steps : now.steps;
+            long long collisions = now.totalCollisions >= last.totalCollisions
+                ? now.totalCollisions - last.totalCollisions : now.totalCollisions;
+            
+            std::cout << "📡 " << steps / seconds << " steps/s | "
+                      << collisions / seconds << " collisions/s | last step: "
+                      << now.frameCollisions << " collisions, "
+                      << now.broadPhaseCandidates << " candidates, "
+                      << now.narrowPhaseHits << " hits, "
+                      << now.stepNanoseconds / 1e6 << " ms" << std::endl;
+            
+            last = now;
+            lastTime = nowTime;
+        }
+    }
+    
+public:
+    TelemetryReporter(const Simulation& sim, double intervalSeconds)
+        : simulation(sim), interval(intervalSeconds), stopping(false) {
+        if (interval > 0) thread = std::thread(&TelemetryReporter::run, this);
+    }
+    
+    ~TelemetryReporter() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        stopSignal.notify_one();
+        if (thread.joinable()) thread.join();
+    }
+    
+    TelemetryReporter(const TelemetryReporter&) = delete;
+    TelemetryReporter& operator=(const TelemetryReporter&) = delete;
+};
+
+// Window (and world) size used for a given number of balls
+inline void worldSizeForBalls(int numberOfBalls, int& width, int& height) {
+    width = std::max(800, (int)(400 + sqrt(numberOfBalls) * 60));
+    height = std::max(600, (int)(300 + sqrt(numberOfBalls) * 45));
+    
+    // Cap window size for very large numbers
+    width = std::min(width, 1920);
+    height = std::min(height, 1080);
+}
+
+template <typename T>
+const char* precisionName() {
+    return sizeof(T) == sizeof(float) ? "float" : "double";
+}
+
+#endif // PHYSICS_SIM_H